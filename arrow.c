@@ -0,0 +1,689 @@
+/* Arrow output, for --format=arrow: an Arrow IPC stream, for analytics
+ * pipelines to ingest without parsing.
+ *
+ * The stream has a schema, then record batches of readings, one row per
+ * sensor reading:
+ *
+ *	path		dictionary<int32, utf8>
+ *	value		float64, with the scale applied; null if the
+ *			sensor couldn't be read
+ *	raw		int64, the unscaled integer for 'x' sensors; null
+ *			for others
+ *	lower_crit, upper_crit, lower_warn, upper_warn
+ *			bool
+ *	timestamp	timestamp[ms, UTC], of the reading
+ *
+ * Paths are sent in dictionary batches ahead of the record batches that
+ * use them: all of the paths seen so far before the first batch, and
+ * deltas with any new ones before later batches.
+ *
+ * The IPC metadata is flatbuffers, which we build by hand: the schema is
+ * fixed, and only a handful of tables are needed. The builder works
+ * front to back, placing each child after its parent, so an offset is
+ * always patched in once its target has a position. Metadata is little-
+ * endian, as flatbuffers require; the column data is in host order, and
+ * the schema says which that is.
+ *
+ * As with the other formatters, these return the full length of the
+ * message, and only write it if it fits in len bytes.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensor-query.h"
+
+/* room for the largest message's metadata: the schema */
+#define FB_MAX			2048
+
+#define ARROW_CONTINUATION	0xffffffffu
+#define ARROW_METADATA_V5	4
+
+/* Message header union types */
+#define ARROW_SCHEMA		1
+#define ARROW_DICTIONARY_BATCH	2
+#define ARROW_RECORD_BATCH	3
+
+/* Type union types */
+#define ARROW_TYPE_INT		2
+#define ARROW_TYPE_FLOAT	3
+#define ARROW_TYPE_UTF8		5
+#define ARROW_TYPE_BOOL		6
+#define ARROW_TYPE_TIMESTAMP	10
+
+#define ARROW_PRECISION_DOUBLE	2
+#define ARROW_UNIT_MS		1
+
+#define ARROW_PATH_DICT_ID	0
+
+enum arrow_column {
+	COL_PATH,
+	COL_VALUE,
+	COL_RAW,
+	COL_LOWER_CRIT,
+	COL_UPPER_CRIT,
+	COL_LOWER_WARN,
+	COL_UPPER_WARN,
+	COL_TIMESTAMP,
+	N_COLUMNS,
+};
+
+/* in enum arrow_column order */
+static const struct arrow_field {
+	const char	*name;
+	uint8_t		type;
+	bool		nullable;
+} fields[N_COLUMNS] = {
+	{ "path",	ARROW_TYPE_UTF8,	false },
+	{ "value",	ARROW_TYPE_FLOAT,	true },
+	{ "raw",	ARROW_TYPE_INT,		true },
+	{ "lower_crit",	ARROW_TYPE_BOOL,	false },
+	{ "upper_crit",	ARROW_TYPE_BOOL,	false },
+	{ "lower_warn",	ARROW_TYPE_BOOL,	false },
+	{ "upper_warn",	ARROW_TYPE_BOOL,	false },
+	{ "timestamp",	ARROW_TYPE_TIMESTAMP,	false },
+};
+
+/* the batch's bitmaps: validity for the nullable columns, and the data
+ * of the bool ones */
+enum arrow_bitmap {
+	BITS_VALUE_VALID,
+	BITS_RAW_VALID,
+	BITS_LOWER_CRIT,
+	BITS_UPPER_CRIT,
+	BITS_LOWER_WARN,
+	BITS_UPPER_WARN,
+	N_BITMAPS,
+};
+
+struct arrow_batch {
+	unsigned int	n;
+	unsigned int	alloc;
+	int32_t		*path;
+	double		*value;
+	int64_t		*raw;
+	int64_t		*timestamp;
+	uint8_t		*bits[N_BITMAPS];
+	unsigned int	n_null_value;
+	unsigned int	n_null_raw;
+};
+
+struct fb {
+	uint8_t	buf[FB_MAX];
+	size_t	len;
+	bool	overflow;
+};
+
+/* a table, and the offset of each of its fields within it */
+struct fb_table {
+	size_t		pos;
+	uint16_t	off[8];
+};
+
+struct fb_node {
+	int64_t		length;
+	int64_t		null_count;
+};
+
+/* Allocate size bytes, zeroed, at a position where pos + skew is aligned
+ * to align: a vector's elements follow its 4-byte length, so for those,
+ * skew is 4.
+ */
+static size_t fb_alloc(struct fb *fb, size_t size, size_t align, size_t skew)
+{
+	size_t pos = fb->len;
+
+	while ((pos + skew) & (align - 1))
+		pos++;
+
+	if (pos + size > sizeof(fb->buf)) {
+		fb->overflow = true;
+		return 0;
+	}
+
+	memset(fb->buf + fb->len, 0, pos + size - fb->len);
+	fb->len = pos + size;
+	return pos;
+}
+
+static void fb_put(struct fb *fb, size_t pos, uint64_t val, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		fb->buf[pos + i] = val >> (i * 8);
+}
+
+/* point the offset at pos to target, which must follow it */
+static void fb_ref(struct fb *fb, size_t pos, size_t target)
+{
+	fb_put(fb, pos, target - pos, 4);
+}
+
+/* Add a table of n fields, of the given sizes (zero for an absent field),
+ * after its vtable. Fields are laid out in order, each aligned to its
+ * size, which works for the small tables we need.
+ */
+static void fb_table(struct fb *fb, struct fb_table *t, const uint8_t *sizes,
+		unsigned int n)
+{
+	size_t vtable, size = 4, align = 4;
+	unsigned int i;
+
+	vtable = fb_alloc(fb, 4 + 2 * n, 2, 0);
+
+	for (i = 0; i < n; i++) {
+		t->off[i] = 0;
+		if (!sizes[i])
+			continue;
+		while (size & (sizes[i] - 1))
+			size++;
+		t->off[i] = size;
+		size += sizes[i];
+		if (sizes[i] > align)
+			align = sizes[i];
+	}
+
+	t->pos = fb_alloc(fb, size, align, 0);
+	if (fb->overflow)
+		return;
+
+	fb_put(fb, vtable, 4 + 2 * n, 2);
+	fb_put(fb, vtable + 2, size, 2);
+	for (i = 0; i < n; i++)
+		fb_put(fb, vtable + 4 + 2 * i, t->off[i], 2);
+
+	/* the vtable precedes the table, so this is positive */
+	fb_put(fb, t->pos, t->pos - vtable, 4);
+}
+
+static void fb_set(struct fb *fb, const struct fb_table *t, unsigned int id,
+		uint64_t val, size_t size)
+{
+	fb_put(fb, t->pos + t->off[id], val, size);
+}
+
+/* the position of a field holding an offset, to pass to fb_ref() */
+static size_t fb_field(const struct fb_table *t, unsigned int id)
+{
+	return t->pos + t->off[id];
+}
+
+/* a vector of n elements, to fill in; returns the position of the first */
+static size_t fb_vector(struct fb *fb, size_t ref, unsigned int n,
+		size_t size, size_t align)
+{
+	size_t pos;
+
+	pos = fb_alloc(fb, 4 + n * size, align < 4 ? 4 : align, 4);
+	if (fb->overflow)
+		return 0;
+
+	fb_put(fb, pos, n, 4);
+	fb_ref(fb, ref, pos);
+	return pos + 4;
+}
+
+static void fb_string(struct fb *fb, size_t ref, const char *str)
+{
+	size_t pos, len = strlen(str);
+
+	/* and a terminator, which fb_alloc() zeroes */
+	pos = fb_vector(fb, ref, len, 1, 1);
+	fb_alloc(fb, 1, 1, 0);
+	if (!fb->overflow)
+		memcpy(fb->buf + pos, str, len);
+}
+
+/* Start the message, with its header of type, and a body of body_len:
+ * returns the position of the header's offset, to point to the header.
+ */
+static size_t fb_message(struct fb *fb, uint8_t type, uint64_t body_len)
+{
+	static const uint8_t sizes[] = { 2, 1, 4, 8 };
+	struct fb_table msg;
+	size_t root;
+
+	fb->len = 0;
+	fb->overflow = false;
+
+	root = fb_alloc(fb, 4, 4, 0);
+	fb_table(fb, &msg, sizes, ARRAY_SIZE(sizes));
+	fb_ref(fb, root, msg.pos);
+
+	fb_set(fb, &msg, 0, ARROW_METADATA_V5, 2);
+	fb_set(fb, &msg, 1, type, 1);
+	fb_set(fb, &msg, 3, body_len, 8);
+
+	return fb_field(&msg, 2);
+}
+
+/* A RecordBatch table, of n_nodes field nodes and the buffers after them,
+ * whose lengths are given in lens; each buffer is padded to 8 bytes in
+ * the body.
+ */
+static void fb_record_batch(struct fb *fb, size_t ref, int64_t length,
+		const struct fb_node *nodes, unsigned int n_nodes,
+		const size_t *lens, unsigned int n_buffers)
+{
+	static const uint8_t sizes[] = { 8, 4, 4 };
+	struct fb_table batch;
+	uint64_t offset;
+	unsigned int i;
+	size_t pos;
+
+	fb_table(fb, &batch, sizes, ARRAY_SIZE(sizes));
+	fb_ref(fb, ref, batch.pos);
+	fb_set(fb, &batch, 0, length, 8);
+
+	pos = fb_vector(fb, fb_field(&batch, 1), n_nodes, 16, 8);
+	for (i = 0; !fb->overflow && i < n_nodes; i++) {
+		fb_put(fb, pos + i * 16, nodes[i].length, 8);
+		fb_put(fb, pos + i * 16 + 8, nodes[i].null_count, 8);
+	}
+
+	pos = fb_vector(fb, fb_field(&batch, 2), n_buffers, 16, 8);
+	for (i = 0, offset = 0; !fb->overflow && i < n_buffers; i++) {
+		fb_put(fb, pos + i * 16, offset, 8);
+		fb_put(fb, pos + i * 16 + 8, lens[i], 8);
+		offset += (lens[i] + 7) & ~(size_t)7;
+	}
+}
+
+static size_t body_length(const size_t *lens, unsigned int n)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		len += (lens[i] + 7) & ~(size_t)7;
+	return len;
+}
+
+/* the message's length: the prefix, metadata (padded to 8) and body */
+static size_t message_length(const struct fb *fb, size_t body_len)
+{
+	return 8 + ((fb->len + 7) & ~(size_t)7) + body_len;
+}
+
+/* write the prefix and metadata; returns where the body goes */
+static char *write_metadata(char *buf, const struct fb *fb)
+{
+	size_t meta_len = (fb->len + 7) & ~(size_t)7;
+	uint32_t prefix[2] = { ARROW_CONTINUATION, meta_len };
+
+	/* the prefix is little-endian too */
+	prefix[1] = htole32(prefix[1]);
+	memcpy(buf, prefix, sizeof(prefix));
+	memcpy(buf + 8, fb->buf, fb->len);
+	memset(buf + 8 + fb->len, 0, meta_len - fb->len);
+
+	return buf + 8 + meta_len;
+}
+
+/* copy a buffer into the body, padded to 8 bytes */
+static char *write_buffer(char *p, const void *data, size_t len)
+{
+	size_t padded = (len + 7) & ~(size_t)7;
+
+	memcpy(p, data, len);
+	memset(p + len, 0, padded - len);
+	return p + padded;
+}
+
+static void fb_type(struct fb *fb, const struct fb_table *field,
+		uint8_t type)
+{
+	static const uint8_t int_sizes[] = { 4, 1 };
+	static const uint8_t float_sizes[] = { 2 };
+	static const uint8_t timestamp_sizes[] = { 2, 4 };
+	struct fb_table t;
+
+	fb_set(fb, field, 2, type, 1);
+
+	switch (type) {
+	case ARROW_TYPE_INT:
+		fb_table(fb, &t, int_sizes, ARRAY_SIZE(int_sizes));
+		fb_set(fb, &t, 0, 64, 4);
+		fb_set(fb, &t, 1, true, 1);
+		break;
+	case ARROW_TYPE_FLOAT:
+		fb_table(fb, &t, float_sizes, ARRAY_SIZE(float_sizes));
+		fb_set(fb, &t, 0, ARROW_PRECISION_DOUBLE, 2);
+		break;
+	case ARROW_TYPE_TIMESTAMP:
+		fb_table(fb, &t, timestamp_sizes,
+				ARRAY_SIZE(timestamp_sizes));
+		fb_set(fb, &t, 0, ARROW_UNIT_MS, 2);
+		fb_string(fb, fb_field(&t, 1), "UTC");
+		break;
+	default:
+		/* Utf8 and Bool have no fields */
+		fb_table(fb, &t, NULL, 0);
+	}
+
+	fb_ref(fb, fb_field(field, 3), t.pos);
+}
+
+/* the path column's dictionary encoding, with int32 indices */
+static void fb_dictionary(struct fb *fb, size_t ref)
+{
+	static const uint8_t dict_sizes[] = { 8, 4 };
+	static const uint8_t int_sizes[] = { 4, 1 };
+	struct fb_table dict, index;
+
+	fb_table(fb, &dict, dict_sizes, ARRAY_SIZE(dict_sizes));
+	fb_ref(fb, ref, dict.pos);
+	fb_set(fb, &dict, 0, ARROW_PATH_DICT_ID, 8);
+
+	fb_table(fb, &index, int_sizes, ARRAY_SIZE(int_sizes));
+	fb_ref(fb, fb_field(&dict, 1), index.pos);
+	fb_set(fb, &index, 0, 32, 4);
+	fb_set(fb, &index, 1, true, 1);
+}
+
+/* The stream's first message: its schema */
+int format_schema_arrow(char *buf, size_t len)
+{
+	/* name, nullable, type_type, type, dictionary, children; only the
+	 * path has a dictionary, and an absent field takes no space */
+	static const uint8_t field_sizes[] = { 4, 1, 1, 4, 0, 4 };
+	static const uint8_t dict_field_sizes[] = { 4, 1, 1, 4, 4, 4 };
+	static const uint8_t schema_sizes[] = { 2, 4 };
+	struct fb_table schema, field;
+	struct fb fb;
+	size_t ref, pos;
+	unsigned int i;
+
+	ref = fb_message(&fb, ARROW_SCHEMA, 0);
+
+	fb_table(&fb, &schema, schema_sizes, ARRAY_SIZE(schema_sizes));
+	fb_ref(&fb, ref, schema.pos);
+	fb_set(&fb, &schema, 0,
+			__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__, 2);
+
+	pos = fb_vector(&fb, fb_field(&schema, 1), N_COLUMNS, 4, 4);
+
+	for (i = 0; i < N_COLUMNS && !fb.overflow; i++) {
+		fb_table(&fb, &field, i == COL_PATH ?
+				dict_field_sizes : field_sizes,
+				ARRAY_SIZE(field_sizes));
+		fb_ref(&fb, pos + i * 4, field.pos);
+
+		fb_string(&fb, fb_field(&field, 0), fields[i].name);
+		fb_set(&fb, &field, 1, fields[i].nullable, 1);
+		fb_type(&fb, &field, fields[i].type);
+		if (i == COL_PATH)
+			fb_dictionary(&fb, fb_field(&field, 4));
+		fb_vector(&fb, fb_field(&field, 5), 0, 4, 4);
+	}
+
+	if (fb.overflow)
+		return -EOVERFLOW;
+
+	if (message_length(&fb, 0) <= len)
+		write_metadata(buf, &fb);
+	return message_length(&fb, 0);
+}
+
+/* A dictionary batch of the n paths with IDs from first: a delta to
+ * those already sent, unless first is zero.
+ */
+int format_dictionary_arrow(char *buf, size_t len, uint32_t first,
+		char *const *paths, unsigned int n)
+{
+	static const uint8_t sizes[] = { 8, 4, 1 };
+	struct fb_node node = { .length = n };
+	struct fb_table dict;
+	struct fb fb;
+	size_t lens[3], ref;
+	unsigned int i;
+	int32_t offset;
+	char *p;
+
+	/* validity (none), offsets, and the concatenated strings */
+	lens[0] = 0;
+	lens[1] = (n + 1) * sizeof(int32_t);
+	for (i = 0, lens[2] = 0; i < n; i++)
+		lens[2] += strlen(paths[i]);
+
+	ref = fb_message(&fb, ARROW_DICTIONARY_BATCH,
+			body_length(lens, ARRAY_SIZE(lens)));
+
+	fb_table(&fb, &dict, sizes, ARRAY_SIZE(sizes));
+	fb_ref(&fb, ref, dict.pos);
+	fb_set(&fb, &dict, 0, ARROW_PATH_DICT_ID, 8);
+	fb_set(&fb, &dict, 2, first > 0, 1);
+	fb_record_batch(&fb, fb_field(&dict, 1), n, &node, 1,
+			lens, ARRAY_SIZE(lens));
+
+	if (fb.overflow)
+		return -EOVERFLOW;
+
+	if (message_length(&fb, body_length(lens, 3)) > len)
+		return message_length(&fb, body_length(lens, 3));
+
+	p = write_metadata(buf, &fb);
+
+	for (i = 0, offset = 0; i <= n; i++) {
+		memcpy(p + i * sizeof(offset), &offset, sizeof(offset));
+		if (i < n)
+			offset += strlen(paths[i]);
+	}
+	p += (lens[1] + 7) & ~(size_t)7;
+
+	for (i = 0; i < n; i++) {
+		size_t l = strlen(paths[i]);
+
+		memcpy(p, paths[i], l);
+		p += l;
+	}
+	memset(p, 0, ((lens[2] + 7) & ~(size_t)7) - lens[2]);
+
+	return message_length(&fb, body_length(lens, 3));
+}
+
+/* A record batch of the rows collected in batch */
+int format_batch_arrow(char *buf, size_t len, const struct arrow_batch *batch)
+{
+	size_t lens[N_COLUMNS * 2], bitmap_len, body_len;
+	const void *data[N_COLUMNS * 2];
+	struct fb_node nodes[N_COLUMNS];
+	unsigned int i, n = batch->n;
+	struct fb fb;
+	size_t ref;
+	char *p;
+
+	bitmap_len = (n + 7) / 8;
+
+	/* every column has a validity buffer and a data buffer; only value
+	 * and raw have nulls, and so need a validity bitmap */
+	memset(nodes, 0, sizeof(nodes));
+	memset(lens, 0, sizeof(lens));
+	memset(data, 0, sizeof(data));
+	for (i = 0; i < N_COLUMNS; i++)
+		nodes[i].length = n;
+
+	nodes[COL_VALUE].null_count = batch->n_null_value;
+	if (batch->n_null_value) {
+		data[COL_VALUE * 2] = batch->bits[BITS_VALUE_VALID];
+		lens[COL_VALUE * 2] = bitmap_len;
+	}
+	nodes[COL_RAW].null_count = batch->n_null_raw;
+	if (batch->n_null_raw) {
+		data[COL_RAW * 2] = batch->bits[BITS_RAW_VALID];
+		lens[COL_RAW * 2] = bitmap_len;
+	}
+
+	data[COL_PATH * 2 + 1] = batch->path;
+	lens[COL_PATH * 2 + 1] = n * sizeof(*batch->path);
+	data[COL_VALUE * 2 + 1] = batch->value;
+	lens[COL_VALUE * 2 + 1] = n * sizeof(*batch->value);
+	data[COL_RAW * 2 + 1] = batch->raw;
+	lens[COL_RAW * 2 + 1] = n * sizeof(*batch->raw);
+	for (i = 0; i < 4; i++) {
+		data[(COL_LOWER_CRIT + i) * 2 + 1] =
+			batch->bits[BITS_LOWER_CRIT + i];
+		lens[(COL_LOWER_CRIT + i) * 2 + 1] = bitmap_len;
+	}
+	data[COL_TIMESTAMP * 2 + 1] = batch->timestamp;
+	lens[COL_TIMESTAMP * 2 + 1] = n * sizeof(*batch->timestamp);
+
+	body_len = body_length(lens, ARRAY_SIZE(lens));
+	ref = fb_message(&fb, ARROW_RECORD_BATCH, body_len);
+	fb_record_batch(&fb, ref, n, nodes, N_COLUMNS,
+			lens, ARRAY_SIZE(lens));
+
+	if (fb.overflow)
+		return -EOVERFLOW;
+
+	if (message_length(&fb, body_len) > len)
+		return message_length(&fb, body_len);
+
+	p = write_metadata(buf, &fb);
+	for (i = 0; i < ARRAY_SIZE(lens); i++)
+		if (lens[i])
+			p = write_buffer(p, data[i], lens[i]);
+
+	return message_length(&fb, body_len);
+}
+
+/* the end-of-stream marker */
+int format_eos_arrow(char *buf, size_t len)
+{
+	static const uint32_t eos[2] = { ARROW_CONTINUATION, 0 };
+
+	if (sizeof(eos) <= len)
+		memcpy(buf, eos, sizeof(eos));
+	return sizeof(eos);
+}
+
+static int arrow_batch_grow(struct arrow_batch *batch)
+{
+	unsigned int alloc = batch->alloc ? batch->alloc * 2 : 1024;
+	unsigned int i;
+	void *tmp;
+
+#define GROW(field) do {						\
+		tmp = reallocarray(batch->field, alloc,			\
+				sizeof(*batch->field));			\
+		if (!tmp)						\
+			return -ENOMEM;					\
+		batch->field = tmp;					\
+	} while (0)
+
+	GROW(path);
+	GROW(value);
+	GROW(raw);
+	GROW(timestamp);
+#undef GROW
+
+	for (i = 0; i < N_BITMAPS; i++) {
+		tmp = realloc(batch->bits[i], alloc / 8);
+		if (!tmp)
+			return -ENOMEM;
+		batch->bits[i] = tmp;
+		memset(batch->bits[i] + batch->alloc / 8, 0,
+				(alloc - batch->alloc) / 8);
+	}
+
+	batch->alloc = alloc;
+	return 0;
+}
+
+static void set_bit(uint8_t *bits, unsigned int i, bool val)
+{
+	if (val)
+		bits[i / 8] |= 1 << (i % 8);
+}
+
+/* Add a row for a sensor reading, whose path has the given ID; rc is as
+ * for sensor_result_fn. The batch is allocated on the first row.
+ */
+int arrow_batch_append(struct arrow_batch **batchp, uint32_t id,
+		const struct sensor_data *sensor, int rc,
+		uint64_t timestamp_ms)
+{
+	struct arrow_batch *batch = *batchp;
+	unsigned int i;
+	bool raw;
+	int ret;
+
+	if (!batch) {
+		batch = calloc(1, sizeof(*batch));
+		if (!batch)
+			return -ENOMEM;
+		*batchp = batch;
+	}
+
+	if (batch->n == batch->alloc) {
+		ret = arrow_batch_grow(batch);
+		if (ret < 0)
+			return ret;
+	}
+
+	i = batch->n++;
+	raw = !rc && sensor->type == 'x';
+
+	batch->path[i] = id;
+	batch->value[i] = rc ? 0 : sensor_value_double(sensor);
+	batch->raw[i] = raw ? sensor->value.x : 0;
+	batch->timestamp[i] = timestamp_ms;
+
+	set_bit(batch->bits[BITS_VALUE_VALID], i, !rc);
+	set_bit(batch->bits[BITS_RAW_VALID], i, raw);
+	set_bit(batch->bits[BITS_LOWER_CRIT], i, !rc && sensor->lower_crit);
+	set_bit(batch->bits[BITS_UPPER_CRIT], i, !rc && sensor->upper_crit);
+	set_bit(batch->bits[BITS_LOWER_WARN], i, !rc && sensor->lower_warn);
+	set_bit(batch->bits[BITS_UPPER_WARN], i, !rc && sensor->upper_warn);
+	if (rc)
+		batch->n_null_value++;
+	if (!raw)
+		batch->n_null_raw++;
+
+	return 0;
+}
+
+unsigned int arrow_batch_rows(const struct arrow_batch *batch)
+{
+	return batch ? batch->n : 0;
+}
+
+/* the timestamp of the batch's first row, which must have one */
+uint64_t arrow_batch_start(const struct arrow_batch *batch)
+{
+	return batch->timestamp[0];
+}
+
+/* empty the batch, once written, keeping its allocations */
+void arrow_batch_reset(struct arrow_batch *batch)
+{
+	unsigned int i;
+
+	if (!batch)
+		return;
+
+	for (i = 0; i < N_BITMAPS; i++)
+		memset(batch->bits[i], 0, (batch->n + 7) / 8);
+	batch->n = 0;
+	batch->n_null_value = 0;
+	batch->n_null_raw = 0;
+}
+
+void arrow_batch_free(struct arrow_batch *batch)
+{
+	unsigned int i;
+
+	if (!batch)
+		return;
+
+	free(batch->path);
+	free(batch->value);
+	free(batch->raw);
+	free(batch->timestamp);
+	for (i = 0; i < N_BITMAPS; i++)
+		free(batch->bits[i]);
+	free(batch);
+}
@@ -0,0 +1,225 @@
+/* Value formatting benchmark: time format_double() and format_i64()
+ * against the snprintf() calls they replace, over values distributed
+ * like those a BMC reports. Every value is also checked to format
+ * identically both ways.
+ *
+ * The doubles come from the conversions dbus-sensors daemons do: hwmon
+ * readings in milli- or micro-units divided down (temperatures,
+ * voltages, currents, power), whole fan RPMs, PMBus-style raw readings
+ * multiplied by a coefficient, and the odd NaN for an unavailable
+ * sensor. The integers are the raw readings themselves.
+ *
+ * usage: bench-format [options]
+ */
+
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensor-query.h"
+
+/* distinct values per case, cycled through for the iterations */
+#define N_VALUES	4096
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/* xorshift64*: reproducible, and cheap enough not to matter */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static int64_t rng_range(int64_t lo, int64_t hi)
+{
+	return lo + (int64_t)(rng() % (uint64_t)(hi - lo + 1));
+}
+
+static double gen_double(void)
+{
+	switch (rng() % 8) {
+	case 0:
+	case 1:
+		/* temperature, from millidegrees */
+		return rng_range(15000, 105000) / 1000.0;
+	case 2:
+		/* fan speed, whole RPM */
+		return rng_range(0, 20000);
+	case 3:
+		/* voltage, from millivolts */
+		return rng_range(0, 13000) / 1000.0;
+	case 4:
+		/* current, from milliamps */
+		return rng_range(0, 100000) / 1000.0;
+	case 5:
+		/* power, from microwatts */
+		return rng_range(0, 2000000000) / 1000000.0;
+	case 6:
+		/* PMBus linear reading times a coefficient */
+		return rng_range(0, 4095) * 0.0625 * 1.0123;
+	default:
+		return (rng() % 16) ? rng_range(-40000, 40000) / 1000.0 : NAN;
+	}
+}
+
+static int64_t gen_int(void)
+{
+	switch (rng() % 4) {
+	case 0:
+		return rng_range(15000, 105000);
+	case 1:
+		return rng_range(0, 20000);
+	case 2:
+		return rng_range(0, 2000000000);
+	default:
+		return rng_range(-40000, 40000);
+	}
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, unsigned long iterations,
+		uint64_t libc_ns, uint64_t ours_ns)
+{
+	printf("%-8s %10lu %14.1f %14.1f %8.2fx\n", name, iterations,
+			(double)libc_ns / iterations,
+			(double)ours_ns / iterations,
+			(double)libc_ns / ours_ns);
+}
+
+/* the sum of output lengths, so the loops can't be optimised away */
+static volatile size_t sink;
+
+static void bench_double(unsigned long iterations)
+{
+	char buf[FORMAT_VALUE_MAX], ref[FORMAT_VALUE_MAX];
+	static double values[N_VALUES];
+	uint64_t start, libc_ns, ours_ns;
+	unsigned long i;
+	size_t total;
+
+	for (i = 0; i < N_VALUES; i++) {
+		values[i] = gen_double();
+		format_double(buf, values[i], FORMAT_DEFAULT_DIGITS);
+		snprintf(ref, sizeof(ref), "%f", values[i]);
+		if (strcmp(buf, ref))
+			errx(EXIT_FAILURE, "%a: formatted '%s', expected '%s'",
+					values[i], buf, ref);
+	}
+
+	total = 0;
+	start = now_nsec();
+	for (i = 0; i < iterations; i++)
+		total += snprintf(buf, sizeof(buf), "%f",
+				values[i % N_VALUES]);
+	libc_ns = now_nsec() - start;
+
+	start = now_nsec();
+	for (i = 0; i < iterations; i++)
+		total += format_double(buf, values[i % N_VALUES],
+				FORMAT_DEFAULT_DIGITS);
+	ours_ns = now_nsec() - start;
+
+	sink = total;
+	report("double", iterations, libc_ns, ours_ns);
+}
+
+static void bench_int(unsigned long iterations)
+{
+	char buf[FORMAT_VALUE_MAX], ref[FORMAT_VALUE_MAX];
+	static int64_t values[N_VALUES];
+	uint64_t start, libc_ns, ours_ns;
+	unsigned long i;
+	size_t total;
+
+	for (i = 0; i < N_VALUES; i++) {
+		values[i] = gen_int();
+		format_i64(buf, values[i]);
+		snprintf(ref, sizeof(ref), "%" PRId64, values[i]);
+		if (strcmp(buf, ref))
+			errx(EXIT_FAILURE, "%" PRId64 ": formatted '%s'",
+					values[i], buf);
+	}
+
+	total = 0;
+	start = now_nsec();
+	for (i = 0; i < iterations; i++)
+		total += snprintf(buf, sizeof(buf), "%" PRId64,
+				values[i % N_VALUES]);
+	libc_ns = now_nsec() - start;
+
+	start = now_nsec();
+	for (i = 0; i < iterations; i++)
+		total += format_i64(buf, values[i % N_VALUES]);
+	ours_ns = now_nsec() - start;
+
+	sink = total;
+	report("int64", iterations, libc_ns, ours_ns);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"options:\n"
+		"  -n, --iterations=N     values formatted per case "
+					"(default 1000000)\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "iterations",	required_argument,	NULL, 'n' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ 0 },
+	};
+	unsigned long iterations;
+	char *endp;
+	int rc;
+
+	iterations = 1000000;
+
+	for (;;) {
+		rc = getopt_long(argc, argv, "n:h", options, NULL);
+		if (rc == -1)
+			break;
+
+		switch (rc) {
+		case 'n':
+			iterations = strtoul(optarg, &endp, 10);
+			if (*endp || !iterations)
+				errx(EXIT_FAILURE, "invalid iterations '%s'",
+						optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%-8s %10s %14s %14s %9s\n", "value", "values",
+			"snprintf ns", "format ns", "speedup");
+
+	bench_double(iterations);
+	bench_int(iterations);
+
+	return EXIT_SUCCESS;
+}
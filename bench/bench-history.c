@@ -0,0 +1,308 @@
+/* History store benchmark: record a day of 1 Hz updates for a BMC's
+ * worth of sensors, and report the time per sample and how much of the
+ * file it took; then time queries for one sensor over the whole day, its
+ * last hour, and the whole day in 5 minute buckets.
+ *
+ * The updates are shaped like those dbus-sensors sends: temperatures
+ * wandering in eighths of a degree, noisy whole fan RPMs, voltages and
+ * currents from milli-units, and power from microwatts, as doubles; or,
+ * with --integers, the same readings as phosphor-hwmon sends them, as
+ * integers with a Scale. Each arrives a second after the last, give or
+ * take some jitter.
+ *
+ * With a --size small enough for the file to wrap, the queries show how
+ * much of the day it holds.
+ *
+ * usage: bench-history [options]
+ */
+
+#include <err.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sensor-query.h"
+
+/* times each query is run, for the best time */
+#define QUERY_RUNS		20
+
+/* by default, big enough for a day of anything we generate; the file is
+ * sparse, so only the blocks we write take space */
+#define BENCH_HISTORY_SIZE	((uint64_t)1 << 30)
+
+static const struct {
+	const char	*name;
+	int8_t		scale;		/* of its raw readings */
+} types[] = {
+	{ "temperature",	-3 },
+	{ "fan_tach",		0 },
+	{ "voltage",		-3 },
+	{ "current",		-3 },
+	{ "power",		-6 },
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/* xorshift64*: reproducible, and cheap enough not to matter */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static int64_t rng_range(int64_t lo, int64_t hi)
+{
+	return lo + (int64_t)(rng() % (uint64_t)(hi - lo + 1));
+}
+
+/* the next raw reading of sensor i, whose last was *raw */
+static void next_raw(unsigned int i, int64_t *raw)
+{
+	switch (i % ARRAY_SIZE(types)) {
+	case 0:
+		/* millidegrees, moving an eighth of a degree at a time */
+		*raw += rng_range(-1, 1) * 125;
+		break;
+	case 1:
+		*raw = 8000 + rng_range(-60, 60);
+		break;
+	case 2:
+		*raw = 12000 + rng_range(-20, 20);
+		break;
+	case 3:
+		*raw = 20000 + rng_range(-200, 200);
+		break;
+	default:
+		*raw = 350000000 + rng_range(-5000000, 5000000);
+	}
+}
+
+/* set sensor i's value from its raw reading */
+static void set_value(struct sensor_data *data, unsigned int i, int64_t raw,
+		bool integers)
+{
+	data->value.x = raw;
+	data->scale = types[i % ARRAY_SIZE(types)].scale;
+	data->type = 'x';
+	if (integers)
+		return;
+
+	data->value.d = sensor_value_double(data);
+	data->scale = 0;
+	data->type = 'd';
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void count_point(const char *path, const struct history_point *point,
+		void *data)
+{
+	unsigned long *n = data;
+
+	(void)path;
+	(void)point;
+	(*n)++;
+}
+
+static void bench_query(const char *name, const char *file,
+		const char *sensor, uint64_t since, uint64_t until,
+		uint64_t bucket)
+{
+	uint64_t start, elapsed, best;
+	unsigned long n;
+	unsigned int i;
+	int rc;
+
+	best = UINT64_MAX;
+	for (i = 0; i < QUERY_RUNS; i++) {
+		n = 0;
+		start = now_nsec();
+		rc = history_query(file, sensor, since, until, bucket,
+				count_point, &n);
+		elapsed = now_nsec() - start;
+		if (rc < 0)
+			errx(EXIT_FAILURE, "query failed: %s",
+					strerror(-rc));
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	printf("%-12s %10lu %12.3f\n", name, n, best / 1e6);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"options:\n"
+		"  -n, --sensors=N        sensors (default 300)\n"
+		"  -H, --hours=N          hours of updates (default 24)\n"
+		"  -j, --jitter=MS        update time jitter (default 10)\n"
+		"  -i, --integers         integer values, with a Scale\n"
+		"  -s, --size=MB          history file size (default 1024)\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "sensors",	required_argument,	NULL, 'n' },
+		{ "hours",	required_argument,	NULL, 'H' },
+		{ "jitter",	required_argument,	NULL, 'j' },
+		{ "integers",	no_argument,		NULL, 'i' },
+		{ "size",	required_argument,	NULL, 's' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ 0 },
+	};
+	unsigned long n_sensors, hours, jitter, s, n_samples;
+	struct history_store *store;
+	struct watch_sensor *sensors;
+	uint64_t *times, t0, start, elapsed, size;
+	char path[64], **objects;
+	bool integers;
+	unsigned int i;
+	int64_t *raw;
+	char *endp;
+	int rc;
+
+	n_sensors = 300;
+	hours = 24;
+	jitter = 10;
+	integers = false;
+	size = BENCH_HISTORY_SIZE;
+
+	for (;;) {
+		rc = getopt_long(argc, argv, "n:H:j:is:h", options, NULL);
+		if (rc == -1)
+			break;
+
+		switch (rc) {
+		case 'n':
+			n_sensors = strtoul(optarg, &endp, 10);
+			if (*endp || !n_sensors)
+				errx(EXIT_FAILURE, "invalid sensors '%s'",
+						optarg);
+			break;
+		case 'H':
+			hours = strtoul(optarg, &endp, 10);
+			if (*endp || !hours)
+				errx(EXIT_FAILURE, "invalid hours '%s'",
+						optarg);
+			break;
+		case 'j':
+			jitter = strtoul(optarg, &endp, 10);
+			if (*endp || jitter >= 500)
+				errx(EXIT_FAILURE, "invalid jitter '%s'",
+						optarg);
+			break;
+		case 'i':
+			integers = true;
+			break;
+		case 's':
+			size = strtoull(optarg, &endp, 10) << 20;
+			if (*endp || !size)
+				errx(EXIT_FAILURE, "invalid size '%s'",
+						optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	sensors = calloc(n_sensors, sizeof(*sensors));
+	objects = calloc(n_sensors, sizeof(*objects));
+	times = calloc(n_sensors, sizeof(*times));
+	raw = calloc(n_sensors, sizeof(*raw));
+	if (!sensors || !objects || !times || !raw)
+		err(EXIT_FAILURE, "calloc");
+
+	/* sorted by path, as the watch core keeps them */
+	for (i = 0; i < n_sensors; i++) {
+		if (asprintf(&objects[i], SENSORS_ROOT "/%s/bench%05u",
+					types[i % ARRAY_SIZE(types)].name,
+					i) < 0)
+			err(EXIT_FAILURE, "asprintf");
+		sensors[i].desc.object = objects[i];
+		sensors[i].valid = true;
+		raw[i] = rng_range(30000, 60000) / 125 * 125;
+	}
+	qsort(objects, n_sensors, sizeof(*objects),
+			(int (*)(const void *, const void *))strcmp);
+	for (i = 0; i < n_sensors; i++)
+		sensors[i].desc.object = objects[i];
+
+	snprintf(path, sizeof(path), "/tmp/bench-history.%d", getpid());
+	rc = history_open(&store, path, size);
+	if (!rc)
+		rc = history_layout(store, sensors, n_sensors);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't create %s: %s", path,
+				strerror(-rc));
+
+	t0 = 1700000000000ull;
+	for (i = 0; i < n_sensors; i++)
+		times[i] = t0 + rng_range(0, 999);
+
+	n_samples = 0;
+	elapsed = 0;
+
+	/* a second at a time, so values are generated outside the timing */
+	for (s = 0; s < hours * 3600; s++) {
+		for (i = 0; i < n_sensors; i++) {
+			next_raw(i, &raw[i]);
+			set_value(&sensors[i].data, i, raw[i], integers);
+		}
+
+		start = now_nsec();
+		for (i = 0; i < n_sensors; i++)
+			history_record(store, i, &sensors[i],
+					times[i] + s * 1000);
+		elapsed += now_nsec() - start;
+		n_samples += n_sensors;
+
+		for (i = 0; i < n_sensors; i++)
+			times[i] += rng_range(-(int64_t)jitter, jitter);
+	}
+
+	printf("%lu sensors, %lu hours at 1 Hz: %lu samples, %.1f ns/sample\n",
+			n_sensors, hours, n_samples,
+			(double)elapsed / n_samples);
+	history_report(store);
+
+	/* one sensor from the middle of the table */
+	printf("%-12s %10s %12s\n", "query", "points", "best ms");
+	t0 = times[n_sensors / 2] + (hours * 3600 - 1) * 1000;
+	bench_query("day", path, objects[n_sensors / 2], 0, t0, 0);
+	bench_query("last hour", path, objects[n_sensors / 2],
+			t0 - 3600 * 1000, t0, 0);
+	bench_query("day, 5m", path, objects[n_sensors / 2], 0, t0,
+			5 * 60 * 1000);
+
+	history_close(store);
+	unlink(path);
+
+	for (i = 0; i < n_sensors; i++)
+		free(objects[i]);
+	free(objects);
+	free(sensors);
+	free(times);
+	free(raw);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,355 @@
+/* Property decode benchmark: time the parsing of sensor property
+ * replies, without a bus. Replies are built with the properties (and
+ * property order) that dbus-sensors daemons expose on a sensor object,
+ * then decoded repeatedly with the same functions the query engines
+ * use:
+ *
+ *  - getall: a GetAll on all interfaces, as the default queries make;
+ *  - value-iface: a GetAll on Sensor.Value, as with --filter-ifaces
+ *    and --values-only;
+ *  - bad-object: a GetManagedObjects reply, as the bulk engine reads,
+ *    of an object with bad properties in two of its interfaces and then
+ *    a good one. The bad one has to fail, and the good one still parse.
+ *
+ * usage: bench-parse [options]
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+
+#include "sensor-query.h"
+
+/* distinct replies per case, so we're not just decoding one buffer */
+#define N_REPLIES	64
+
+enum reply_kind {
+	REPLY_GETALL,
+	REPLY_VALUE_IFACE,
+	REPLY_BAD_OBJECT,
+};
+
+static const struct bench_case {
+	const char	*name;
+	enum reply_kind	kind;
+	unsigned int	n_props;
+} cases[] = {
+	{ "getall",		REPLY_GETALL,		15 },
+	{ "value-iface",	REPLY_VALUE_IFACE,	4 },
+	{ "bad-object",		REPLY_BAD_OBJECT,	15 },
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Messages can only be created on a started bus, but it doesn't need to
+ * be connected to anything: one end of a socketpair will do.
+ */
+static sd_bus *open_bus(void)
+{
+	sd_bus *bus;
+	int fds[2], rc;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+		err(EXIT_FAILURE, "socketpair");
+
+	rc = sd_bus_new(&bus);
+	if (rc >= 0)
+		rc = sd_bus_set_fd(bus, fds[0], fds[0]);
+	if (rc >= 0)
+		rc = sd_bus_start(bus);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't create bus: %s", strerror(-rc));
+
+	close(fds[1]);
+	return bus;
+}
+
+static int append_value_props(sd_bus_message *m, double value)
+{
+	return sd_bus_message_append(m, "{sv}{sv}{sv}{sv}",
+			"MaxValue", "d", 127.0,
+			"MinValue", "d", -128.0,
+			"Unit", "s",
+				"xyz.openbmc_project.Sensor.Value.Unit.DegreesC",
+			"Value", "d", value);
+}
+
+static int append_threshold_props(sd_bus_message *m, const char *prefix,
+		bool alarm_high, double high, double low)
+{
+	char names[4][32];
+
+	snprintf(names[0], sizeof(names[0]), "%sAlarmHigh", prefix);
+	snprintf(names[1], sizeof(names[1]), "%sAlarmLow", prefix);
+	snprintf(names[2], sizeof(names[2]), "%sHigh", prefix);
+	snprintf(names[3], sizeof(names[3]), "%sLow", prefix);
+
+	return sd_bus_message_append(m, "{sv}{sv}{sv}{sv}",
+			names[0], "b", alarm_high,
+			names[1], "b", false,
+			names[2], "d", high,
+			names[3], "d", low);
+}
+
+static double reply_value(unsigned int i)
+{
+	return 20 + i * 0.25;
+}
+
+/* Two objects: the first with two alarms of the wrong type under
+ * Threshold.Critical, and another under Threshold.Warning; the second
+ * as a good sensor.
+ */
+static int append_objects(sd_bus_message *m, double value)
+{
+	int rc;
+
+	rc = sd_bus_message_open_container(m, 'a', "{oa{sa{sv}}}");
+	if (rc >= 0)
+		rc = sd_bus_message_append(m, "{oa{sa{sv}}}",
+				"/xyz/openbmc_project/sensors/temperature/Bad",
+				3,
+				"xyz.openbmc_project.Sensor.Value", 1,
+					"Value", "d", value,
+				"xyz.openbmc_project.Sensor.Threshold.Critical",
+				2,
+					"CriticalAlarmHigh", "s", "yes",
+					"CriticalAlarmLow", "s", "no",
+				"xyz.openbmc_project.Sensor.Threshold.Warning",
+				1,
+					"WarningAlarmHigh", "s", "yes");
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(m, 'e', "oa{sa{sv}}");
+	if (rc >= 0)
+		rc = sd_bus_message_append(m, "o",
+				"/xyz/openbmc_project/sensors/"
+					"temperature/Good");
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(m, 'a', "{sa{sv}}");
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(m, 'e', "sa{sv}");
+	if (rc >= 0)
+		rc = sd_bus_message_append(m, "s",
+				"xyz.openbmc_project.Sensor.Value");
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(m, 'a', "{sv}");
+	if (rc >= 0)
+		rc = append_value_props(m, value);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(m);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(m);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(m);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(m);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(m);
+
+	return rc;
+}
+
+static sd_bus_message *build_reply(sd_bus *bus, enum reply_kind kind,
+		unsigned int i)
+{
+	double value = reply_value(i);
+	sd_bus_message *m;
+	int rc;
+
+	rc = sd_bus_message_new_signal(bus, &m, "/", "org.example.Bench",
+			"Reply");
+	if (rc < 0)
+		goto err;
+
+	if (kind == REPLY_BAD_OBJECT) {
+		rc = append_objects(m, value);
+		goto seal;
+	}
+
+	rc = sd_bus_message_open_container(m, 'a', "{sv}");
+	if (rc < 0)
+		goto err;
+
+	rc = append_value_props(m, value);
+	if (rc >= 0 && kind == REPLY_GETALL) {
+		rc = append_threshold_props(m, "Critical", i % 8 == 0,
+				105, 0);
+		if (rc >= 0)
+			rc = append_threshold_props(m, "Warning", i % 4 == 0,
+					90, 5);
+		if (rc >= 0)
+			rc = sd_bus_message_append(m, "{sv}{sv}{sv}",
+					"Available", "b", true,
+					"Functional", "b", true,
+					"Associations", "a(sss)", 1,
+					"chassis", "all_sensors",
+					"/xyz/openbmc_project/inventory/"
+						"system/board/Bench");
+	}
+	if (rc < 0)
+		goto err;
+
+	rc = sd_bus_message_close_container(m);
+seal:
+	if (rc >= 0)
+		rc = sd_bus_message_seal(m, i + 1, 0);
+	if (rc < 0)
+		goto err;
+
+	return m;
+
+err:
+	errx(EXIT_FAILURE, "can't build reply: %s", strerror(-rc));
+}
+
+/* Parse the objects of a bad-object reply as the bulk engine does; 0 if
+ * the bad one failed and the good one came out right */
+static int parse_objects(sd_bus_message *m, double value)
+{
+	struct sensor_data sensor;
+	unsigned int n;
+	int rc;
+
+	rc = sd_bus_message_enter_container(m, 'a', "{oa{sa{sv}}}");
+	if (rc < 0)
+		return rc;
+
+	for (n = 0; ; n++) {
+		rc = sd_bus_message_enter_container(m, 'e', "oa{sa{sv}}");
+		if (rc <= 0)
+			break;
+
+		rc = sd_bus_message_skip(m, "o");
+		if (rc < 0)
+			return rc;
+
+		rc = parse_object_ifaces(m, &sensor);
+		if (n == 0 && rc != -ENXIO)
+			return -EBADMSG;
+		if (n == 1 && (rc < 0 || sensor.value.d != value))
+			return -EBADMSG;
+
+		rc = sd_bus_message_exit_container(m);
+		if (rc < 0)
+			return rc;
+	}
+
+	if (rc < 0)
+		return rc;
+
+	return n == 2 ? 0 : -EBADMSG;
+}
+
+static void bench_case(sd_bus *bus, const struct bench_case *bc,
+		unsigned long iterations)
+{
+	sd_bus_message *replies[N_REPLIES];
+	struct sensor_data sensor;
+	unsigned long i, n_errors;
+	uint64_t start, ns;
+	int rc;
+
+	for (i = 0; i < N_REPLIES; i++)
+		replies[i] = build_reply(bus, bc->kind, i);
+
+	n_errors = 0;
+	start = now_nsec();
+
+	for (i = 0; i < iterations; i++) {
+		sd_bus_message *m = replies[i % N_REPLIES];
+
+		sd_bus_message_rewind(m, true);
+		if (bc->kind == REPLY_BAD_OBJECT)
+			rc = parse_objects(m, reply_value(i % N_REPLIES));
+		else
+			rc = parse_sensor_reply(m, &sensor);
+		if (rc < 0)
+			n_errors++;
+	}
+
+	ns = now_nsec() - start;
+
+	printf("%-12s %6u %10lu %12.1f %12.1f\n", bc->name, bc->n_props,
+			iterations, (double)ns / iterations,
+			(double)ns / iterations / bc->n_props);
+
+	if (n_errors)
+		errx(EXIT_FAILURE, "%lu replies failed to parse", n_errors);
+
+	for (i = 0; i < N_REPLIES; i++)
+		sd_bus_message_unref(replies[i]);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"options:\n"
+		"  -n, --iterations=N     replies decoded per case "
+					"(default 1000000)\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "iterations",	required_argument,	NULL, 'n' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ 0 },
+	};
+	unsigned long iterations;
+	unsigned int i;
+	sd_bus *bus;
+	char *endp;
+	int rc;
+
+	iterations = 1000000;
+
+	for (;;) {
+		rc = getopt_long(argc, argv, "n:h", options, NULL);
+		if (rc == -1)
+			break;
+
+		switch (rc) {
+		case 'n':
+			iterations = strtoul(optarg, &endp, 10);
+			if (*endp || !iterations)
+				errx(EXIT_FAILURE, "invalid iterations '%s'",
+						optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	bus = open_bus();
+
+	printf("%-12s %6s %10s %12s %12s\n", "reply", "props", "replies",
+			"ns/reply", "ns/prop");
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++)
+		bench_case(bus, &cases[i], iterations);
+
+	sd_bus_unref(bus);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,550 @@
+/* Scan benchmark: run sensor-query against mock-sensord, on a private
+ * dbus-daemon, at a range of sensor counts and with each query engine,
+ * and report scans/sec and per-scan latency. Each engine is run with
+ * GetAll on all interfaces, with --filter-ifaces, and with
+ * --values-only; where dbus-monitor is available, we also report the
+ * bus traffic per scan.
+ *
+ * Each scan is a separate sensor-query process, as it would be run on a
+ * BMC, so the latency includes process startup, bus connection and
+ * loading the (warm) discovery cache.
+ *
+ * usage: bench-scan [options] <sensor-query> <mock-sensord>
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+
+#define MOCK_SERVICE	"xyz.openbmc_project.MockSensor"
+#define MAPPER_SERVICE	"xyz.openbmc_project.ObjectMapper"
+#define MARKER_MEMBER	"BenchScanMarker"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+/* the properties each scan requests, and the sensor-query option for
+ * that */
+static const struct props_mode {
+	const char	*name;
+	const char	*arg;
+} props_modes[] = {
+	{ "all",	NULL },
+	{ "filtered",	"--filter-ifaces" },
+	{ "values",	"--values-only" },
+};
+
+/* minimum number of scans per data point, regardless of duration */
+#define MIN_SCANS	5
+
+static pid_t bus_pid = -1, mock_pid = -1, monitor_pid = -1;
+static char tmpdir[] = "/tmp/bench-scan.XXXXXX";
+static char cache_path[sizeof(tmpdir) + 16];
+static char monitor_path[sizeof(tmpdir) + 16];
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stop_process(pid_t *pid)
+{
+	if (*pid <= 0)
+		return;
+
+	kill(*pid, SIGTERM);
+	waitpid(*pid, NULL, 0);
+	*pid = -1;
+}
+
+/* atexit handler; children use _exit(), so don't run this */
+static void cleanup(void)
+{
+	stop_process(&monitor_pid);
+	stop_process(&mock_pid);
+	stop_process(&bus_pid);
+	unlink(cache_path);
+	unlink(monitor_path);
+	rmdir(tmpdir);
+}
+
+/* Start a private session bus, and point the system bus address at it:
+ * sensor-query and the mock both connect to the default (system) bus.
+ */
+static void start_bus(void)
+{
+	char addr[512], fd_arg[32];
+	int fds[2];
+	ssize_t len;
+	char *nl;
+
+	if (pipe(fds))
+		err(EXIT_FAILURE, "pipe");
+
+	bus_pid = fork();
+	if (bus_pid < 0)
+		err(EXIT_FAILURE, "fork");
+
+	if (!bus_pid) {
+		close(fds[0]);
+		snprintf(fd_arg, sizeof(fd_arg), "--print-address=%d", fds[1]);
+		execlp("dbus-daemon", "dbus-daemon", "--session", "--nofork",
+				fd_arg, NULL);
+		warn("can't run dbus-daemon");
+		_exit(EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	len = read(fds[0], addr, sizeof(addr) - 1);
+	close(fds[0]);
+	if (len <= 0)
+		errx(EXIT_FAILURE, "can't read dbus-daemon address");
+
+	addr[len] = '\0';
+	nl = strchr(addr, '\n');
+	if (nl)
+		*nl = '\0';
+
+	setenv("DBUS_SYSTEM_BUS_ADDRESS", addr, 1);
+	setenv("DBUS_SESSION_BUS_ADDRESS", addr, 1);
+	setenv("DBUS_STARTER_BUS_TYPE", "system", 1);
+}
+
+/* wait for the mock to claim its names, so the first scan doesn't race
+ * its startup */
+static void wait_for_mock(void)
+{
+	sd_bus_message *reply;
+	uint64_t deadline;
+	sd_bus *bus;
+	int rc;
+
+	rc = sd_bus_open_system(&bus);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't connect to private bus: %s",
+				strerror(-rc));
+
+	deadline = now_nsec() + 30ull * 1000000000;
+
+	for (;;) {
+		rc = sd_bus_call_method(bus, "org.freedesktop.DBus",
+				"/org/freedesktop/DBus", "org.freedesktop.DBus",
+				"GetNameOwner", NULL, &reply, "s",
+				MAPPER_SERVICE);
+		if (rc >= 0) {
+			sd_bus_message_unref(reply);
+			break;
+		}
+
+		if (now_nsec() > deadline)
+			errx(EXIT_FAILURE, "mock-sensord didn't start");
+
+		usleep(10000);
+	}
+
+	sd_bus_unref(bus);
+}
+
+static void start_mock(const char *mock, unsigned int n_sensors,
+		const char *latency)
+{
+	char n_arg[16];
+
+	snprintf(n_arg, sizeof(n_arg), "%u", n_sensors);
+
+	mock_pid = fork();
+	if (mock_pid < 0)
+		err(EXIT_FAILURE, "fork");
+
+	if (!mock_pid) {
+		execl(mock, mock, "--mapper", "--service", MOCK_SERVICE,
+				"--sensors", n_arg, "--latency", latency, NULL);
+		warn("can't run %s", mock);
+		_exit(EXIT_FAILURE);
+	}
+
+	wait_for_mock();
+}
+
+/* Bus traffic is counted with a dbus-monitor in pcap mode, where each
+ * record is one complete message. We bracket each data point with a
+ * marker signal (which, unlike a method call, has no reply to count),
+ * and total the records in between. The monitor writes to a file rather
+ * than a pipe, so it never blocks (and gets disconnected by the bus)
+ * while we're busy running scans.
+ */
+struct pcap_record {
+	uint32_t	ts_sec;
+	uint32_t	ts_usec;
+	uint32_t	incl_len;
+	uint32_t	orig_len;
+};
+
+static sd_bus *marker_bus;
+static FILE *monitor;
+
+/* read from the monitor output, waiting for it to be written */
+static bool monitor_read(void *buf, size_t len)
+{
+	uint64_t deadline;
+	size_t n;
+
+	deadline = now_nsec() + 10ull * 1000000000;
+
+	for (n = 0; n < len;) {
+		n += fread((char *)buf + n, 1, len - n, monitor);
+		if (n == len)
+			break;
+		if (now_nsec() > deadline)
+			return false;
+		clearerr(monitor);
+		usleep(1000);
+	}
+
+	return true;
+}
+
+static void start_monitor(void)
+{
+	char hdr[24];
+	int fd;
+
+	snprintf(monitor_path, sizeof(monitor_path), "%s/monitor", tmpdir);
+	fd = open(monitor_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		err(EXIT_FAILURE, "can't create %s", monitor_path);
+
+	monitor_pid = fork();
+	if (monitor_pid < 0)
+		err(EXIT_FAILURE, "fork");
+
+	if (!monitor_pid) {
+		dup2(fd, STDOUT_FILENO);
+		execlp("dbus-monitor", "dbus-monitor", "--system", "--pcap",
+				NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	monitor = fopen(monitor_path, "r");
+	if (!monitor)
+		err(EXIT_FAILURE, "can't open %s", monitor_path);
+
+	/* the pcap file header */
+	if (!monitor_read(hdr, sizeof(hdr))) {
+		warnx("dbus-monitor unavailable; not counting bus traffic");
+		fclose(monitor);
+		monitor = NULL;
+		stop_process(&monitor_pid);
+		return;
+	}
+
+	if (sd_bus_open_system(&marker_bus) < 0)
+		errx(EXIT_FAILURE, "can't connect to private bus");
+}
+
+/* Emit a marker, and read monitor records up to it, returning the total
+ * size and number of the messages before it. */
+static void monitor_sync(uint64_t *bytes, unsigned long *msgs)
+{
+	struct pcap_record rec;
+	static char *buf;
+	static size_t buf_len;
+	bool found;
+	int rc;
+
+	rc = sd_bus_emit_signal(marker_bus, "/", "org.example.BenchScan",
+			MARKER_MEMBER, NULL);
+	if (rc >= 0)
+		rc = sd_bus_flush(marker_bus);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't send marker: %s", strerror(-rc));
+
+	*bytes = 0;
+	*msgs = 0;
+
+	for (found = false; !found;) {
+		if (!monitor_read(&rec, sizeof(rec)))
+			errx(EXIT_FAILURE, "dbus-monitor stopped");
+
+		if (rec.incl_len > buf_len) {
+			buf_len = rec.incl_len;
+			buf = realloc(buf, buf_len);
+			if (!buf)
+				err(EXIT_FAILURE, "realloc");
+		}
+
+		if (!monitor_read(buf, rec.incl_len))
+			errx(EXIT_FAILURE, "dbus-monitor stopped");
+
+		found = memmem(buf, rec.incl_len, MARKER_MEMBER,
+				strlen(MARKER_MEMBER)) != NULL;
+		if (!found) {
+			*bytes += rec.orig_len;
+			(*msgs)++;
+		}
+	}
+}
+
+/* run one scan, returning its duration in ns */
+static uint64_t run_scan(char * const *argv)
+{
+	uint64_t start;
+	int status, fd;
+	pid_t pid;
+
+	start = now_nsec();
+
+	pid = fork();
+	if (pid < 0)
+		err(EXIT_FAILURE, "fork");
+
+	if (!pid) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0)
+			dup2(fd, STDOUT_FILENO);
+		execv(argv[0], argv);
+		warn("can't run %s", argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		err(EXIT_FAILURE, "waitpid");
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(EXIT_FAILURE, "%s failed", argv[0]);
+
+	return now_nsec() - start;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static void bench_engine(const char *sensor_query, unsigned int n_sensors,
+		const char *engine, const struct props_mode *props,
+		double duration)
+{
+	char *argv[] = {
+		(char *)sensor_query, "--direct", "--cache", cache_path,
+		"--engine", (char *)engine,
+		(char *)props->arg, NULL,
+	};
+	uint64_t *samples, total, deadline, bytes;
+	unsigned int n, alloc;
+	char traffic[32];
+	unsigned long msgs;
+
+	alloc = 64;
+	samples = malloc(alloc * sizeof(*samples));
+	if (!samples)
+		err(EXIT_FAILURE, "malloc");
+
+	if (monitor)
+		monitor_sync(&bytes, &msgs);
+
+	n = 0;
+	total = 0;
+	deadline = now_nsec() + (uint64_t)(duration * 1e9);
+
+	while (n < MIN_SCANS || now_nsec() < deadline) {
+		if (n == alloc) {
+			alloc *= 2;
+			samples = realloc(samples, alloc * sizeof(*samples));
+			if (!samples)
+				err(EXIT_FAILURE, "realloc");
+		}
+		samples[n] = run_scan(argv);
+		total += samples[n++];
+	}
+
+	if (monitor) {
+		monitor_sync(&bytes, &msgs);
+		snprintf(traffic, sizeof(traffic), "%10.1f %8.1f",
+				bytes / 1024.0 / n, (double)msgs / n);
+	} else {
+		snprintf(traffic, sizeof(traffic), "%10s %8s", "-", "-");
+	}
+
+	qsort(samples, n, sizeof(*samples), u64_cmp);
+
+	printf("%8u  %-6s %-8s %6u %10.1f %10.3f %10.3f %10.3f %10.3f %s\n",
+			n_sensors, engine, props->name, n,
+			n * 1e9 / total, total / 1e6 / n, samples[n / 2] / 1e6,
+			samples[0] / 1e6, samples[n - 1] / 1e6, traffic);
+	fflush(stdout);
+
+	free(samples);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options] <sensor-query> <mock-sensord>\n"
+		"options:\n"
+		"  -n, --sensors=N,...    sensor counts "
+					"(default 10,100,1000,10000)\n"
+		"  -e, --engines=E,...    query engines (default "
+					"sync,async,bulk)\n"
+		"  -p, --props=P,...      properties to request: all, "
+					"filtered, values\n"
+		"                         (default all three)\n"
+		"  -l, --latency=USEC     mock per-call latency (default 0)\n"
+		"  -t, --time=SECS        time per data point (default 2)\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "sensors",	required_argument,	NULL, 'n' },
+		{ "engines",	required_argument,	NULL, 'e' },
+		{ "props",	required_argument,	NULL, 'p' },
+		{ "latency",	required_argument,	NULL, 'l' },
+		{ "time",	required_argument,	NULL, 't' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ 0 },
+	};
+	const char *sensor_query, *mock, *latency;
+	char *counts, *engines, *engine_list, *count, *engine, *props;
+	bool props_enabled[ARRAY_SIZE(props_modes)];
+	char *sp1, *sp2, *endp;
+	unsigned int i;
+	char *warmup_argv[6];
+	unsigned long n_sensors;
+	double duration;
+	int rc;
+
+	counts = strdup("10,100,1000,10000");
+	engines = strdup("sync,async,bulk");
+	latency = "0";
+	duration = 2;
+	for (i = 0; i < ARRAY_SIZE(props_modes); i++)
+		props_enabled[i] = true;
+
+	for (;;) {
+		rc = getopt_long(argc, argv, "n:e:p:l:t:h", options, NULL);
+		if (rc == -1)
+			break;
+
+		switch (rc) {
+		case 'n':
+			free(counts);
+			counts = strdup(optarg);
+			break;
+		case 'e':
+			free(engines);
+			engines = strdup(optarg);
+			break;
+		case 'p':
+			memset(props_enabled, 0, sizeof(props_enabled));
+			for (props = strtok_r(optarg, ",", &sp1); props;
+					props = strtok_r(NULL, ",", &sp1)) {
+				for (i = 0; i < ARRAY_SIZE(props_modes); i++)
+					if (!strcmp(props, props_modes[i].name))
+						break;
+				if (i == ARRAY_SIZE(props_modes))
+					errx(EXIT_FAILURE, "invalid props "
+							"'%s'", props);
+				props_enabled[i] = true;
+			}
+			break;
+		case 'l':
+			latency = optarg;
+			break;
+		case 't':
+			duration = strtod(optarg, &endp);
+			if (*endp || duration < 0)
+				errx(EXIT_FAILURE, "invalid time '%s'",
+						optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind + 2 != argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!counts || !engines)
+		err(EXIT_FAILURE, "strdup");
+
+	sensor_query = argv[optind];
+	mock = argv[optind + 1];
+
+	if (!mkdtemp(tmpdir))
+		err(EXIT_FAILURE, "mkdtemp");
+	snprintf(cache_path, sizeof(cache_path), "%s/cache", tmpdir);
+
+	atexit(cleanup);
+	start_bus();
+	start_monitor();
+
+	printf("%8s  %-6s %-8s %6s %10s %10s %10s %10s %10s %10s %8s\n",
+			"sensors", "engine", "props", "scans", "scans/s",
+			"mean (ms)", "p50", "min", "max", "KiB/scan",
+			"msgs");
+
+	for (count = strtok_r(counts, ",", &sp1); count;
+			count = strtok_r(NULL, ",", &sp1)) {
+		n_sensors = strtoul(count, &endp, 10);
+		if (*endp || !n_sensors)
+			errx(EXIT_FAILURE, "invalid sensor count '%s'", count);
+
+		start_mock(mock, n_sensors, latency);
+
+		/* populate the discovery cache, so scans measure the
+		 * query engine rather than discovery */
+		warmup_argv[0] = (char *)sensor_query;
+		warmup_argv[1] = "--direct";
+		warmup_argv[2] = "--rescan";
+		warmup_argv[3] = "--cache";
+		warmup_argv[4] = cache_path;
+		warmup_argv[5] = NULL;
+		run_scan(warmup_argv);
+
+		/* strtok_r modifies the list, so work on a copy */
+		engine_list = strdup(engines);
+		if (!engine_list)
+			err(EXIT_FAILURE, "strdup");
+
+		for (engine = strtok_r(engine_list, ",", &sp2); engine;
+				engine = strtok_r(NULL, ",", &sp2)) {
+			for (i = 0; i < ARRAY_SIZE(props_modes); i++)
+				if (props_enabled[i])
+					bench_engine(sensor_query, n_sensors,
+							engine, &props_modes[i],
+							duration);
+		}
+
+		free(engine_list);
+		stop_process(&mock_pid);
+	}
+
+	free(counts);
+	free(engines);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,703 @@
+/* Mock OpenBMC sensor daemon, for benchmarking sensor-query without a
+ * BMC. Exposes a configurable number of sensor objects, with the
+ * Sensor.Value and Threshold.{Critical,Warning} interfaces, plus an
+ * ObjectManager at the sensors root. With --mapper, it also answers
+ * ObjectMapper GetSubTree queries, so it can serve discovery on its own.
+ *
+ * Run it on a private bus; see bench-scan.c.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+#define SENSORS_ROOT	"/xyz/openbmc_project/sensors"
+
+#define VALUE_IFACE	"xyz.openbmc_project.Sensor.Value"
+#define CRIT_IFACE	"xyz.openbmc_project.Sensor.Threshold.Critical"
+#define WARN_IFACE	"xyz.openbmc_project.Sensor.Threshold.Warning"
+#define AVAIL_IFACE	"xyz.openbmc_project.State.Decorator.Availability"
+#define OPSTATUS_IFACE	"xyz.openbmc_project.State.Decorator.OperationalStatus"
+#define ASSOC_IFACE	"xyz.openbmc_project.Association.Definitions"
+
+struct mock_sensor {
+	char	*path;
+	double	d;
+	int64_t	x;
+	bool	lower_crit;
+	bool	upper_crit;
+	bool	lower_warn;
+	bool	upper_warn;
+};
+
+struct mock {
+	sd_bus			*bus;
+	sd_event		*event;
+	const char		*service;
+	struct mock_sensor	*sensors;
+	unsigned int		n_sensors;
+	size_t			prefix_len;
+	char			value_type;
+	bool			has_scale;
+	int64_t			scale;
+	uint64_t		latency_us;
+	unsigned int		update_rate;
+	unsigned int		update_next;
+};
+
+/* A method call whose reply is deferred by latency_us, to model a
+ * sensor daemon that does some work (eg, a sysfs read) per request.
+ */
+struct deferred_reply {
+	sd_bus_message	*reply;
+	sd_event_source	*source;
+};
+
+/* Append the sensor's value as a variant of the configured type. The
+ * integer types narrower than 'x' just take the truncated value.
+ */
+static int append_value(struct mock *mock, struct mock_sensor *sensor,
+		sd_bus_message *m)
+{
+	int64_t x = sensor->x;
+
+	switch (mock->value_type) {
+	case 'y':
+		return sd_bus_message_append(m, "v", "y", (uint8_t)x);
+	case 'n':
+		return sd_bus_message_append(m, "v", "n", (int16_t)x);
+	case 'q':
+		return sd_bus_message_append(m, "v", "q", (uint16_t)x);
+	case 'i':
+		return sd_bus_message_append(m, "v", "i", (int32_t)x);
+	case 'u':
+		return sd_bus_message_append(m, "v", "u", (uint32_t)x);
+	case 'x':
+		return sd_bus_message_append(m, "v", "x", x);
+	case 't':
+		return sd_bus_message_append(m, "v", "t", (uint64_t)x);
+	default:
+		return sd_bus_message_append(m, "v", "d", sensor->d);
+	}
+}
+
+/* append a "Value" dictionary entry */
+static int append_value_prop(struct mock *mock, struct mock_sensor *sensor,
+		sd_bus_message *m)
+{
+	int rc;
+
+	rc = sd_bus_message_open_container(m, 'e', "sv");
+	if (rc >= 0)
+		rc = sd_bus_message_append(m, "s", "Value");
+	if (rc >= 0)
+		rc = append_value(mock, sensor, m);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(m);
+	return rc;
+}
+
+static int append_variant_double(sd_bus_message *m, const char *name,
+		double val)
+{
+	return sd_bus_message_append(m, "{sv}", name, "d", val);
+}
+
+static int append_variant_bool(sd_bus_message *m, const char *name, bool val)
+{
+	return sd_bus_message_append(m, "{sv}", name, "b", (int)val);
+}
+
+static int append_value_iface(struct mock *mock, struct mock_sensor *sensor,
+		sd_bus_message *m)
+{
+	int rc;
+
+	rc = append_value_prop(mock, sensor, m);
+	if (rc < 0)
+		return rc;
+
+	if (mock->has_scale) {
+		rc = sd_bus_message_append(m, "{sv}", "Scale", "x",
+				mock->scale);
+		if (rc < 0)
+			return rc;
+	}
+
+	rc = sd_bus_message_append(m, "{sv}", "Unit", "s",
+			"xyz.openbmc_project.Sensor.Value.Unit.DegreesC");
+	if (rc < 0)
+		return rc;
+
+	rc = append_variant_double(m, "MaxValue", 127);
+	if (rc < 0)
+		return rc;
+
+	return append_variant_double(m, "MinValue", -128);
+}
+
+static int append_crit_iface(struct mock_sensor *sensor, sd_bus_message *m)
+{
+	int rc;
+
+	rc = append_variant_double(m, "CriticalHigh", 105);
+	if (rc >= 0)
+		rc = append_variant_double(m, "CriticalLow", 0);
+	if (rc >= 0)
+		rc = append_variant_bool(m, "CriticalAlarmHigh",
+				sensor->upper_crit);
+	if (rc >= 0)
+		rc = append_variant_bool(m, "CriticalAlarmLow",
+				sensor->lower_crit);
+	return rc;
+}
+
+static int append_warn_iface(struct mock_sensor *sensor, sd_bus_message *m)
+{
+	int rc;
+
+	rc = append_variant_double(m, "WarningHigh", 95);
+	if (rc >= 0)
+		rc = append_variant_double(m, "WarningLow", 5);
+	if (rc >= 0)
+		rc = append_variant_bool(m, "WarningAlarmHigh",
+				sensor->upper_warn);
+	if (rc >= 0)
+		rc = append_variant_bool(m, "WarningAlarmLow",
+				sensor->lower_warn);
+	return rc;
+}
+
+static int append_misc_iface(const char *iface, sd_bus_message *m)
+{
+	if (!strcmp(iface, AVAIL_IFACE))
+		return append_variant_bool(m, "Available", true);
+	if (!strcmp(iface, OPSTATUS_IFACE))
+		return append_variant_bool(m, "Functional", true);
+	if (!strcmp(iface, ASSOC_IFACE))
+		return sd_bus_message_append(m, "{sv}", "Associations",
+				"a(sss)", 1, "chassis", "all_sensors",
+				"/xyz/openbmc_project/inventory/system/board/"
+				"Mock_Board");
+	return 0;
+}
+
+static const char *ifaces[] = {
+	VALUE_IFACE,
+	CRIT_IFACE,
+	WARN_IFACE,
+	AVAIL_IFACE,
+	OPSTATUS_IFACE,
+	ASSOC_IFACE,
+};
+
+/* append the properties of one interface, as a sequence of {sv} entries */
+static int append_iface_props(struct mock *mock, struct mock_sensor *sensor,
+		const char *iface, sd_bus_message *m)
+{
+	if (!strcmp(iface, VALUE_IFACE))
+		return append_value_iface(mock, sensor, m);
+	if (!strcmp(iface, CRIT_IFACE))
+		return append_crit_iface(sensor, m);
+	if (!strcmp(iface, WARN_IFACE))
+		return append_warn_iface(sensor, m);
+	return append_misc_iface(iface, m);
+}
+
+static int append_all_props(struct mock *mock, struct mock_sensor *sensor,
+		const char *iface, sd_bus_message *m)
+{
+	unsigned int i;
+	int rc;
+
+	rc = sd_bus_message_open_container(m, 'a', "{sv}");
+	if (rc < 0)
+		return rc;
+
+	for (i = 0; i < ARRAY_SIZE(ifaces); i++) {
+		if (iface && *iface && strcmp(iface, ifaces[i]))
+			continue;
+		rc = append_iface_props(mock, sensor, ifaces[i], m);
+		if (rc < 0)
+			return rc;
+	}
+
+	return sd_bus_message_close_container(m);
+}
+
+static struct mock_sensor *find_sensor(struct mock *mock, const char *path)
+{
+	unsigned long idx;
+	const char *p;
+	char *endp;
+
+	if (strncmp(path, mock->sensors[0].path, mock->prefix_len))
+		return NULL;
+
+	p = path + mock->prefix_len;
+	idx = strtoul(p, &endp, 10);
+	if (*endp || endp == p || idx >= mock->n_sensors)
+		return NULL;
+
+	return &mock->sensors[idx];
+}
+
+static int deferred_reply_fire(sd_event_source *s, uint64_t usec, void *data)
+{
+	struct deferred_reply *d = data;
+
+	(void)s;
+	(void)usec;
+
+	sd_bus_send(NULL, d->reply, NULL);
+	sd_bus_message_unref(d->reply);
+	sd_event_source_unref(d->source);
+	free(d);
+	return 0;
+}
+
+static int send_reply(struct mock *mock, sd_bus_message *reply)
+{
+	struct deferred_reply *d;
+	int rc;
+
+	if (!mock->latency_us) {
+		rc = sd_bus_send(NULL, reply, NULL);
+		sd_bus_message_unref(reply);
+		return rc < 0 ? rc : 1;
+	}
+
+	d = malloc(sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+	d->reply = reply;
+
+	rc = sd_event_add_time_relative(mock->event, &d->source,
+			CLOCK_MONOTONIC,
+			mock->latency_us, 1, deferred_reply_fire, d);
+	if (rc < 0) {
+		sd_bus_message_unref(reply);
+		free(d);
+		return rc;
+	}
+
+	return 1;
+}
+
+static int handle_sensor(sd_bus_message *m, void *data, sd_bus_error *err)
+{
+	struct mock *mock = data;
+	struct mock_sensor *sensor;
+	sd_bus_message *reply;
+	const char *iface, *prop;
+	int rc;
+
+	(void)err;
+
+	sensor = find_sensor(mock, sd_bus_message_get_path(m));
+	if (!sensor)
+		return 0;
+
+	if (sd_bus_message_is_method_call(m, "org.freedesktop.DBus.Properties",
+				"GetAll")) {
+		rc = sd_bus_message_read(m, "s", &iface);
+		if (rc < 0)
+			return rc;
+
+		rc = sd_bus_message_new_method_return(m, &reply);
+		if (rc < 0)
+			return rc;
+
+		rc = append_all_props(mock, sensor, iface, reply);
+		if (rc < 0) {
+			sd_bus_message_unref(reply);
+			return rc;
+		}
+
+		return send_reply(mock, reply);
+	}
+
+	if (sd_bus_message_is_method_call(m, "org.freedesktop.DBus.Properties",
+				"Get")) {
+		rc = sd_bus_message_read(m, "ss", &iface, &prop);
+		if (rc < 0)
+			return rc;
+
+		if (strcmp(iface, VALUE_IFACE) || strcmp(prop, "Value"))
+			return sd_bus_reply_method_errorf(m,
+				"org.freedesktop.DBus.Error.UnknownProperty",
+				"unknown property %s.%s", iface, prop);
+
+		rc = sd_bus_message_new_method_return(m, &reply);
+		if (rc < 0)
+			return rc;
+
+		rc = append_value(mock, sensor, reply);
+		if (rc < 0) {
+			sd_bus_message_unref(reply);
+			return rc;
+		}
+
+		return send_reply(mock, reply);
+	}
+
+	return 0;
+}
+
+/* the object path and interface dictionary for one object, as used in
+ * both GetManagedObjects replies and InterfacesAdded signals */
+static int append_managed_object_body(struct mock *mock,
+		struct mock_sensor *sensor, sd_bus_message *m)
+{
+	unsigned int i;
+	int rc;
+
+	rc = sd_bus_message_append(m, "o", sensor->path);
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_message_open_container(m, 'a', "{sa{sv}}");
+	if (rc < 0)
+		return rc;
+
+	for (i = 0; i < ARRAY_SIZE(ifaces); i++) {
+		rc = sd_bus_message_open_container(m, 'e', "sa{sv}");
+		if (rc < 0)
+			return rc;
+
+		rc = sd_bus_message_append(m, "s", ifaces[i]);
+		if (rc < 0)
+			return rc;
+
+		rc = append_all_props(mock, sensor, ifaces[i], m);
+		if (rc < 0)
+			return rc;
+
+		rc = sd_bus_message_close_container(m);
+		if (rc < 0)
+			return rc;
+	}
+
+	return sd_bus_message_close_container(m);
+}
+
+static int append_managed_object(struct mock *mock,
+		struct mock_sensor *sensor, sd_bus_message *m)
+{
+	int rc;
+
+	rc = sd_bus_message_open_container(m, 'e', "oa{sa{sv}}");
+	if (rc < 0)
+		return rc;
+
+	rc = append_managed_object_body(mock, sensor, m);
+	if (rc < 0)
+		return rc;
+
+	return sd_bus_message_close_container(m);
+}
+
+static int handle_root(sd_bus_message *m, void *data, sd_bus_error *err)
+{
+	struct mock *mock = data;
+	sd_bus_message *reply;
+	unsigned int i;
+	int rc;
+
+	(void)err;
+
+	if (!sd_bus_message_is_method_call(m,
+				"org.freedesktop.DBus.ObjectManager",
+				"GetManagedObjects"))
+		return 0;
+
+	rc = sd_bus_message_new_method_return(m, &reply);
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_message_open_container(reply, 'a', "{oa{sa{sv}}}");
+	for (i = 0; rc >= 0 && i < mock->n_sensors; i++)
+		rc = append_managed_object(mock, &mock->sensors[i], reply);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(reply);
+	if (rc < 0) {
+		sd_bus_message_unref(reply);
+		return rc;
+	}
+
+	return send_reply(mock, reply);
+}
+
+/* ObjectMapper emulation: answer GetSubTree with our own sensors, so
+ * that discovery can be benchmarked too.
+ */
+static int handle_mapper(sd_bus_message *m, void *data, sd_bus_error *err)
+{
+	struct mock *mock = data;
+	sd_bus_message *reply;
+	unsigned int i;
+	int rc;
+
+	(void)err;
+
+	if (!sd_bus_message_is_method_call(m,
+				"xyz.openbmc_project.ObjectMapper",
+				"GetSubTree"))
+		return 0;
+
+	rc = sd_bus_message_new_method_return(m, &reply);
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_message_open_container(reply, 'a', "{sa{sas}}");
+	for (i = 0; rc >= 0 && i < mock->n_sensors; i++)
+		rc = sd_bus_message_append(reply, "{sa{sas}}",
+				mock->sensors[i].path, 1, mock->service, 3,
+				VALUE_IFACE, CRIT_IFACE, WARN_IFACE);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(reply);
+	if (rc < 0) {
+		sd_bus_message_unref(reply);
+		return rc;
+	}
+
+	return send_reply(mock, reply);
+}
+
+static int emit_value_changed(struct mock *mock, struct mock_sensor *sensor)
+{
+	sd_bus_message *m;
+	int rc;
+
+	rc = sd_bus_message_new_signal(mock->bus, &m, sensor->path,
+			"org.freedesktop.DBus.Properties",
+			"PropertiesChanged");
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_message_append(m, "s", VALUE_IFACE);
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(m, 'a', "{sv}");
+	if (rc >= 0)
+		rc = append_value_prop(mock, sensor, m);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(m);
+	if (rc >= 0)
+		rc = sd_bus_message_append(m, "as", 0);
+	if (rc >= 0)
+		rc = sd_bus_send(mock->bus, m, NULL);
+
+	sd_bus_message_unref(m);
+	return rc;
+}
+
+/* periodically change a subset of sensor values, emitting
+ * PropertiesChanged, to exercise watch mode.
+ */
+static int update_timer(sd_event_source *s, uint64_t usec, void *data)
+{
+	struct mock *mock = data;
+	struct mock_sensor *sensor;
+
+	sensor = &mock->sensors[mock->update_next++ % mock->n_sensors];
+	sensor->d += 0.5;
+	sensor->x += 500;
+
+	emit_value_changed(mock, sensor);
+
+	sd_event_source_set_time(s, usec + 1000000 / mock->update_rate);
+	sd_event_source_set_enabled(s, SD_EVENT_ON);
+	return 0;
+}
+
+/* announce our sensors, as a daemon would on startup, so that long-running
+ * clients can pick them up */
+static int emit_interfaces_added(struct mock *mock, struct mock_sensor *sensor)
+{
+	sd_bus_message *m;
+	int rc;
+
+	rc = sd_bus_message_new_signal(mock->bus, &m, SENSORS_ROOT,
+			"org.freedesktop.DBus.ObjectManager",
+			"InterfacesAdded");
+	if (rc < 0)
+		return rc;
+
+	rc = append_managed_object_body(mock, sensor, m);
+	if (rc >= 0)
+		rc = sd_bus_send(mock->bus, m, NULL);
+
+	sd_bus_message_unref(m);
+	return rc;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"options:\n"
+		"  -s, --service=NAME   bus name to claim\n"
+		"  -n, --sensors=N      number of sensor objects (default 10)\n"
+		"  -t, --type=TYPE      sensor type path component "
+						"(default temperature)\n"
+		"  -v, --value-type=T   Value type: d, or an integer type "
+						"(default d)\n"
+		"  -S, --scale=N        also expose a Scale property\n"
+		"  -l, --latency=USEC   per-call reply latency (default 0)\n"
+		"  -u, --updates=N      value changes per second (default 0)\n"
+		"  -m, --mapper         also act as the ObjectMapper\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "service",	required_argument,	NULL, 's' },
+		{ "sensors",	required_argument,	NULL, 'n' },
+		{ "type",	required_argument,	NULL, 't' },
+		{ "value-type",	required_argument,	NULL, 'v' },
+		{ "scale",	required_argument,	NULL, 'S' },
+		{ "latency",	required_argument,	NULL, 'l' },
+		{ "updates",	required_argument,	NULL, 'u' },
+		{ "mapper",	no_argument,		NULL, 'm' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ 0 },
+	};
+	const char *type;
+	struct mock mock = { 0 };
+	bool mapper;
+	unsigned int i;
+	int rc;
+
+	mock.service = "xyz.openbmc_project.MockSensor";
+	type = "temperature";
+	mock.n_sensors = 10;
+	mock.value_type = 'd';
+	mapper = false;
+
+	for (;;) {
+		rc = getopt_long(argc, argv, "s:n:t:v:S:l:u:mh", options, NULL);
+		if (rc == -1)
+			break;
+
+		switch (rc) {
+		case 's':
+			mock.service = optarg;
+			break;
+		case 'n':
+			mock.n_sensors = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			type = optarg;
+			break;
+		case 'v':
+			mock.value_type = optarg[0];
+			break;
+		case 'S':
+			mock.has_scale = true;
+			mock.scale = strtoll(optarg, NULL, 10);
+			break;
+		case 'l':
+			mock.latency_us = strtoull(optarg, NULL, 10);
+			break;
+		case 'u':
+			mock.update_rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			mapper = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!mock.n_sensors)
+		errx(EXIT_FAILURE, "need at least one sensor");
+	if (!mock.value_type || !strchr("ynqiuxtd", mock.value_type))
+		errx(EXIT_FAILURE, "value type must be one of ynqiuxtd");
+
+	mock.sensors = calloc(mock.n_sensors, sizeof(*mock.sensors));
+	if (!mock.sensors)
+		err(EXIT_FAILURE, "calloc");
+
+	for (i = 0; i < mock.n_sensors; i++) {
+		struct mock_sensor *sensor = &mock.sensors[i];
+
+		if (asprintf(&sensor->path, "%s/%s/Mock%u",
+					SENSORS_ROOT, type, i) < 0)
+			err(EXIT_FAILURE, "asprintf");
+
+		sensor->d = 20.0 + (i % 50) * 1.25;
+		sensor->x = 20000 + (i % 50) * 1250;
+		sensor->upper_warn = (i % 7) == 3;
+		sensor->upper_crit = (i % 23) == 5;
+	}
+	mock.prefix_len = strlen(mock.sensors[0].path) - 1;
+
+	rc = sd_event_default(&mock.event);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "sd_event_default: %s", strerror(-rc));
+
+	rc = sd_bus_default(&mock.bus);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't connect to dbus: %s", strerror(-rc));
+
+	rc = sd_bus_attach_event(mock.bus, mock.event, 0);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "sd_bus_attach_event: %s", strerror(-rc));
+
+	rc = sd_bus_add_fallback(mock.bus, NULL, SENSORS_ROOT,
+			handle_sensor, &mock);
+	if (rc >= 0)
+		rc = sd_bus_add_object(mock.bus, NULL, SENSORS_ROOT,
+				handle_root, &mock);
+	if (rc >= 0 && mapper)
+		rc = sd_bus_add_object(mock.bus, NULL,
+				"/xyz/openbmc_project/object_mapper",
+				handle_mapper, &mock);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't register objects: %s",
+				strerror(-rc));
+
+	rc = sd_bus_request_name(mock.bus, mock.service, 0);
+	if (rc >= 0 && mapper)
+		rc = sd_bus_request_name(mock.bus,
+				"xyz.openbmc_project.ObjectMapper", 0);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't claim bus name: %s", strerror(-rc));
+
+	for (i = 0; i < mock.n_sensors; i++)
+		emit_interfaces_added(&mock, &mock.sensors[i]);
+
+	if (mock.update_rate) {
+		uint64_t now;
+
+		sd_event_now(mock.event, CLOCK_MONOTONIC, &now);
+		rc = sd_event_add_time(mock.event, NULL, CLOCK_MONOTONIC,
+				now + 1000000 / mock.update_rate, 1,
+				update_timer, &mock);
+		if (rc < 0)
+			errx(EXIT_FAILURE, "can't add timer: %s",
+					strerror(-rc));
+	}
+
+	rc = sd_event_loop(mock.event);
+
+	return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+/* CBOR output, for --format=cbor: a CBOR sequence (RFC 8742) for
+ * consumers that want values without parsing any text.
+ *
+ * The stream opens with the RFC 9277 magic, a tagged byte string "BOR".
+ * After that, each item is either:
+ *
+ *  - a path dictionary, a map {"id": N, "paths": [path, ...]}, which
+ *    assigns IDs N, N+1, ... to the paths. IDs count up from zero over
+ *    the whole stream, and are never reused; a dictionary precedes any
+ *    record that refers to its paths. Usually there's just one, at the
+ *    start, but in watch mode, sensors that appear later get their own.
+ *
+ *  - a scan, an indefinite-length array of records. In watch mode, each
+ *    batch of changes is a scan.
+ *
+ * Every record has the same shape and size, CBOR_RECORD_SIZE bytes, so
+ * a consumer can also step through a scan without a general decoder:
+ *
+ *	84				array(4)
+ *	1a <u32>			path ID
+ *	18 <u8>				type: 'd', 'x' or 't', from
+ *					sensor_data.type; 0 if the sensor
+ *					couldn't be read; '-' if it was removed
+ *	fb <f64> | 1b <u64> | 3b <u64>	value: double, or integer ('x' and
+ *					't'); NaN if there's no value
+ *	18 <u8>				alarms: SENSOR_SHM_* flags
+ *
+ * Scaled integers are sent as doubles, with the scale applied. As in
+ * json.c, the formatters never allocate, and return the full length of
+ * the item even if it doesn't fit in the buffer.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "sensor-query.h"
+#include "sensor-shm.h"
+
+#define CBOR_UINT	0
+#define CBOR_NEGINT	1
+#define CBOR_BYTES	2
+#define CBOR_TEXT	3
+#define CBOR_ARRAY	4
+#define CBOR_MAP	5
+#define CBOR_TAG	6
+#define CBOR_SIMPLE	7
+
+/* additional information, for the argument's size */
+#define CBOR_ARG_U8	24
+#define CBOR_ARG_U16	25
+#define CBOR_ARG_U32	26
+#define CBOR_ARG_U64	27
+
+/* RFC 9277: tag 55800 on "BOR" marks a CBOR sequence */
+#define CBOR_TAG_SEQUENCE	55800
+
+#define CBOR_TYPE_NONE		0
+#define CBOR_TYPE_REMOVED	'-'
+
+struct cbor_writer {
+	unsigned char	*buf;
+	size_t		size;
+	size_t		len;	/* may exceed size */
+};
+
+static void cbor_init(struct cbor_writer *w, char *buf, size_t size)
+{
+	w->buf = (unsigned char *)buf;
+	w->size = size;
+	w->len = 0;
+}
+
+static void cbor_putc(struct cbor_writer *w, unsigned char c)
+{
+	if (w->len < w->size)
+		w->buf[w->len] = c;
+	w->len++;
+}
+
+static void cbor_write(struct cbor_writer *w, const void *data, size_t len)
+{
+	size_t room;
+
+	if (w->len < w->size) {
+		room = w->size - w->len;
+		memcpy(w->buf + w->len, data, len < room ? len : room);
+	}
+	w->len += len;
+}
+
+/* an item's initial byte, and an argument of the given size (1, 2, 4 or
+ * 8 bytes), big-endian */
+static void cbor_head_sized(struct cbor_writer *w, unsigned int major,
+		uint64_t val, unsigned int size)
+{
+	unsigned int shift;
+
+	switch (size) {
+	case 1:
+		cbor_putc(w, major << 5 | CBOR_ARG_U8);
+		break;
+	case 2:
+		cbor_putc(w, major << 5 | CBOR_ARG_U16);
+		break;
+	case 4:
+		cbor_putc(w, major << 5 | CBOR_ARG_U32);
+		break;
+	default:
+		cbor_putc(w, major << 5 | CBOR_ARG_U64);
+		size = 8;
+	}
+
+	for (shift = size * 8; shift; shift -= 8)
+		cbor_putc(w, val >> (shift - 8));
+}
+
+/* an item's head, in the shortest encoding */
+static void cbor_head(struct cbor_writer *w, unsigned int major,
+		uint64_t val)
+{
+	if (val < CBOR_ARG_U8)
+		cbor_putc(w, major << 5 | val);
+	else if (val <= UINT8_MAX)
+		cbor_head_sized(w, major, val, 1);
+	else if (val <= UINT16_MAX)
+		cbor_head_sized(w, major, val, 2);
+	else if (val <= UINT32_MAX)
+		cbor_head_sized(w, major, val, 4);
+	else
+		cbor_head_sized(w, major, val, 8);
+}
+
+static void cbor_text(struct cbor_writer *w, const char *str)
+{
+	size_t len = strlen(str);
+
+	cbor_head(w, CBOR_TEXT, len);
+	cbor_write(w, str, len);
+}
+
+static void cbor_float64(struct cbor_writer *w, double val)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &val, sizeof(bits));
+	cbor_head_sized(w, CBOR_SIMPLE, bits, 8);
+}
+
+/* The stream's first item: the CBOR sequence magic */
+int format_magic_cbor(char *buf, size_t len)
+{
+	struct cbor_writer w;
+
+	cbor_init(&w, buf, len);
+	cbor_head(&w, CBOR_TAG, CBOR_TAG_SEQUENCE);
+	cbor_head(&w, CBOR_BYTES, 3);
+	cbor_write(&w, "BOR", 3);
+
+	return w.len;
+}
+
+/* A path dictionary item, for the n paths with IDs from first */
+int format_paths_cbor(char *buf, size_t len, uint32_t first,
+		char *const *paths, unsigned int n)
+{
+	struct cbor_writer w;
+	unsigned int i;
+
+	cbor_init(&w, buf, len);
+	cbor_head(&w, CBOR_MAP, 2);
+	cbor_text(&w, "id");
+	cbor_head(&w, CBOR_UINT, first);
+	cbor_text(&w, "paths");
+	cbor_head(&w, CBOR_ARRAY, n);
+	for (i = 0; i < n; i++)
+		cbor_text(&w, paths[i]);
+
+	return w.len;
+}
+
+static void cbor_record(struct cbor_writer *w, uint32_t id,
+		unsigned char type)
+{
+	cbor_head(w, CBOR_ARRAY, 4);
+	cbor_head_sized(w, CBOR_UINT, id, 4);
+	cbor_head_sized(w, CBOR_UINT, type, 1);
+}
+
+/* A sensor's record; see above. rc is as for sensor_result_fn. */
+int format_sensor_cbor(char *buf, size_t len, uint32_t id,
+		const struct sensor_data *sensor, int rc)
+{
+	struct cbor_writer w;
+	uint64_t start;
+	uint8_t alarms;
+
+	start = stats_start();
+	cbor_init(&w, buf, len);
+
+	if (rc) {
+		cbor_record(&w, id, CBOR_TYPE_NONE);
+		cbor_float64(&w, NAN);
+		cbor_head_sized(&w, CBOR_UINT, 0, 1);
+		goto out;
+	}
+
+	if (sensor->scale || sensor->type == 'd') {
+		cbor_record(&w, id, 'd');
+		cbor_float64(&w, sensor_value_double(sensor));
+	} else if (sensor->type == 't') {
+		cbor_record(&w, id, 't');
+		cbor_head_sized(&w, CBOR_UINT, sensor->value.t, 8);
+	} else if (sensor->value.x < 0) {
+		/* -1 - n, so n is the complement */
+		cbor_record(&w, id, 'x');
+		cbor_head_sized(&w, CBOR_NEGINT, ~(uint64_t)sensor->value.x,
+				8);
+	} else {
+		cbor_record(&w, id, 'x');
+		cbor_head_sized(&w, CBOR_UINT, sensor->value.x, 8);
+	}
+
+	alarms = (sensor->lower_crit ? SENSOR_SHM_LOWER_CRIT : 0) |
+		(sensor->upper_crit ? SENSOR_SHM_UPPER_CRIT : 0) |
+		(sensor->lower_warn ? SENSOR_SHM_LOWER_WARN : 0) |
+		(sensor->upper_warn ? SENSOR_SHM_UPPER_WARN : 0);
+	cbor_head_sized(&w, CBOR_UINT, alarms, 1);
+
+out:
+	stats_end(STATS_FORMAT, start);
+	return w.len;
+}
+
+/* a record for a sensor that has disappeared, in watch mode */
+int format_removed_cbor(char *buf, size_t len, uint32_t id)
+{
+	struct cbor_writer w;
+
+	cbor_init(&w, buf, len);
+	cbor_record(&w, id, CBOR_TYPE_REMOVED);
+	cbor_float64(&w, NAN);
+	cbor_head_sized(&w, CBOR_UINT, 0, 1);
+
+	return w.len;
+}
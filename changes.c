@@ -0,0 +1,387 @@
+/* Change-only output (--changes): a sensor is output only when its state
+ * differs from what was last output for it, so that polling doesn't
+ * repeat the same readings. A sensor's state has changed if:
+ *
+ *  - it's new, or it's gone from unreadable to readable or back;
+ *  - any of its alarm bits have flipped; or
+ *  - its value has moved by more than its deadband: an absolute amount,
+ *    or a percentage of the last value output. Without a deadband, any
+ *    change counts.
+ *
+ * Deadbands are set for all sensors, or per type (--deadband=[TYPE:]N,
+ * or N% for a relative one), with a type's taking precedence.
+ *
+ * The comparison is against the last state output, not the last read, so
+ * that a slow drift is output once it has added up. In watch mode the
+ * states are kept in memory; one-shot queries keep them in a file
+ * between runs:
+ *
+ *   struct state_header
+ *   struct state_entry entries[n_entries]
+ *   char strtab[strtab_size]			(NUL-terminated paths)
+ *
+ * in native byte order, as the sensor cache is. Consumers polling
+ * independently need a file each.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensor-query.h"
+#include "sensor-shm.h"
+
+#define STATE_MAGIC	"SQD"
+#define STATE_VERSION	1
+
+struct state_header {
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	n_entries;
+	uint32_t	strtab_size;
+};
+
+struct state_entry {
+	uint32_t	path;		/* offset into strtab */
+	char		type;		/* zero if it couldn't be read */
+	int8_t		scale;
+	uint8_t		flags;		/* SENSOR_SHM_* alarm bits */
+	uint8_t		pad;
+	uint64_t	value;		/* the bits of sensor_data.value */
+};
+
+struct deadband {
+	char		*type;		/* NULL for all sensors */
+	double		value;
+	bool		relative;
+};
+
+/* the last state output for a sensor */
+struct change_entry {
+	bool			known;
+	bool			readable;
+	/* the deadband is looked up on first use */
+	bool			band_set;
+	const struct deadband	*band;
+	struct sensor_data	data;
+};
+
+static uint8_t alarm_flags(const struct sensor_data *sensor)
+{
+	return (sensor->lower_crit ? SENSOR_SHM_LOWER_CRIT : 0) |
+		(sensor->upper_crit ? SENSOR_SHM_UPPER_CRIT : 0) |
+		(sensor->lower_warn ? SENSOR_SHM_LOWER_WARN : 0) |
+		(sensor->upper_warn ? SENSOR_SHM_UPPER_WARN : 0);
+}
+
+/* Add a deadband, from an argument of the form [TYPE:]N[%]. A later one
+ * for the same type replaces an earlier one.
+ */
+int change_filter_add_deadband(struct change_filter *filter,
+		const char *arg)
+{
+	const char *sep, *num;
+	struct deadband *band;
+	unsigned int i;
+	char *type, *endp;
+	double value;
+
+	sep = strchr(arg, ':');
+	num = sep ? sep + 1 : arg;
+
+	value = strtod(num, &endp);
+	if (endp == num || !isfinite(value) || value < 0)
+		return -EINVAL;
+
+	if (*endp == '%')
+		endp++;
+	if (*endp)
+		return -EINVAL;
+
+	type = NULL;
+	if (sep) {
+		type = strndup(arg, sep - arg);
+		if (!type)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < filter->n_bands; i++) {
+		band = &filter->bands[i];
+		if (!band->type == !type &&
+				(!type || !strcmp(band->type, type))) {
+			free(type);
+			goto set;
+		}
+	}
+
+	band = reallocarray(filter->bands, filter->n_bands + 1,
+			sizeof(*band));
+	if (!band) {
+		free(type);
+		return -ENOMEM;
+	}
+	filter->bands = band;
+	band = &filter->bands[filter->n_bands++];
+	band->type = type;
+
+set:
+	band->value = value;
+	band->relative = endp[-1] == '%';
+	return 0;
+}
+
+static const struct deadband *find_deadband(
+		const struct change_filter *filter, const char *path)
+{
+	const struct sensor_desc desc = { .object = path };
+	const struct deadband *band = NULL;
+	unsigned int i;
+
+	for (i = 0; i < filter->n_bands; i++) {
+		if (!filter->bands[i].type)
+			band = band ? band : &filter->bands[i];
+		else if (sensor_matches_type(&desc, filter->bands[i].type))
+			return &filter->bands[i];
+	}
+
+	return band;
+}
+
+/* the entry for a path, zeroed if it's new */
+static struct change_entry *change_entry(struct change_filter *filter,
+		const char *path)
+{
+	struct change_entry *entries;
+	unsigned int alloc;
+	int id;
+
+	id = path_dict_intern(&filter->paths, path);
+	if (id < 0)
+		return NULL;
+
+	if ((unsigned int)id >= filter->alloc) {
+		alloc = filter->alloc ? filter->alloc * 2 : 256;
+		entries = reallocarray(filter->entries, alloc,
+				sizeof(*entries));
+		if (!entries)
+			return NULL;
+		memset(entries + filter->alloc, 0,
+				(alloc - filter->alloc) * sizeof(*entries));
+		filter->entries = entries;
+		filter->alloc = alloc;
+	}
+
+	return &filter->entries[id];
+}
+
+static bool value_changed(const struct deadband *band,
+		const struct sensor_data *old, const struct sensor_data *new)
+{
+	double a, b, limit;
+
+	if (old->type != new->type || old->scale != new->scale)
+		return true;
+
+	/* as in watch mode, compare bits, so NaN is unchanged from NaN */
+	if (!band)
+		return memcmp(&old->value, &new->value, sizeof(old->value));
+
+	a = sensor_value_double(old);
+	b = sensor_value_double(new);
+	if (isnan(a) || isnan(b))
+		return isnan(a) != isnan(b);
+
+	limit = band->relative ? fabs(a) * band->value / 100 : band->value;
+	return fabs(b - a) > limit;
+}
+
+/* Check a reading against the last state output for the sensor; rc is
+ * as for sensor_result_fn. Returns 1 if it should be output (and records
+ * it as the last state output), 0 if not, or a negative error.
+ */
+int change_filter_check(struct change_filter *filter,
+		const struct sensor_desc *desc,
+		const struct sensor_data *sensor, int rc)
+{
+	struct change_entry *entry;
+
+	entry = change_entry(filter, desc->object);
+	if (!entry)
+		return -ENOMEM;
+
+	if (!entry->band_set) {
+		entry->band = find_deadband(filter, desc->object);
+		entry->band_set = true;
+	}
+
+	if (entry->known && entry->readable == !rc) {
+		if (rc)
+			return 0;
+		if (alarm_flags(&entry->data) == alarm_flags(sensor) &&
+				!value_changed(entry->band, &entry->data,
+					sensor))
+			return 0;
+	}
+
+	entry->known = true;
+	entry->readable = !rc;
+	if (!rc)
+		entry->data = *sensor;
+	filter->dirty = true;
+	return 1;
+}
+
+/* a sensor has gone: if it comes back, it's new */
+void change_filter_forget(struct change_filter *filter,
+		const struct sensor_desc *desc)
+{
+	struct change_entry *entry;
+
+	entry = change_entry(filter, desc->object);
+	if (entry && entry->known) {
+		entry->known = false;
+		filter->dirty = true;
+	}
+}
+
+static int load_state(struct change_filter *filter, const void *image,
+		size_t len)
+{
+	const struct state_header *hdr = image;
+	const struct state_entry *entries;
+	struct change_entry *entry;
+	const char *strtab;
+	unsigned int i;
+
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, STATE_MAGIC, 4) ||
+			hdr->version != STATE_VERSION)
+		return -EINVAL;
+
+	if (len != sizeof(*hdr) +
+			(size_t)hdr->n_entries * sizeof(*entries) +
+			hdr->strtab_size)
+		return -EINVAL;
+
+	entries = (const struct state_entry *)(hdr + 1);
+	strtab = (const char *)(entries + hdr->n_entries);
+	if (hdr->strtab_size && strtab[hdr->strtab_size - 1])
+		return -EINVAL;
+
+	for (i = 0; i < hdr->n_entries; i++) {
+		const struct state_entry *e = &entries[i];
+
+		if (e->path >= hdr->strtab_size)
+			return -EINVAL;
+
+		entry = change_entry(filter, strtab + e->path);
+		if (!entry)
+			return -ENOMEM;
+
+		entry->known = true;
+		entry->readable = e->type != 0;
+		entry->data.type = e->type;
+		entry->data.scale = e->scale;
+		memcpy(&entry->data.value, &e->value, sizeof(e->value));
+		entry->data.lower_crit = e->flags & SENSOR_SHM_LOWER_CRIT;
+		entry->data.upper_crit = e->flags & SENSOR_SHM_UPPER_CRIT;
+		entry->data.lower_warn = e->flags & SENSOR_SHM_LOWER_WARN;
+		entry->data.upper_warn = e->flags & SENSOR_SHM_UPPER_WARN;
+	}
+
+	return 0;
+}
+
+/* Load the states last output from a file written by change_filter_save().
+ * A state file that's unreadable or invalid is as good as none, so the
+ * caller can carry on without one.
+ */
+int change_filter_load(struct change_filter *filter, const char *path)
+{
+	void *image;
+	size_t len;
+	int rc;
+
+	rc = read_whole_file(path, &image, &len);
+	if (rc < 0)
+		return rc;
+
+	rc = load_state(filter, image, len);
+	free(image);
+	filter->dirty = false;
+	return rc;
+}
+
+/* Save the states last output, if any have changed */
+int change_filter_save(struct change_filter *filter, const char *path)
+{
+	struct state_entry *entries;
+	struct state_header *hdr;
+	size_t len, strtab_size;
+	unsigned int i, n;
+	char *image, *strtab;
+	int rc;
+
+	if (!filter->dirty)
+		return 0;
+
+	for (i = 0, n = 0, strtab_size = 0; i < filter->paths.n; i++) {
+		if (!filter->entries[i].known)
+			continue;
+		n++;
+		strtab_size += strlen(filter->paths.paths[i]) + 1;
+	}
+
+	len = sizeof(*hdr) + n * sizeof(*entries) + strtab_size;
+	image = calloc(1, len);
+	if (!image)
+		return -ENOMEM;
+
+	hdr = (struct state_header *)image;
+	memcpy(hdr->magic, STATE_MAGIC, 4);
+	hdr->version = STATE_VERSION;
+	hdr->n_entries = n;
+	hdr->strtab_size = strtab_size;
+
+	entries = (struct state_entry *)(hdr + 1);
+	strtab = (char *)(entries + n);
+
+	for (i = 0, n = 0, strtab_size = 0; i < filter->paths.n; i++) {
+		const struct change_entry *entry = &filter->entries[i];
+		struct state_entry *e = &entries[n];
+
+		if (!entry->known)
+			continue;
+
+		e->path = strtab_size;
+		strcpy(strtab + strtab_size, filter->paths.paths[i]);
+		strtab_size += strlen(filter->paths.paths[i]) + 1;
+
+		if (entry->readable) {
+			e->type = entry->data.type;
+			e->scale = entry->data.scale;
+			e->flags = alarm_flags(&entry->data);
+			memcpy(&e->value, &entry->data.value,
+					sizeof(e->value));
+		}
+		n++;
+	}
+
+	rc = write_file_atomic(path, image, len);
+	free(image);
+	if (!rc)
+		filter->dirty = false;
+	return rc;
+}
+
+void change_filter_free(struct change_filter *filter)
+{
+	unsigned int i;
+
+	for (i = 0; i < filter->n_bands; i++)
+		free(filter->bands[i].type);
+	free(filter->bands);
+	free(filter->entries);
+	path_dict_free(&filter->paths);
+	memset(filter, 0, sizeof(*filter));
+}
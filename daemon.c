@@ -0,0 +1,410 @@
+/* Daemon mode: keep a live sensor table, through the watch core, and
+ * answer queries from local clients over a unix socket. A client query
+ * then avoids the process's bus connection setup and full scan, and
+ * costs one local socket round-trip. Optionally, the state is also
+ * published to shared memory (see shm.c), for readers that can't
+ * afford even that.
+ *
+ * The protocol is minimal: the client sends a single line containing the
+ * sensor type to query (empty for all sensors), optionally followed by a
+ * space and "values-only". The daemon replies with the same output that
+ * a direct query would print, then closes the connection.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "sensor-query.h"
+
+#define REQUEST_MAX	256
+#define VALUES_ONLY	"values-only"
+
+struct daemon_ctx {
+	const char		*socket_path;
+	int			lock_fd;
+	int			listen_fd;
+	sd_event_source		*listen_source;
+	struct watch_ctx	*watch;
+	const char		*shm_name;
+	struct shm_publisher	*shm;
+};
+
+struct daemon_client {
+	struct daemon_ctx	*ctx;
+	sd_event_source		*source;
+	int			fd;
+	char			request[REQUEST_MAX];
+	size_t			request_len;
+	bool			responding;
+	struct output_buf	response;
+	size_t			response_sent;
+};
+
+static void client_free(struct daemon_client *client)
+{
+	sd_event_source_unref(client->source);
+	close(client->fd);
+	output_free(&client->response);
+	free(client);
+}
+
+/* format the output for every watched sensor matching type */
+static int build_response(struct daemon_client *client, const char *type,
+		bool thresholds)
+{
+	const struct watch_sensor *sensors;
+	unsigned int i, n;
+	int rc;
+
+	sensors = watch_get_sensors(client->ctx->watch, &n);
+
+	for (i = 0; i < n; i++) {
+		struct sensor_data sensor = sensors[i].data;
+
+		if (!sensor_matches_type(&sensors[i].desc, type))
+			continue;
+
+		rc = output_sensor(&client->response, &sensors[i].desc,
+				&sensor, sensors[i].valid ? 0 : -1,
+				thresholds, FORMAT_DEFAULT_DIGITS);
+		if (rc < 0)
+			return rc;
+	}
+
+	client->responding = true;
+	return 0;
+}
+
+static int client_write(struct daemon_client *client)
+{
+	ssize_t rc;
+
+	while (client->response_sent < client->response.len) {
+		rc = send(client->fd,
+				client->response.buf + client->response_sent,
+				client->response.len - client->response_sent,
+				MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			return -errno;
+		}
+		client->response_sent += rc;
+	}
+
+	/* all sent */
+	return 1;
+}
+
+static int client_read(struct daemon_client *client)
+{
+	char *eol, *opt;
+	bool thresholds;
+	ssize_t rc;
+
+	rc = recv(client->fd, client->request + client->request_len,
+			sizeof(client->request) - client->request_len - 1, 0);
+	if (rc < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	client->request_len += rc;
+	client->request[client->request_len] = '\0';
+
+	eol = strchr(client->request, '\n');
+	if (!eol) {
+		/* EOF or a full buffer without a newline: invalid request */
+		if (!rc || client->request_len == sizeof(client->request) - 1)
+			return -EINVAL;
+		return 0;
+	}
+	*eol = '\0';
+
+	thresholds = true;
+	opt = strchr(client->request, ' ');
+	if (opt) {
+		*opt++ = '\0';
+		if (strcmp(opt, VALUES_ONLY))
+			return -EINVAL;
+		thresholds = false;
+	}
+
+	rc = build_response(client,
+			client->request[0] ? client->request : NULL,
+			thresholds);
+	if (rc < 0)
+		return rc;
+
+	return 1;
+}
+
+static int client_io(sd_event_source *s, int fd, uint32_t revents,
+		void *data)
+{
+	struct daemon_client *client = data;
+	int rc;
+
+	(void)s;
+	(void)fd;
+
+	if (!client->responding) {
+		rc = client_read(client);
+		if (rc <= 0)
+			goto out;
+	}
+
+	rc = client_write(client);
+	if (rc == 0) {
+		/* socket full; wait for space */
+		rc = sd_event_source_set_io_events(client->source, EPOLLOUT);
+		if (rc >= 0)
+			return 0;
+	}
+
+out:
+	if (rc != 0 || (revents & (EPOLLERR | EPOLLHUP)))
+		client_free(client);
+	return 0;
+}
+
+static int daemon_accept(sd_event_source *s, int fd, uint32_t revents,
+		void *data)
+{
+	struct daemon_ctx *ctx = data;
+	struct daemon_client *client;
+	int client_fd, rc;
+
+	(void)s;
+	(void)revents;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0)
+		return 0;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(client_fd);
+		return 0;
+	}
+
+	client->ctx = ctx;
+	client->fd = client_fd;
+
+	rc = sd_event_add_io(sd_event_source_get_event(s), &client->source,
+			client_fd, EPOLLIN, client_io, client);
+	if (rc < 0) {
+		close(client_fd);
+		free(client);
+		return 0;
+	}
+
+	/* the request has usually arrived by now, so try it immediately
+	 * rather than waiting for another event loop iteration */
+	client_io(client->source, client_fd, 0, client);
+
+	return 0;
+}
+
+static void daemon_updated(struct watch_ctx *watch,
+		const struct watch_sensor *sensor, void *data)
+{
+	struct daemon_ctx *ctx = data;
+	unsigned int n;
+
+	/* nothing to do until setup; the initial layout covers the
+	 * initial scan */
+	if (!ctx->shm)
+		return;
+
+	shm_publisher_update(ctx->shm,
+			sensor - watch_get_sensors(watch, &n), sensor);
+}
+
+static void daemon_changed(struct watch_ctx *watch, void *data)
+{
+	struct daemon_ctx *ctx = data;
+	const struct watch_sensor *sensors;
+	unsigned int n;
+	int rc;
+
+	if (!ctx->shm)
+		return;
+
+	sensors = watch_get_sensors(watch, &n);
+	rc = shm_publisher_layout(ctx->shm, sensors, n);
+	if (rc < 0)
+		fprintf(stderr, "shm: can't publish sensors: %s\n",
+				strerror(-rc));
+}
+
+/* Take the lock for a socket path, in a file beside it, for as long as
+ * we run: only its holder replaces or removes the socket, so a second
+ * daemon can't take over a live one's. -EADDRINUSE if it's held.
+ */
+static int daemon_lock(const char *socket_path)
+{
+	char *path;
+	int fd, rc;
+
+	if (asprintf(&path, "%s.lock", socket_path) < 0)
+		return -ENOMEM;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	free(path);
+	if (fd < 0)
+		return -errno;
+
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		rc = errno == EWOULDBLOCK ? -EADDRINUSE : -errno;
+		close(fd);
+		return rc;
+	}
+
+	return fd;
+}
+
+static int daemon_setup(struct watch_ctx *watch, sd_event *event, void *data)
+{
+	struct daemon_ctx *ctx = data;
+	struct sockaddr_un addr;
+	int rc;
+
+	ctx->watch = watch;
+
+	/* before anything another daemon might be using */
+	rc = daemon_lock(ctx->socket_path);
+	if (rc < 0)
+		return rc;
+	ctx->lock_fd = rc;
+
+	if (ctx->shm_name) {
+		rc = shm_publisher_open(&ctx->shm, ctx->shm_name);
+		if (rc < 0)
+			return rc;
+
+		daemon_changed(watch, ctx);
+	}
+
+	if (strlen(ctx->socket_path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, ctx->socket_path);
+
+	ctx->listen_fd = socket(AF_UNIX,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ctx->listen_fd < 0)
+		return -errno;
+
+	/* remove any stale socket from a previous instance, which held
+	 * the lock */
+	unlink(ctx->socket_path);
+
+	rc = bind(ctx->listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (!rc)
+		rc = listen(ctx->listen_fd, 64);
+	if (rc)
+		return -errno;
+
+	return sd_event_add_io(event, &ctx->listen_source, ctx->listen_fd,
+			EPOLLIN, daemon_accept, ctx);
+}
+
+static const struct watch_ops daemon_ops = {
+	.setup		= daemon_setup,
+	.updated	= daemon_updated,
+	.changed	= daemon_changed,
+};
+
+int daemon_run(sd_bus *bus, const struct query_config *config,
+		struct sensor_table *table, const char *socket_path,
+		const char *shm_name)
+{
+	struct daemon_ctx ctx = { 0 };
+	int rc;
+
+	ctx.socket_path = socket_path;
+	ctx.shm_name = shm_name;
+	ctx.lock_fd = -1;
+	ctx.listen_fd = -1;
+
+	/* watch all sensors; requests filter by type */
+	rc = watch_sensors(bus, config, table, NULL, &daemon_ops, &ctx);
+
+	sd_event_source_unref(ctx.listen_source);
+	if (ctx.listen_fd >= 0) {
+		close(ctx.listen_fd);
+		unlink(socket_path);
+	}
+	shm_publisher_close(ctx.shm);
+	if (ctx.lock_fd >= 0)
+		close(ctx.lock_fd);
+
+	return rc;
+}
+
+/* Client side: send the request, and copy the response to stdout */
+int daemon_query(const char *socket_path, const char *type,
+		bool thresholds)
+{
+	struct sockaddr_un addr;
+	char buf[16384];
+	ssize_t len;
+	int fd, rc;
+
+	if (!socket_path || strlen(socket_path) >= sizeof(addr.sun_path))
+		return -ENOTCONN;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -ENOTCONN;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -ENOTCONN;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%s%s\n", type ? type : "",
+			thresholds ? "" : " " VALUES_ONLY);
+	if (len >= (ssize_t)sizeof(buf) || send(fd, buf, len, MSG_NOSIGNAL)
+			!= len) {
+		close(fd);
+		return -ENOTCONN;
+	}
+
+	rc = 0;
+	for (;;) {
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = -errno;
+			break;
+		}
+		if (!len)
+			break;
+
+		if (write(STDOUT_FILENO, buf, len) != len) {
+			rc = -EIO;
+			break;
+		}
+	}
+
+	close(fd);
+	return rc;
+}
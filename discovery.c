@@ -0,0 +1,1023 @@
+/* Runtime sensor discovery, through the ObjectMapper, and a compact
+ * on-disk cache of the results.
+ *
+ * The cache image is used as the in-memory representation of a
+ * discovered table too: after a mapper query we build the image, and
+ * point the sensor_desc entries into its string table. Saving the cache
+ * is then a single write, and loading it is a single read plus some
+ * bounds checks, with no per-entry parsing or allocation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sensor-query.h"
+
+/* Image layout, all fields in native byte order:
+ *
+ *   struct cache_header
+ *   struct cache_service services[n_services]
+ *   struct cache_sensor sensors[n_sensors]
+ *   char strtab[strtab_size]			(NUL-terminated strings)
+ *
+ * Sensors are sorted by object path. Each service records the unique
+ * bus name that owned it at discovery time, which acts as a generation
+ * number for that service's sensors: if the owner has changed, the
+ * daemon has restarted and its sensors may have too.
+ */
+#define CACHE_MAGIC	"SQC"
+#define CACHE_VERSION	2
+
+struct cache_header {
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	n_services;
+	uint32_t	n_sensors;
+	uint32_t	strtab_size;
+};
+
+/* offsets into strtab; an empty owner string means the service had no
+ * owner when discovered */
+struct cache_service {
+	uint32_t	name;
+	uint32_t	owner;
+};
+
+struct cache_sensor {
+	uint32_t	service;
+	uint32_t	path;
+};
+
+static int sensor_desc_cmp(const void *a, const void *b)
+{
+	const struct sensor_desc *sa = a, *sb = b;
+
+	return strcmp(sa->object, sb->object);
+}
+
+static int service_index(const struct sensor_service *services,
+		unsigned int n_services, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_services; i++)
+		if (!strcmp(services[i].name, name))
+			return i;
+
+	return -1;
+}
+
+/* Point table->descs into an image, validating it as we go. Takes
+ * ownership of the image.
+ */
+static int table_from_image(struct sensor_table *table, void *image,
+		size_t len)
+{
+	const struct cache_header *hdr = image;
+	const struct cache_service *cache_services;
+	const struct cache_sensor *sensors;
+	struct sensor_service *services;
+	struct sensor_desc *descs;
+	const char *strtab;
+	size_t hdrs_len;
+	unsigned int i;
+
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, CACHE_MAGIC, 4) ||
+			hdr->version != CACHE_VERSION)
+		goto err_inval;
+
+	hdrs_len = sizeof(*hdr) +
+		(size_t)hdr->n_services * sizeof(*cache_services) +
+		(size_t)hdr->n_sensors * sizeof(*sensors);
+
+	if (hdrs_len > len || len - hdrs_len != hdr->strtab_size ||
+			!hdr->strtab_size)
+		goto err_inval;
+
+	cache_services = (const struct cache_service *)(hdr + 1);
+	sensors = (const struct cache_sensor *)
+		(cache_services + hdr->n_services);
+	strtab = (const char *)image + hdrs_len;
+
+	/* the final NUL ensures every in-bounds offset is a valid string */
+	if (strtab[hdr->strtab_size - 1] != '\0')
+		goto err_inval;
+
+	descs = calloc(hdr->n_sensors ? hdr->n_sensors : 1, sizeof(*descs));
+	services = calloc(hdr->n_services ? hdr->n_services : 1,
+			sizeof(*services));
+	if (!descs || !services) {
+		free(descs);
+		free(services);
+		free(image);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < hdr->n_services; i++) {
+		if (cache_services[i].name >= hdr->strtab_size ||
+				cache_services[i].owner >= hdr->strtab_size)
+			goto err_free;
+
+		services[i].name = strtab + cache_services[i].name;
+		services[i].owner = strtab + cache_services[i].owner;
+		if (!*services[i].owner)
+			services[i].owner = NULL;
+	}
+
+	for (i = 0; i < hdr->n_sensors; i++) {
+		if (sensors[i].service >= hdr->n_services ||
+				sensors[i].path >= hdr->strtab_size)
+			goto err_free;
+
+		descs[i].service = services[sensors[i].service].name;
+		descs[i].object = strtab + sensors[i].path;
+	}
+
+	table->descs = descs;
+	table->n_descs = hdr->n_sensors;
+	table->services = services;
+	table->n_services = hdr->n_services;
+	table->alloc_descs = descs;
+	table->alloc_size = hdr->n_sensors;
+	table->image = image;
+	table->image_len = len;
+
+	return 0;
+
+err_free:
+	free(descs);
+	free(services);
+err_inval:
+	free(image);
+	return -EINVAL;
+}
+
+static uint32_t strtab_add(char *strtab, size_t *size, const char *str)
+{
+	uint32_t off = *size;
+
+	strcpy(strtab + off, str);
+	*size += strlen(str) + 1;
+	return off;
+}
+
+/* Build an image from a set of sensors, sorted by path. Each desc's
+ * service must be one of services[].
+ */
+static int build_image(const struct sensor_desc *descs, unsigned int n,
+		const struct sensor_service *services,
+		unsigned int n_services, void **imagep, size_t *lenp)
+{
+	struct cache_service *cache_services;
+	struct cache_sensor *sensors;
+	struct cache_header *hdr;
+	size_t strtab_size, len;
+	char *image, *strtab;
+	unsigned int i;
+	int idx;
+
+	/* the leading empty string serves as a NULL owner */
+	strtab_size = 1;
+	for (i = 0; i < n_services; i++) {
+		strtab_size += strlen(services[i].name) + 1;
+		if (services[i].owner)
+			strtab_size += strlen(services[i].owner) + 1;
+	}
+	for (i = 0; i < n; i++)
+		strtab_size += strlen(descs[i].object) + 1;
+
+	len = sizeof(*hdr) + n_services * sizeof(*cache_services) +
+		n * sizeof(*sensors) + strtab_size;
+
+	image = calloc(1, len);
+	if (!image)
+		return -ENOMEM;
+
+	hdr = (struct cache_header *)image;
+	memcpy(hdr->magic, CACHE_MAGIC, 4);
+	hdr->version = CACHE_VERSION;
+	hdr->n_services = n_services;
+	hdr->n_sensors = n;
+	hdr->strtab_size = strtab_size;
+
+	cache_services = (struct cache_service *)(hdr + 1);
+	sensors = (struct cache_sensor *)(cache_services + n_services);
+	strtab = (char *)(sensors + n);
+
+	strtab_size = 1;
+	for (i = 0; i < n_services; i++) {
+		cache_services[i].name = strtab_add(strtab, &strtab_size,
+				services[i].name);
+		if (services[i].owner)
+			cache_services[i].owner = strtab_add(strtab,
+					&strtab_size, services[i].owner);
+	}
+
+	for (i = 0; i < n; i++) {
+		idx = service_index(services, n_services, descs[i].service);
+		if (idx < 0) {
+			free(image);
+			return -EINVAL;
+		}
+
+		sensors[i].service = idx;
+		sensors[i].path = strtab_add(strtab, &strtab_size,
+				descs[i].object);
+	}
+
+	*imagep = image;
+	*lenp = len;
+	return 0;
+}
+
+struct owner_query {
+	char		**owner;
+	unsigned int	*pending;
+	sd_bus_slot	*slot;
+};
+
+static int owner_reply(sd_bus_message *reply, void *data,
+		sd_bus_error *ret_error)
+{
+	struct owner_query *query = data;
+	const char *owner;
+
+	(void)ret_error;
+
+	/* an error here is generally NameHasNoOwner; leave owner NULL */
+	if (!sd_bus_message_is_method_error(reply, NULL) &&
+			sd_bus_message_read(reply, "s", &owner) > 0)
+		*query->owner = strdup(owner);
+
+	query->slot = sd_bus_slot_unref(query->slot);
+	(*query->pending)--;
+	return 0;
+}
+
+/* Look up the current unique-name owner of each of names[], with all of
+ * the GetNameOwner calls in flight at once. owners[i] is set to an
+ * allocated string, or NULL if the name has no owner.
+ */
+static int get_name_owners(sd_bus *bus, const char * const *names,
+		unsigned int n, char **owners)
+{
+	struct owner_query *queries;
+	unsigned int i, pending;
+	int rc;
+
+	queries = calloc(n ? n : 1, sizeof(*queries));
+	if (!queries)
+		return -ENOMEM;
+
+	pending = 0;
+	rc = 0;
+	for (i = 0; i < n; i++) {
+		owners[i] = NULL;
+
+		/* unique names own themselves */
+		if (names[i][0] == ':') {
+			owners[i] = strdup(names[i]);
+			continue;
+		}
+
+		queries[i].owner = &owners[i];
+		queries[i].pending = &pending;
+
+		rc = sd_bus_call_method_async(bus, &queries[i].slot,
+				"org.freedesktop.DBus", "/org/freedesktop/DBus",
+				"org.freedesktop.DBus", "GetNameOwner",
+				owner_reply, &queries[i], "s", names[i]);
+		if (rc < 0)
+			break;
+
+		pending++;
+	}
+
+	while (rc >= 0 && pending) {
+		rc = sd_bus_process(bus, NULL);
+		if (rc == 0)
+			rc = sd_bus_wait(bus, UINT64_MAX);
+	}
+
+	for (i = 0; i < n; i++)
+		sd_bus_slot_unref(queries[i].slot);
+	free(queries);
+
+	if (rc < 0) {
+		for (i = 0; i < n; i++)
+			free(owners[i]);
+		return rc;
+	}
+
+	return 0;
+}
+
+/* Create a table from a set of (service, path) pairs, deduplicating the
+ * service names, and recording each service's current owner.
+ */
+static int table_from_discovered(sd_bus *bus, struct sensor_table *table,
+		struct sensor_desc *entries, unsigned int n)
+{
+	struct sensor_service *services;
+	unsigned int i, n_services;
+	const char **names;
+	char **owners;
+	size_t len;
+	void *image;
+	int rc, idx;
+
+	qsort(entries, n, sizeof(*entries), sensor_desc_cmp);
+
+	services = calloc(n ? n : 1, sizeof(*services));
+	names = calloc(n ? n : 1, sizeof(*names));
+	owners = calloc(n ? n : 1, sizeof(*owners));
+	if (!services || !names || !owners) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	n_services = 0;
+	for (i = 0; i < n; i++) {
+		idx = service_index(services, n_services, entries[i].service);
+		if (idx >= 0)
+			continue;
+		names[n_services] = entries[i].service;
+		services[n_services++].name = entries[i].service;
+	}
+
+	/* There is a small window between the mapper reply and our owner
+	 * lookups, where a service may restart. In that case we record the
+	 * new owner against the old set of sensors; this is why long-running
+	 * users should also track signals, with sensor_table_watch().
+	 */
+	rc = get_name_owners(bus, names, n_services, owners);
+	if (rc < 0)
+		goto out;
+
+	for (i = 0; i < n_services; i++)
+		services[i].owner = owners[i];
+
+	rc = build_image(entries, n, services, n_services, &image, &len);
+
+	for (i = 0; i < n_services; i++)
+		free(owners[i]);
+
+	if (rc >= 0)
+		rc = table_from_image(table, image, len);
+
+out:
+	free(services);
+	free(names);
+	free(owners);
+	return rc;
+}
+
+/* Query the ObjectMapper for every object under the sensors root that
+ * implements the Sensor.Value interface.
+ */
+int discover_sensors(sd_bus *bus, struct sensor_table *table)
+{
+	struct sensor_desc *entries, *tmp;
+	unsigned int n, alloc;
+	sd_bus_message *reply;
+	int rc;
+
+	rc = sd_bus_call_method(bus, "xyz.openbmc_project.ObjectMapper",
+			"/xyz/openbmc_project/object_mapper",
+			"xyz.openbmc_project.ObjectMapper", "GetSubTree",
+			NULL, &reply, "sias", SENSORS_ROOT, 0, 1, VALUE_IFACE);
+	if (rc < 0)
+		return rc;
+
+	entries = NULL;
+	n = alloc = 0;
+
+	rc = sd_bus_message_enter_container(reply, 'a', "{sa{sas}}");
+	if (rc < 0)
+		goto out;
+
+	for (;;) {
+		const char *path, *service;
+
+		rc = sd_bus_message_enter_container(reply, 'e', "sa{sas}");
+		if (rc <= 0)
+			break;
+
+		rc = sd_bus_message_read(reply, "s", &path);
+		if (rc < 0)
+			break;
+
+		rc = sd_bus_message_enter_container(reply, 'a', "{sas}");
+		if (rc < 0)
+			break;
+
+		/* each path maps to a set of services; there should only be
+		 * one providing Sensor.Value, so take the first.
+		 */
+		service = NULL;
+		for (;;) {
+			const char *tmp_service;
+
+			rc = sd_bus_message_enter_container(reply, 'e', "sas");
+			if (rc <= 0)
+				break;
+
+			rc = sd_bus_message_read(reply, "s", &tmp_service);
+			if (rc < 0)
+				break;
+
+			if (!service)
+				service = tmp_service;
+
+			rc = sd_bus_message_skip(reply, "as");
+			if (rc < 0)
+				break;
+
+			rc = sd_bus_message_exit_container(reply);
+			if (rc < 0)
+				break;
+		}
+		if (rc < 0)
+			break;
+
+		if (service) {
+			if (n == alloc) {
+				alloc = alloc ? alloc * 2 : 64;
+				tmp = realloc(entries, alloc * sizeof(*entries));
+				if (!tmp) {
+					rc = -ENOMEM;
+					break;
+				}
+				entries = tmp;
+			}
+
+			entries[n].service = service;
+			entries[n].object = path;
+			n++;
+		}
+
+		rc = sd_bus_message_exit_container(reply);
+		if (rc >= 0)
+			rc = sd_bus_message_exit_container(reply);
+		if (rc < 0)
+			break;
+	}
+
+	if (rc >= 0)
+		rc = table_from_discovered(bus, table, entries, n);
+
+out:
+	free(entries);
+	sd_bus_message_unref(reply);
+	return rc;
+}
+
+/* Read a whole file into a new allocation */
+int read_whole_file(const char *path, void **datap, size_t *lenp)
+{
+	struct stat statbuf;
+	ssize_t len;
+	void *data;
+	int fd, rc;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	rc = fstat(fd, &statbuf);
+	if (rc) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	data = malloc(statbuf.st_size ? statbuf.st_size : 1);
+	if (!data) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	len = read(fd, data, statbuf.st_size);
+	rc = len < 0 ? -errno : 0;
+	close(fd);
+
+	if (rc || len != statbuf.st_size) {
+		free(data);
+		return rc ? rc : -EIO;
+	}
+
+	*datap = data;
+	*lenp = len;
+	return 0;
+}
+
+int sensor_cache_load(const char *path, struct sensor_table *table)
+{
+	void *image;
+	size_t len;
+	int rc;
+
+	rc = read_whole_file(path, &image, &len);
+	if (rc < 0)
+		return rc;
+
+	return table_from_image(table, image, len);
+}
+
+/* Check that each service in the table is still owned by the same
+ * connection as when the table was built. This costs one (pipelined)
+ * GetNameOwner per service, rather than a full mapper query.
+ */
+int sensor_table_validate(sd_bus *bus, const struct sensor_table *table)
+{
+	const char **names;
+	unsigned int i;
+	char **owners;
+	int rc;
+
+	names = calloc(table->n_services ? table->n_services : 1,
+			sizeof(*names));
+	owners = calloc(table->n_services ? table->n_services : 1,
+			sizeof(*owners));
+	if (!names || !owners) {
+		free(names);
+		free(owners);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < table->n_services; i++)
+		names[i] = table->services[i].name;
+
+	rc = get_name_owners(bus, names, table->n_services, owners);
+	if (rc < 0)
+		goto out;
+
+	for (i = 0; i < table->n_services; i++) {
+		const char *cached = table->services[i].owner;
+
+		if (!cached != !owners[i] ||
+				(cached && strcmp(cached, owners[i])))
+			rc = -ESTALE;
+
+		free(owners[i]);
+	}
+
+out:
+	free(names);
+	free(owners);
+	return rc;
+}
+
+/* Write a file atomically, so a concurrent reader never sees a partial
+ * one.
+ */
+int write_file_atomic(const char *path, const void *data, size_t len)
+{
+	char *tmp_path;
+	ssize_t ret;
+	int fd, rc;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0)
+		return -ENOMEM;
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		rc = -errno;
+		free(tmp_path);
+		return rc;
+	}
+
+	/* mkstemp gives us 0600; our files are useful to other users too */
+	rc = fchmod(fd, 0644) ? -errno : 0;
+
+	if (!rc) {
+		ret = write(fd, data, len);
+		rc = ret < 0 ? -errno : 0;
+		if (!rc && (size_t)ret != len)
+			rc = -EIO;
+	}
+
+	if (close(fd) && !rc)
+		rc = -errno;
+
+	if (!rc && rename(tmp_path, path))
+		rc = -errno;
+
+	if (rc)
+		unlink(tmp_path);
+
+	free(tmp_path);
+	return rc;
+}
+
+int sensor_cache_save(const char *path, const struct sensor_table *table)
+{
+	size_t image_len;
+	void *image;
+	int rc;
+
+	/* only discovered tables are cached */
+	if (!table->alloc_descs)
+		return -EINVAL;
+
+	/* the table may have been patched since we loaded the image, so
+	 * serialise it afresh */
+	rc = build_image(table->descs, table->n_descs, table->services,
+			table->n_services, &image, &image_len);
+	if (rc < 0)
+		return rc;
+
+	rc = write_file_atomic(path, image, image_len);
+	free(image);
+	return rc;
+}
+
+/* Incremental updates, for long-running modes. Rather than re-querying
+ * the mapper, we patch the table from signals:
+ *
+ *  - NameOwnerChanged: a service has restarted or exited, so drop its
+ *    sensors. A restarted daemon announces its new objects through
+ *    InterfacesAdded.
+ *
+ *  - InterfacesAdded/InterfacesRemoved, with a Sensor.Value interface:
+ *    add or remove the sensor.
+ *
+ * Signals carry the sender's unique name; we map that to a service
+ * through the owners recorded in the table. Sensors from a sender we
+ * don't yet know are recorded under its unique name, and adopted by the
+ * well-known name once its NameOwnerChanged arrives.
+ */
+static char *table_strdup(struct sensor_table *table, const char *str)
+{
+	char **strings, *s;
+
+	strings = realloc(table->strings,
+			(table->n_strings + 1) * sizeof(*strings));
+	if (!strings)
+		return NULL;
+	table->strings = strings;
+
+	s = strdup(str);
+	if (s)
+		table->strings[table->n_strings++] = s;
+	return s;
+}
+
+static int find_service_by_owner(struct sensor_table *table,
+		const char *owner)
+{
+	unsigned int i;
+
+	for (i = 0; i < table->n_services; i++)
+		if (table->services[i].owner &&
+				!strcmp(table->services[i].owner, owner))
+			return i;
+
+	return -1;
+}
+
+static int add_service(struct sensor_table *table, const char *name,
+		const char *owner)
+{
+	struct sensor_service *services;
+
+	services = realloc(table->services,
+			(table->n_services + 1) * sizeof(*services));
+	if (!services)
+		return -ENOMEM;
+	table->services = services;
+
+	services[table->n_services].name = table_strdup(table, name);
+	services[table->n_services].owner = owner ?
+		table_strdup(table, owner) : NULL;
+	if (!services[table->n_services].name ||
+			(owner && !services[table->n_services].owner))
+		return -ENOMEM;
+
+	return table->n_services++;
+}
+
+static int find_sensor(struct sensor_table *table, const char *path,
+		bool *found)
+{
+	unsigned int lo = 0, hi = table->n_descs;
+
+	/* binary search for path, or its insertion point */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		int cmp = strcmp(path, table->alloc_descs[mid].object);
+
+		if (!cmp) {
+			*found = true;
+			return mid;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	*found = false;
+	return lo;
+}
+
+static int add_sensor(struct sensor_table *table, const char *service,
+		const char *path)
+{
+	struct sensor_desc *descs;
+	bool found;
+	int idx;
+
+	idx = find_sensor(table, path, &found);
+	if (found) {
+		table->alloc_descs[idx].service = service;
+		return 0;
+	}
+
+	if (table->n_descs == table->alloc_size) {
+		unsigned int size = table->alloc_size ?
+			table->alloc_size * 2 : 16;
+
+		descs = realloc(table->alloc_descs, size * sizeof(*descs));
+		if (!descs)
+			return -ENOMEM;
+		table->alloc_descs = descs;
+		table->descs = descs;
+		table->alloc_size = size;
+	}
+
+	path = table_strdup(table, path);
+	if (!path)
+		return -ENOMEM;
+
+	descs = table->alloc_descs;
+	memmove(&descs[idx + 1], &descs[idx],
+			(table->n_descs - idx) * sizeof(*descs));
+	descs[idx].service = service;
+	descs[idx].object = path;
+	table->n_descs++;
+
+	return 1;
+}
+
+static void remove_sensor_at(struct sensor_table *table, unsigned int idx)
+{
+	struct sensor_desc *descs = table->alloc_descs;
+
+	memmove(&descs[idx], &descs[idx + 1],
+			(table->n_descs - idx - 1) * sizeof(*descs));
+	table->n_descs--;
+}
+
+/* remove all sensors provided by a service, returning the number
+ * removed */
+static unsigned int remove_service_sensors(struct sensor_table *table,
+		const char *service)
+{
+	unsigned int i, n;
+
+	for (i = 0, n = 0; i < table->n_descs; ) {
+		if (table->alloc_descs[i].service == service) {
+			remove_sensor_at(table, i);
+			n++;
+		} else {
+			i++;
+		}
+	}
+
+	return n;
+}
+
+static void table_changed(struct sensor_table *table)
+{
+	table->generation++;
+	if (table->changed)
+		table->changed(table, table->changed_data);
+}
+
+static int name_owner_changed(sd_bus_message *m, void *data,
+		sd_bus_error *ret_error)
+{
+	struct sensor_table *table = data;
+	const char *name, *old_owner, *new_owner;
+	bool changed = false;
+	int idx, uniq_idx;
+	unsigned int i;
+
+	(void)ret_error;
+
+	if (sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner) < 0)
+		return 0;
+
+	idx = service_index(table->services, table->n_services, name);
+
+	if (name[0] == ':') {
+		/* a connection we know only by unique name has gone */
+		if (idx >= 0 && !*new_owner) {
+			changed = remove_service_sensors(table,
+					table->services[idx].name);
+			table->services[idx].owner = NULL;
+		}
+		goto out;
+	}
+
+	/* has an unknown connection, from which we've already seen
+	 * sensors, just acquired a well-known name? */
+	uniq_idx = *new_owner ? service_index(table->services,
+			table->n_services, new_owner) : -1;
+
+	if (idx < 0 && uniq_idx < 0)
+		return 0;
+
+	if (idx >= 0) {
+		struct sensor_service *svc = &table->services[idx];
+
+		if (svc->owner && !strcmp(svc->owner, new_owner))
+			return 0;
+
+		changed = remove_service_sensors(table, svc->name);
+		svc->owner = *new_owner ? table_strdup(table, new_owner) : NULL;
+	} else {
+		idx = add_service(table, name, new_owner);
+		if (idx < 0)
+			return 0;
+	}
+
+	if (uniq_idx >= 0) {
+		const char *uniq_name = table->services[uniq_idx].name;
+
+		for (i = 0; i < table->n_descs; i++) {
+			if (table->alloc_descs[i].service != uniq_name)
+				continue;
+			table->alloc_descs[i].service =
+				table->services[idx].name;
+			changed = true;
+		}
+		table->services[uniq_idx].owner = NULL;
+	}
+
+out:
+	if (changed)
+		table_changed(table);
+	return 0;
+}
+
+/* does an interface list (either the as of InterfacesRemoved, or the
+ * a{sa{sv}} of InterfacesAdded) include Sensor.Value? */
+static bool has_value_iface(sd_bus_message *m, bool with_props)
+{
+	const char *iface;
+	bool found = false;
+	int rc;
+
+	rc = sd_bus_message_enter_container(m, 'a',
+			with_props ? "{sa{sv}}" : "s");
+	if (rc < 0)
+		return false;
+
+	for (;;) {
+		if (with_props) {
+			rc = sd_bus_message_enter_container(m, 'e', "sa{sv}");
+			if (rc <= 0)
+				break;
+		}
+
+		rc = sd_bus_message_read(m, "s", &iface);
+		if (rc <= 0)
+			break;
+
+		if (!strcmp(iface, VALUE_IFACE))
+			found = true;
+
+		if (with_props) {
+			rc = sd_bus_message_skip(m, "a{sv}");
+			if (rc >= 0)
+				rc = sd_bus_message_exit_container(m);
+			if (rc < 0)
+				break;
+		}
+	}
+
+	return found;
+}
+
+static int interfaces_added(sd_bus_message *m, void *data,
+		sd_bus_error *ret_error)
+{
+	struct sensor_table *table = data;
+	const char *path, *sender;
+	int idx, rc;
+
+	(void)ret_error;
+
+	sender = sd_bus_message_get_sender(m);
+	if (!sender || sd_bus_message_read(m, "o", &path) < 0)
+		return 0;
+
+	if (!has_value_iface(m, true))
+		return 0;
+
+	idx = find_service_by_owner(table, sender);
+	if (idx < 0)
+		idx = service_index(table->services, table->n_services,
+				sender);
+	if (idx < 0)
+		idx = add_service(table, sender, sender);
+	if (idx < 0)
+		return 0;
+
+	rc = add_sensor(table, table->services[idx].name, path);
+	if (rc > 0)
+		table_changed(table);
+
+	return 0;
+}
+
+static int interfaces_removed(sd_bus_message *m, void *data,
+		sd_bus_error *ret_error)
+{
+	struct sensor_table *table = data;
+	const char *path, *sender;
+	int idx, svc_idx;
+	bool found;
+
+	(void)ret_error;
+
+	sender = sd_bus_message_get_sender(m);
+	if (!sender || sd_bus_message_read(m, "o", &path) < 0)
+		return 0;
+
+	if (!has_value_iface(m, false))
+		return 0;
+
+	/* only the sensor's own service may remove it */
+	idx = find_sensor(table, path, &found);
+	if (!found)
+		return 0;
+
+	svc_idx = find_service_by_owner(table, sender);
+	if (svc_idx < 0 || table->services[svc_idx].name !=
+			table->alloc_descs[idx].service)
+		return 0;
+
+	remove_sensor_at(table, idx);
+	table_changed(table);
+
+	return 0;
+}
+
+int sensor_table_watch(sd_bus *bus, struct sensor_table *table,
+		void (*changed)(struct sensor_table *, void *), void *data)
+{
+	static const char *ifaces_match_fmt =
+		"type='signal',"
+		"interface='org.freedesktop.DBus.ObjectManager',"
+		"member='%s',"
+		"arg0path='" SENSORS_ROOT "/'";
+	char match[256];
+	int rc;
+
+	/* we can only patch discovered tables */
+	if (!table->alloc_descs)
+		return -EINVAL;
+
+	table->changed = changed;
+	table->changed_data = data;
+
+	rc = sd_bus_match_signal(bus, &table->slots[0],
+			"org.freedesktop.DBus", "/org/freedesktop/DBus",
+			"org.freedesktop.DBus", "NameOwnerChanged",
+			name_owner_changed, table);
+	if (rc < 0)
+		return rc;
+
+	snprintf(match, sizeof(match), ifaces_match_fmt, "InterfacesAdded");
+	rc = sd_bus_add_match(bus, &table->slots[1], match,
+			interfaces_added, table);
+	if (rc < 0)
+		return rc;
+
+	snprintf(match, sizeof(match), ifaces_match_fmt, "InterfacesRemoved");
+	return sd_bus_add_match(bus, &table->slots[2], match,
+			interfaces_removed, table);
+}
+
+void sensor_table_free(struct sensor_table *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(table->slots); i++)
+		sd_bus_slot_unref(table->slots[i]);
+	for (i = 0; i < table->n_strings; i++)
+		free(table->strings[i]);
+	free(table->strings);
+	free(table->services);
+	free(table->alloc_descs);
+	free(table->image);
+	memset(table, 0, sizeof(*table));
+}
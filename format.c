@@ -0,0 +1,223 @@
+/* Value formatting: integer and fixed-precision decimal conversions,
+ * without going through printf().
+ *
+ * Doubles are printed as printf("%.*f") would, exactly: the integer and
+ * fractional parts are split (which is exact), and only the fractional
+ * part is scaled by 10^digits. That product is below 2^30, so its error
+ * is under 2^-23, and the rounding decision can only go wrong when the
+ * scaled fraction is within that of a half. Those ties (or near-ties),
+ * NaNs, infinities and values too large for a uint64_t are left to
+ * snprintf(), which rounds them exactly.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sensor-query.h"
+
+/* how close to a half the scaled fraction must be for us to defer to
+ * snprintf(): comfortably larger than the product's error */
+#define TIE_EPSILON	0x1p-20
+
+static const uint64_t pow10_table[SENSOR_SCALE_MAX + 1] = {
+	1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+	10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+	100000000000ull, 1000000000000ull, 10000000000000ull,
+	100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+	100000000000000000ull, 1000000000000000000ull,
+};
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Write the decimal digits of val, zero-padded to at least width, two
+ * digits at a time. Returns the length written; there's no terminator.
+ */
+static size_t format_digits(char *buf, uint64_t val, unsigned int width)
+{
+	char tmp[20], *p = tmp + sizeof(tmp);
+	size_t len, pad;
+
+	while (val >= 100) {
+		p -= 2;
+		memcpy(p, &digit_pairs[(val % 100) * 2], 2);
+		val /= 100;
+	}
+	if (val >= 10) {
+		p -= 2;
+		memcpy(p, &digit_pairs[val * 2], 2);
+	} else {
+		*(--p) = '0' + val;
+	}
+
+	len = tmp + sizeof(tmp) - p;
+	pad = width > len ? width - len : 0;
+	memset(buf, '0', pad);
+	memcpy(buf + pad, p, len);
+
+	return pad + len;
+}
+
+size_t format_u64(char *buf, uint64_t val)
+{
+	size_t len;
+
+	len = format_digits(buf, val, 0);
+	buf[len] = '\0';
+	return len;
+}
+
+size_t format_i64(char *buf, int64_t val)
+{
+	char *p = buf;
+
+	if (val < 0)
+		*(p++) = '-';
+
+	/* negate as unsigned, which is safe for INT64_MIN */
+	return (p - buf) + format_u64(p,
+			val < 0 ? -(uint64_t)val : (uint64_t)val);
+}
+
+/* Format an integer value of magnitude mag, with a power-of-ten scale,
+ * exactly: a negative scale places the decimal point, and a positive one
+ * appends zeros. Going through a double would round large values.
+ */
+static size_t format_scaled(char *buf, bool neg, uint64_t mag, int scale)
+{
+	char *p = buf;
+	uint64_t div;
+
+	if (neg)
+		*(p++) = '-';
+
+	if (scale >= 0) {
+		p += format_digits(p, mag, 0);
+		if (mag && scale) {
+			memset(p, '0', scale);
+			p += scale;
+		}
+	} else {
+		div = pow10_table[-scale];
+		p += format_digits(p, mag / div, 0);
+		*(p++) = '.';
+		p += format_digits(p, mag % div, -scale);
+	}
+
+	*p = '\0';
+	return p - buf;
+}
+
+/* Format val with the given number of digits after the decimal point
+ * (at most FORMAT_MAX_DIGITS), as printf("%.*f", digits, val) would,
+ * into buf of at least FORMAT_VALUE_MAX bytes.
+ */
+size_t format_double(char *buf, double val, unsigned int digits)
+{
+	uint64_t ip, fp, scale;
+	double abs, r, frac;
+	char *p = buf;
+
+	if (digits > FORMAT_MAX_DIGITS)
+		digits = FORMAT_MAX_DIGITS;
+
+	abs = val < 0 ? -val : val;
+	if (!(abs < 0x1p63))
+		goto fallback;
+
+	scale = pow10_table[digits];
+	ip = abs;
+	r = (abs - ip) * scale;
+	fp = r;
+	frac = r - fp;
+
+	if (frac > 0.5 - TIE_EPSILON && frac < 0.5 + TIE_EPSILON)
+		goto fallback;
+
+	if (frac > 0.5 && ++fp == scale) {
+		fp = 0;
+		ip++;
+	}
+
+	if (signbit(val))
+		*(p++) = '-';
+	p += format_digits(p, ip, 0);
+	if (digits) {
+		*(p++) = '.';
+		p += format_digits(p, fp, digits);
+	}
+
+	*p = '\0';
+	return p - buf;
+
+fallback:
+	return snprintf(buf, FORMAT_VALUE_MAX, "%.*f", digits, val);
+}
+
+/* The sensor's value as a double, with its scale applied: for consumers
+ * that need a single representation. Integer values beyond 2^53 lose
+ * precision here.
+ */
+double sensor_value_double(const struct sensor_data *sensor)
+{
+	double val;
+
+	switch (sensor->type) {
+	case 'd':
+		val = sensor->value.d;
+		break;
+	case 't':
+		val = sensor->value.t;
+		break;
+	default:
+		val = sensor->value.x;
+	}
+
+	if (sensor->scale > 0)
+		val *= pow10_table[sensor->scale];
+	else if (sensor->scale < 0)
+		val /= pow10_table[-sensor->scale];
+
+	return val;
+}
+
+/* Format a sensor's value, into buf of at least FORMAT_VALUE_MAX bytes.
+ * Integer values are formatted exactly, with their scale; doubles to
+ * digits decimal places.
+ */
+size_t format_sensor_value(char *buf, const struct sensor_data *sensor,
+		unsigned int digits)
+{
+	int64_t x;
+
+	switch (sensor->type) {
+	case 'd':
+		return format_double(buf, sensor_value_double(sensor),
+				digits);
+	case 't':
+		if (!sensor->scale)
+			return format_u64(buf, sensor->value.t);
+		return format_scaled(buf, false, sensor->value.t,
+				sensor->scale);
+	case 'x':
+		x = sensor->value.x;
+		if (!sensor->scale)
+			return format_i64(buf, x);
+		return format_scaled(buf, x < 0,
+				x < 0 ? -(uint64_t)x : (uint64_t)x,
+				sensor->scale);
+	default:
+		strcpy(buf, "(unknown)");
+		return strlen(buf);
+	}
+}
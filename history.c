@@ -0,0 +1,1327 @@
+/* History store, for watch and daemon modes (--history): every update to
+ * a watched sensor is recorded in a memory-mapped file of fixed size, so
+ * the recent history of each sensor is kept on the BMC itself.
+ *
+ * The file holds one ring of blocks per sensor; when a ring is full, its
+ * oldest block is reused. Within a block, samples are compressed as in
+ * Facebook's Gorilla: a timestamp is stored as the difference between
+ * successive deltas, in a variable-length bit field. Values are kept as
+ * the sensor reported them: an integer (with its Scale, in the block
+ * header) as the difference from the previous value, again in a
+ * variable-length field, and a double as the XOR with the previous value,
+ * of which only the bits that differ are kept. Sensors that update at a
+ * steady rate and values that change by small steps, or not at all, then
+ * take a few bits per sample.
+ *
+ * Layout:
+ *
+ *   struct history_header
+ *   struct history_ring rings[capacity]
+ *   (padding, to a multiple of HISTORY_BLOCK_SIZE)
+ *   blocks[capacity][blocks_per_ring], each HISTORY_BLOCK_SIZE bytes:
+ *	struct history_block, followed by the encoded samples
+ *
+ * in native byte order. A block's samples are:
+ *
+ *   first:	value, as below: a double's is its 64 bits, and an
+ *		integer's is taken from 0 (its timestamp is in the block
+ *		header)
+ *   others:	timestamp: delta of delta from the previous sample, in ms:
+ *		  '0'				0
+ *		  '10'   + 7 bits		-63 to 64
+ *		  '110'  + 9 bits		-255 to 256
+ *		  '1110' + 12 bits		-2047 to 2048
+ *		  '1111' + 32 bits		otherwise
+ *		value, for an integer: difference from the previous value:
+ *		  '0'				same value
+ *		  '10'     + 7 bits		-63 to 64
+ *		  '110'    + 12 bits		-2047 to 2048
+ *		  '1110'   + 20 bits		-524287 to 524288
+ *		  '11110'  + 32 bits		-2^31 + 1 to 2^31
+ *		  '111110' + 64 bits		the value itself
+ *		  '111111'			no value
+ *		with these fields, like the timestamp's, biased to be
+ *		unsigned (2^(n-1) - 1 added);
+ *		value, for a double: XOR with the previous value's bits:
+ *		  '0'				same value
+ *		  '10' + bits			in the previous window: the bits
+ *						between its leading and trailing
+ *						zeros
+ *		  '11' + 5 bits leading zeros + 6 bits length - 1 + bits
+ *
+ * with bits packed from the most significant end of each byte. A block
+ * holds values of one type and scale; a sensor that changes either starts
+ * a new one. Doubles have any scale applied, and are NaN while a sensor
+ * can't be read. A sensor's value holds from one sample until the next.
+ *
+ * Sensors are given rings as they appear, and keep them, so a sensor that
+ * goes away keeps its history. There's room for some sensors to appear
+ * beyond those present when the file was made; after that, the file is
+ * made again with more rings, each keeping its newest blocks. A file is
+ * reused on restart if it was made with the same size.
+ *
+ * One process records to a file, holding an exclusive flock() on it.
+ * Readers may map the file while we write: a block's sample count is
+ * updated only after its samples, and its sequence counter is odd while
+ * it's being reused, as for the slots in sensor-shm.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sensor-query.h"
+
+#define HISTORY_MAGIC		0x31485153	/* "SQH1" */
+#define HISTORY_VERSION		2
+#define HISTORY_BLOCK_SIZE	1024
+#define HISTORY_PATH_MAX	246
+
+/* rings beyond those needed when the file is made, for sensors that
+ * appear later: an eighth more, and at least this many */
+#define HISTORY_MIN_SPARE	8
+
+/* the most bits a sample other than the first can take: a double's
+ * value takes more than an integer's */
+#define SAMPLE_BITS_MAX		(4 + 32 + 2 + 5 + 6 + 64)
+
+/* an integer that doesn't fit the difference classes, or none */
+#define INT_WHOLE		0x3e	/* '111110' */
+#define INT_NONE		0x3f	/* '111111' */
+#define INT_ESCAPE_BITS		6
+
+/* no window yet, so the next value XOR opens one */
+#define NO_WINDOW		0xff
+
+struct history_header {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	ring_size;
+	uint32_t	block_size;
+	uint32_t	capacity;	/* rings */
+	uint32_t	blocks_per_ring;
+	uint32_t	n_rings;	/* rings given to sensors so far */
+	uint64_t	size;		/* the size the file was made for */
+	uint8_t		reserved[32];
+};
+
+struct history_ring {
+	uint32_t	head;		/* the block being written */
+	uint32_t	n_blocks;	/* blocks with samples */
+	uint16_t	path_len;
+	char		path[HISTORY_PATH_MAX];
+};
+
+struct history_block {
+	uint32_t	seq;
+	uint32_t	count;		/* samples */
+	uint64_t	t_first;	/* ms since the epoch */
+	uint64_t	t_last;
+	char		type;		/* of its values: 'd', 'x' or 't' */
+	int8_t		scale;		/* of its integers */
+	uint8_t		reserved[6];
+	uint8_t		data[];
+};
+
+#define BLOCK_BITS \
+	((HISTORY_BLOCK_SIZE - sizeof(struct history_block)) * 8)
+
+/* encoder state for a ring's current block */
+struct ring_writer {
+	bool		open;
+	char		type;		/* the block's */
+	int8_t		scale;
+	unsigned int	pos;		/* in bits */
+	uint64_t	t;
+	int64_t		delta;
+	uint64_t	bits;		/* the last value, or a double's bits */
+	uint8_t		leading;
+	uint8_t		trailing;
+};
+
+struct history_store {
+	char			*path;
+	uint64_t		size;
+	int			fd;	/* locked while we record */
+
+	struct history_header	*hdr;
+	struct history_ring	*rings;
+	uint8_t			*blocks;
+	size_t			len;
+	struct ring_writer	*writers;
+
+	/* ring for each watched sensor, or -1 if it isn't recorded */
+	int			*ring_map;
+	unsigned int		n_map;
+
+	/* for --stats */
+	unsigned long		n_samples;
+	unsigned long		n_blocks;
+	uint64_t		n_bits;
+};
+
+struct field_class {
+	unsigned int	prefix;
+	unsigned int	prefix_bits;
+	unsigned int	bits;
+};
+
+/* the delta of delta classes, after the '0' for no change */
+static const struct field_class dod_classes[] = {
+	{ 0x2, 2, 7 },
+	{ 0x6, 3, 9 },
+	{ 0xe, 4, 12 },
+	{ 0xf, 4, 32 },
+};
+
+/* the integer difference classes, likewise */
+static const struct field_class int_classes[] = {
+	{ 0x2, 2, 7 },
+	{ 0x6, 3, 12 },
+	{ 0xe, 4, 20 },
+	{ 0x1e, 5, 32 },
+};
+
+static void seq_begin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_end(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static struct history_block *ring_block(struct history_store *store,
+		unsigned int ring, unsigned int idx)
+{
+	return (struct history_block *)(store->blocks + ((size_t)ring *
+				store->hdr->blocks_per_ring + idx) *
+			HISTORY_BLOCK_SIZE);
+}
+
+/* append the low n bits of val; the bits after pos are zero */
+static void put_bits(uint8_t *data, unsigned int *pos, uint64_t val,
+		unsigned int n)
+{
+	unsigned int room, take;
+
+	while (n) {
+		room = 8 - (*pos & 7);
+		take = n < room ? n : room;
+		data[*pos >> 3] |= ((val >> (n - take)) & ((1u << take) - 1))
+			<< (room - take);
+		*pos += take;
+		n -= take;
+	}
+}
+
+/* encode val as '0' if it's zero, or else in the first of n classes it
+ * fits; false if it fits none */
+static bool put_field(uint8_t *data, unsigned int *pos,
+		const struct field_class *classes, unsigned int n, int64_t val)
+{
+	unsigned int i;
+	int64_t bias;
+
+	if (!val) {
+		put_bits(data, pos, 0, 1);
+		return true;
+	}
+
+	for (i = 0; i < n; i++) {
+		bias = ((int64_t)1 << (classes[i].bits - 1)) - 1;
+		if (val < -bias || val > bias + 1)
+			continue;
+
+		put_bits(data, pos, classes[i].prefix, classes[i].prefix_bits);
+		put_bits(data, pos, val + bias, classes[i].bits);
+		return true;
+	}
+
+	return false;
+}
+
+static void put_int(struct ring_writer *w, uint8_t *data, bool valid,
+		uint64_t val)
+{
+	if (!valid) {
+		put_bits(data, &w->pos, INT_NONE, INT_ESCAPE_BITS);
+		return;
+	}
+
+	/* wrapping, which works for 't' values as well as 'x' */
+	if (!put_field(data, &w->pos, int_classes, ARRAY_SIZE(int_classes),
+				(int64_t)(val - w->bits))) {
+		put_bits(data, &w->pos, INT_WHOLE, INT_ESCAPE_BITS);
+		put_bits(data, &w->pos, val, 64);
+	}
+	w->bits = val;
+}
+
+static void put_double(struct ring_writer *w, uint8_t *data, uint64_t bits)
+{
+	unsigned int leading, trailing, len;
+	uint64_t xor = bits ^ w->bits;
+
+	w->bits = bits;
+
+	if (!xor) {
+		put_bits(data, &w->pos, 0, 1);
+		return;
+	}
+
+	/* the leading zero count has to fit in 5 bits */
+	leading = __builtin_clzll(xor);
+	if (leading > 31)
+		leading = 31;
+	trailing = __builtin_ctzll(xor);
+
+	if (w->leading != NO_WINDOW && leading >= w->leading &&
+			trailing >= w->trailing) {
+		put_bits(data, &w->pos, 0x2, 2);
+		put_bits(data, &w->pos, xor >> w->trailing,
+				64 - w->leading - w->trailing);
+		return;
+	}
+
+	len = 64 - leading - trailing;
+	put_bits(data, &w->pos, 0x3, 2);
+	put_bits(data, &w->pos, leading, 5);
+	put_bits(data, &w->pos, len - 1, 6);
+	put_bits(data, &w->pos, xor >> trailing, len);
+	w->leading = leading;
+	w->trailing = trailing;
+}
+
+/* Move a ring on to a fresh block, starting at t, for values of the
+ * given type and scale: the next after its head, which is its oldest
+ * once the ring is full.
+ */
+static struct history_block *ring_advance(struct history_store *store,
+		unsigned int r, uint64_t t, char type, int8_t scale)
+{
+	struct history_ring *ring = &store->rings[r];
+	struct history_block *block;
+	unsigned int head;
+
+	head = ring->n_blocks ?
+		(ring->head + 1) % store->hdr->blocks_per_ring : 0;
+	block = ring_block(store, r, head);
+
+	seq_begin(&block->seq);
+	__atomic_store_n(&block->count, 0, __ATOMIC_RELAXED);
+	block->t_first = t;
+	block->t_last = t;
+	block->type = type;
+	block->scale = scale;
+	memset(block->data, 0, HISTORY_BLOCK_SIZE - sizeof(*block));
+	seq_end(&block->seq);
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	if (ring->n_blocks < store->hdr->blocks_per_ring)
+		__atomic_store_n(&ring->n_blocks, ring->n_blocks + 1,
+				__ATOMIC_RELEASE);
+
+	store->n_blocks++;
+	return block;
+}
+
+/* encode a sample's value, in the type of the writer's block */
+static void put_sample(struct ring_writer *w, uint8_t *data,
+		const struct sensor_data *sensor, bool valid, bool first)
+{
+	uint64_t bits;
+	double d;
+
+	if (w->type != 'd') {
+		put_int(w, data, valid, sensor->value.t);
+		return;
+	}
+
+	d = valid ? sensor_value_double(sensor) : NAN;
+	memcpy(&bits, &d, sizeof(bits));
+	if (first) {
+		put_bits(data, &w->pos, bits, 64);
+		w->bits = bits;
+	} else {
+		put_double(w, data, bits);
+	}
+}
+
+static void ring_append(struct history_store *store, unsigned int r,
+		uint64_t t, const struct sensor_data *sensor, bool valid)
+{
+	struct ring_writer *w = &store->writers[r];
+	struct history_block *block;
+	unsigned int start;
+	int64_t delta;
+	int8_t scale;
+	char type;
+
+	/* a sensor that can't be read has no value of either kind, so that
+	 * goes in whatever block is open */
+	if (!valid && w->open) {
+		type = w->type;
+		scale = w->scale;
+	} else if (valid && (sensor->type == 'x' || sensor->type == 't')) {
+		type = sensor->type;
+		scale = sensor->scale;
+	} else {
+		type = 'd';
+		scale = 0;
+	}
+
+	/* keep time moving forwards within a ring, even if the clock
+	 * doesn't, as readers search its blocks by time: from the head
+	 * block, which is still there after a restart */
+	block = ring_block(store, r, store->rings[r].head);
+	if (store->rings[r].n_blocks && t < block->t_last)
+		t = block->t_last;
+
+	if (w->open && w->type == type && w->scale == scale) {
+		delta = t - w->t;
+		start = w->pos;
+
+		if (w->pos + SAMPLE_BITS_MAX <= BLOCK_BITS &&
+				put_field(block->data, &w->pos, dod_classes,
+					ARRAY_SIZE(dod_classes),
+					delta - w->delta)) {
+			put_sample(w, block->data, sensor, valid, false);
+			w->t = t;
+			w->delta = delta;
+			store->n_bits += w->pos - start;
+			goto publish;
+		}
+	}
+
+	block = ring_advance(store, r, t, type, scale);
+	w->open = true;
+	w->type = type;
+	w->scale = scale;
+	w->pos = 0;
+	w->t = t;
+	w->delta = 0;
+	w->bits = 0;
+	w->leading = NO_WINDOW;
+	w->trailing = 0;
+	put_sample(w, block->data, sensor, valid, true);
+	store->n_bits += w->pos;
+
+publish:
+	__atomic_store_n(&block->t_last, t, __ATOMIC_RELAXED);
+	__atomic_store_n(&block->count, block->count + 1, __ATOMIC_RELEASE);
+	store->n_samples++;
+}
+
+/* where the blocks start, for a file with room for capacity rings */
+static size_t blocks_offset(unsigned int capacity)
+{
+	size_t off;
+
+	off = sizeof(struct history_header) +
+		(size_t)capacity * sizeof(struct history_ring);
+	return (off + HISTORY_BLOCK_SIZE - 1) /
+		HISTORY_BLOCK_SIZE * HISTORY_BLOCK_SIZE;
+}
+
+static size_t file_size(unsigned int capacity, unsigned int blocks_per_ring)
+{
+	return blocks_offset(capacity) +
+		(size_t)capacity * blocks_per_ring * HISTORY_BLOCK_SIZE;
+}
+
+static int history_attach(struct history_store *store, void *map,
+		size_t len)
+{
+	store->hdr = map;
+	store->rings = (struct history_ring *)(store->hdr + 1);
+	store->blocks = (uint8_t *)map + blocks_offset(store->hdr->capacity);
+	store->len = len;
+
+	/* a block that was being written is left as it is; we start each
+	 * ring on a fresh one */
+	store->writers = calloc(store->hdr->capacity, sizeof(*store->writers));
+	if (!store->writers) {
+		munmap(map, len);
+		store->hdr = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void history_detach(struct history_store *store)
+{
+	if (store->hdr)
+		munmap(store->hdr, store->len);
+	store->hdr = NULL;
+	free(store->writers);
+	store->writers = NULL;
+}
+
+/* Map an open history file, and check it's one we can read */
+static int history_map_fd(int fd, bool writable, void **mapp, size_t *lenp)
+{
+	const struct history_header *hdr;
+	const struct history_ring *rings;
+	struct stat statbuf;
+	unsigned int i, n;
+	void *map;
+
+	if (fstat(fd, &statbuf))
+		return -errno;
+	if ((size_t)statbuf.st_size < sizeof(*hdr))
+		return -EINVAL;
+
+	map = mmap(NULL, statbuf.st_size,
+			PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED,
+			fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	rings = (const struct history_ring *)(hdr + 1);
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != HISTORY_MAGIC
+			|| hdr->version != HISTORY_VERSION
+			|| hdr->ring_size != sizeof(struct history_ring)
+			|| hdr->block_size != HISTORY_BLOCK_SIZE
+			|| !hdr->blocks_per_ring
+			|| (uint64_t)hdr->capacity * hdr->blocks_per_ring >
+				(uint64_t)statbuf.st_size / HISTORY_BLOCK_SIZE
+			|| file_size(hdr->capacity, hdr->blocks_per_ring) !=
+				(size_t)statbuf.st_size)
+		goto invalid;
+
+	n = __atomic_load_n(&hdr->n_rings, __ATOMIC_ACQUIRE);
+	if (n > hdr->capacity)
+		goto invalid;
+
+	for (i = 0; i < n; i++) {
+		if (rings[i].path_len >= HISTORY_PATH_MAX ||
+				rings[i].path[rings[i].path_len] ||
+				rings[i].n_blocks > hdr->blocks_per_ring ||
+				rings[i].head >= hdr->blocks_per_ring)
+			goto invalid;
+	}
+
+	*mapp = map;
+	*lenp = statbuf.st_size;
+	return 0;
+
+invalid:
+	munmap(map, statbuf.st_size);
+	return -EINVAL;
+}
+
+static int history_map(const char *path, bool writable, void **mapp,
+		size_t *lenp)
+{
+	int fd, rc;
+
+	fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	rc = history_map_fd(fd, writable, mapp, lenp);
+	close(fd);
+	return rc;
+}
+
+/* Open the file at path, creating it if need be, and take the writer's
+ * lock on it, which we hold until the store is closed. Another writer
+ * may have replaced the file (see history_rebuild()) while we waited to
+ * open it, so check that the one we locked is still the one at path.
+ */
+static int history_lock(const char *path)
+{
+	struct stat fd_stat, path_stat;
+	int fd, rc;
+
+	for (;;) {
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -errno;
+
+		if (flock(fd, LOCK_EX | LOCK_NB)) {
+			rc = errno == EWOULDBLOCK ? -EBUSY : -errno;
+			close(fd);
+			return rc;
+		}
+
+		if (fstat(fd, &fd_stat)) {
+			rc = -errno;
+			close(fd);
+			return rc;
+		}
+
+		if (!stat(path, &path_stat) &&
+				path_stat.st_dev == fd_stat.st_dev &&
+				path_stat.st_ino == fd_stat.st_ino)
+			return fd;
+
+		close(fd);
+	}
+}
+
+/* Map the locked file if it was made as we'd make it now. Otherwise it's
+ * replaced once we know how many sensors there are: but only if it's one
+ * of ours, or empty, as history_lock() leaves a file it creates.
+ */
+static int history_reuse(struct history_store *store)
+{
+	const struct history_header *hdr;
+	struct stat statbuf;
+	uint32_t magic;
+	size_t len;
+	void *map;
+	int rc;
+
+	rc = history_map_fd(store->fd, true, &map, &len);
+	if (rc == -EINVAL) {
+		if (fstat(store->fd, &statbuf))
+			return -errno;
+		if (!statbuf.st_size)
+			return 0;
+
+		if (pread(store->fd, &magic, sizeof(magic), 0) !=
+				sizeof(magic) || magic != HISTORY_MAGIC)
+			return -EEXIST;
+
+		fprintf(stderr, "history: %s is from another version, or "
+				"damaged; discarding it\n", store->path);
+		return 0;
+	}
+	if (rc < 0)
+		return rc;
+
+	hdr = map;
+	if (hdr->size != store->size) {
+		fprintf(stderr, "history: %s was made for %" PRIu64 " bytes, "
+				"not %" PRIu64 "; discarding it\n",
+				store->path, hdr->size, store->size);
+		munmap(map, len);
+		return 0;
+	}
+
+	return history_attach(store, map, len);
+}
+
+/* Open a history file of the given size for recording, or -EBUSY if
+ * another process is recording to it, or -EEXIST if it's something else.
+ */
+int history_open(struct history_store **storep, const char *path,
+		uint64_t size)
+{
+	struct history_store *store;
+	int rc;
+
+	store = calloc(1, sizeof(*store));
+	if (!store)
+		return -ENOMEM;
+
+	store->fd = -1;
+	store->size = size;
+	store->path = strdup(path);
+	if (!store->path) {
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	rc = history_lock(path);
+	if (rc < 0)
+		goto err;
+	store->fd = rc;
+
+	rc = history_reuse(store);
+	if (rc < 0)
+		goto err;
+
+	*storep = store;
+	return 0;
+
+err:
+	history_close(store);
+	return rc;
+}
+
+/* Copy the store's rings into a new file's, with as many of the newest
+ * blocks of each as fit */
+static void copy_rings(struct history_store *store, void *map)
+{
+	struct history_header *hdr = map;
+	struct history_ring *rings = (struct history_ring *)(hdr + 1);
+	uint8_t *blocks = (uint8_t *)map + blocks_offset(hdr->capacity);
+	unsigned int old_per = store->hdr->blocks_per_ring;
+	unsigned int r, k, n, keep, oldest;
+	uint8_t *to;
+
+	for (r = 0; r < store->hdr->n_rings; r++) {
+		n = store->rings[r].n_blocks;
+		keep = n < hdr->blocks_per_ring ? n : hdr->blocks_per_ring;
+		oldest = n < old_per ? 0 : (store->rings[r].head + 1) % old_per;
+
+		oldest = (oldest + n - keep) % old_per;
+
+		for (k = 0; k < keep; k++) {
+			to = blocks + ((size_t)r * hdr->blocks_per_ring + k) *
+				HISTORY_BLOCK_SIZE;
+			memcpy(to, ring_block(store, r, (oldest + k) % old_per),
+					HISTORY_BLOCK_SIZE);
+		}
+
+		memcpy(rings[r].path, store->rings[r].path,
+				store->rings[r].path_len);
+		rings[r].path_len = store->rings[r].path_len;
+		rings[r].n_blocks = keep;
+		rings[r].head = keep ? keep - 1 : 0;
+	}
+
+	hdr->n_rings = store->hdr->n_rings;
+}
+
+/* Make the file again, with room for capacity rings and the store's
+ * size, carrying over the rings we have. It's made under another name
+ * and renamed over the old, so readers see one file or the other; those
+ * with the old one mapped keep it until they reopen.
+ */
+static int history_rebuild(struct history_store *store,
+		unsigned int capacity)
+{
+	struct history_header *hdr;
+	uint64_t per_ring;
+	char *tmp;
+	size_t len;
+	void *map;
+	int fd, rc;
+
+	if (store->size <= blocks_offset(capacity))
+		return -ENOSPC;
+
+	per_ring = (store->size - blocks_offset(capacity)) / capacity /
+		HISTORY_BLOCK_SIZE;
+	if (per_ring < 2)
+		return -ENOSPC;
+	if (per_ring > UINT32_MAX)
+		per_ring = UINT32_MAX;
+
+	if (asprintf(&tmp, "%s.XXXXXX", store->path) < 0)
+		return -ENOMEM;
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		rc = -errno;
+		free(tmp);
+		return rc;
+	}
+
+	/* nobody else has it yet, so the lock is ours at once */
+	len = file_size(capacity, per_ring);
+	if (flock(fd, LOCK_EX) || fchmod(fd, 0644) || ftruncate(fd, len)) {
+		rc = -errno;
+		goto err;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		rc = -errno;
+		goto err;
+	}
+
+	/* ftruncate gives us zeroed blocks */
+	hdr = map;
+	hdr->magic = HISTORY_MAGIC;
+	hdr->version = HISTORY_VERSION;
+	hdr->ring_size = sizeof(struct history_ring);
+	hdr->block_size = HISTORY_BLOCK_SIZE;
+	hdr->capacity = capacity;
+	hdr->blocks_per_ring = per_ring;
+	hdr->size = store->size;
+	if (store->hdr)
+		copy_rings(store, map);
+
+	if (rename(tmp, store->path)) {
+		rc = -errno;
+		munmap(map, len);
+		goto err;
+	}
+	free(tmp);
+
+	/* and closing the old file gives up our lock on it */
+	history_detach(store);
+	close(store->fd);
+	store->fd = fd;
+
+	return history_attach(store, map, len);
+
+err:
+	close(fd);
+	unlink(tmp);
+	free(tmp);
+	return rc;
+}
+
+/* rings for n sensors, and some to spare for those that appear later */
+static unsigned int ring_capacity(unsigned int n)
+{
+	return n + (n / 8 > HISTORY_MIN_SPARE ? n / 8 : HISTORY_MIN_SPARE);
+}
+
+static int find_ring(const struct history_store *store, const char *path)
+{
+	size_t len = strlen(path);
+	unsigned int i;
+
+	for (i = 0; i < store->hdr->n_rings; i++)
+		if (store->rings[i].path_len == len &&
+				!memcmp(store->rings[i].path, path, len))
+			return i;
+
+	return -1;
+}
+
+/* the ring for a path, given a new one if need be; -1 if there's none */
+static int assign_ring(struct history_store *store, const char *path)
+{
+	struct history_ring *ring;
+	size_t len = strlen(path);
+	int r;
+
+	r = find_ring(store, path);
+	if (r >= 0)
+		return r;
+
+	if (len >= HISTORY_PATH_MAX) {
+		fprintf(stderr, "history: path too long, not recorded: %s\n",
+				path);
+		return -1;
+	}
+
+	if (store->hdr->n_rings == store->hdr->capacity) {
+		fprintf(stderr, "history: no room, not recorded: %s\n", path);
+		return -1;
+	}
+
+	r = store->hdr->n_rings;
+	ring = &store->rings[r];
+	memcpy(ring->path, path, len);
+	ring->path_len = len;
+
+	__atomic_store_n(&store->hdr->n_rings, r + 1, __ATOMIC_RELEASE);
+	return r;
+}
+
+/* Find (or assign) a ring for each of a new set of watched sensors. The
+ * file is made to fit them on the first call, unless it was reused; and
+ * made again, with more (and so shorter) rings, when there isn't room for
+ * new ones.
+ */
+int history_layout(struct history_store *store,
+		const struct watch_sensor *sensors, unsigned int n)
+{
+	unsigned int i, want;
+	int *map, rc;
+
+	want = store->hdr ? store->hdr->n_rings : 0;
+	for (i = 0; i < n; i++)
+		if (!store->hdr || find_ring(store, sensors[i].desc.object) < 0)
+			want++;
+
+	if (!store->hdr || want > store->hdr->capacity) {
+		rc = history_rebuild(store, ring_capacity(want));
+		if (rc < 0 && !store->hdr)
+			return rc;
+		if (rc < 0)
+			fprintf(stderr, "history: can't make room for more "
+					"sensors: %s\n", strerror(-rc));
+	}
+
+	map = realloc(store->ring_map, (n ? n : 1) * sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+	store->ring_map = map;
+	store->n_map = n;
+
+	for (i = 0; i < n; i++)
+		map[i] = assign_ring(store, sensors[i].desc.object);
+
+	return 0;
+}
+
+/* Record the state of sensor idx, in the last layout, at time t (in ms
+ * since the epoch) */
+void history_record(struct history_store *store, unsigned int idx,
+		const struct watch_sensor *ws, uint64_t t)
+{
+	if (!store->hdr || idx >= store->n_map || store->ring_map[idx] < 0)
+		return;
+
+	ring_append(store, store->ring_map[idx], t, &ws->data, ws->valid);
+}
+
+void history_report(const struct history_store *store)
+{
+	if (!store->hdr)
+		return;
+
+	fprintf(stderr, "history: %lu samples in %lu new blocks, "
+			"%.2f bytes/sample; %u rings of %u blocks\n",
+			store->n_samples, store->n_blocks,
+			store->n_bits / 8.0 /
+				(store->n_samples ? store->n_samples : 1),
+			store->hdr->capacity, store->hdr->blocks_per_ring);
+}
+
+void history_close(struct history_store *store)
+{
+	if (!store)
+		return;
+
+	history_detach(store);
+	if (store->fd >= 0)
+		close(store->fd);
+	free(store->ring_map);
+	free(store->path);
+	free(store);
+}
+
+/* Reading: a query finds the rings for the sensors asked for, and in
+ * each, the blocks covering the time range. Blocks are in time order
+ * around the ring, so their headers' first and last timestamps are an
+ * index that can be binary searched; only the blocks in range are
+ * decoded.
+ */
+
+/* the most samples a block can hold: the first, then at least a bit each
+ * for the timestamp and the value */
+#define BLOCK_SAMPLES_MAX	(1 + (BLOCK_BITS - 1) / 2)
+
+struct history_sample {
+	uint64_t	t;
+	double		value;
+};
+
+struct history_reader {
+	const struct history_header	*hdr;
+	const struct history_ring	*rings;
+	const uint8_t			*blocks;
+	struct history_sample		*samples;
+
+	uint64_t			since;
+	uint64_t			until;
+	uint64_t			bucket;
+	history_point_fn		fn;
+	void				*data;
+
+	/* with a bucket size, the bucket being filled */
+	bool				open;
+	struct history_point		point;
+	double				sum;
+};
+
+static const struct history_block *reader_block(
+		const struct history_reader *reader, unsigned int ring,
+		unsigned int idx)
+{
+	return (const struct history_block *)(reader->blocks +
+			((size_t)ring * reader->hdr->blocks_per_ring + idx) *
+			HISTORY_BLOCK_SIZE);
+}
+
+/* read n bits, or fail with false if the block ends first */
+static bool get_bits(const uint8_t *data, unsigned int *pos,
+		unsigned int n, uint64_t *val)
+{
+	unsigned int avail, take;
+
+	if (*pos + n > BLOCK_BITS)
+		return false;
+
+	*val = 0;
+	while (n) {
+		avail = 8 - (*pos & 7);
+		take = n < avail ? n : avail;
+		*val = *val << take | ((data[*pos >> 3] >> (avail - take)) &
+				((1u << take) - 1));
+		*pos += take;
+		n -= take;
+	}
+
+	return true;
+}
+
+/* count the ones before a zero, up to max of them */
+static bool get_ones(const uint8_t *data, unsigned int *pos,
+		unsigned int max, unsigned int *ones)
+{
+	uint64_t bit;
+
+	for (*ones = 0; *ones < max; (*ones)++) {
+		if (!get_bits(data, pos, 1, &bit))
+			return false;
+		if (!bit)
+			break;
+	}
+
+	return true;
+}
+
+static bool get_field(const uint8_t *data, unsigned int *pos,
+		const struct field_class *class, int64_t *val)
+{
+	uint64_t raw;
+
+	if (!get_bits(data, pos, class->bits, &raw))
+		return false;
+
+	*val = (int64_t)raw - (((int64_t)1 << (class->bits - 1)) - 1);
+	return true;
+}
+
+static bool get_dod(const uint8_t *data, unsigned int *pos, int64_t *dod)
+{
+	unsigned int ones;
+
+	if (!get_ones(data, pos, ARRAY_SIZE(dod_classes), &ones))
+		return false;
+
+	if (!ones) {
+		*dod = 0;
+		return true;
+	}
+
+	return get_field(data, pos, &dod_classes[ones - 1], dod);
+}
+
+/* decode an integer, from the previous one in *val; *valid is cleared if
+ * the sensor had no value */
+static bool get_int(const uint8_t *data, unsigned int *pos, uint64_t *val,
+		bool *valid)
+{
+	unsigned int ones;
+	int64_t diff;
+
+	if (!get_ones(data, pos, INT_ESCAPE_BITS, &ones))
+		return false;
+
+	*valid = ones != INT_ESCAPE_BITS;
+	if (!ones || !*valid)
+		return true;
+
+	if (ones > ARRAY_SIZE(int_classes))
+		return get_bits(data, pos, 64, val);
+
+	if (!get_field(data, pos, &int_classes[ones - 1], &diff))
+		return false;
+
+	*val += (uint64_t)diff;
+	return true;
+}
+
+static bool get_double(const uint8_t *data, unsigned int *pos,
+		uint64_t *bits, unsigned int *leading, unsigned int *trailing)
+{
+	uint64_t ctl, val, len;
+
+	if (!get_bits(data, pos, 1, &ctl))
+		return false;
+	if (!ctl)
+		return true;
+
+	if (!get_bits(data, pos, 1, &ctl))
+		return false;
+
+	if (ctl) {
+		if (!get_bits(data, pos, 5, &val) ||
+				!get_bits(data, pos, 6, &len))
+			return false;
+		if (val + len + 1 > 64)
+			return false;
+		*leading = val;
+		*trailing = 64 - val - (len + 1);
+	} else if (*leading + *trailing >= 64) {
+		/* no window yet */
+		return false;
+	}
+
+	if (!get_bits(data, pos, 64 - *leading - *trailing, &val))
+		return false;
+
+	*bits ^= val << *trailing;
+	return true;
+}
+
+/* Decode a block into reader->samples. Returns the number of samples,
+ * -EAGAIN if the block was reused as we read it (so its samples are
+ * gone), or -EINVAL if it doesn't decode.
+ */
+static int read_block(struct history_reader *reader,
+		const struct history_block *block)
+{
+	struct history_sample *samples = reader->samples;
+	unsigned int i, count, pos, leading, trailing;
+	struct sensor_data sensor = { 0 };
+	uint64_t t, bits;
+	int64_t delta, dod;
+	uint32_t seq;
+	bool valid;
+
+	seq = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return -EAGAIN;
+
+	count = __atomic_load_n(&block->count, __ATOMIC_ACQUIRE);
+	if (count > BLOCK_SAMPLES_MAX)
+		return -EINVAL;
+
+	/* integers are scaled as for output */
+	sensor.type = block->type;
+	sensor.scale = block->scale;
+	if ((sensor.type != 'd' && sensor.type != 'x' && sensor.type != 't')
+			|| sensor.scale < -SENSOR_SCALE_MAX
+			|| sensor.scale > SENSOR_SCALE_MAX)
+		return -EINVAL;
+
+	pos = 0;
+	t = block->t_first;
+	delta = 0;
+	bits = 0;
+	leading = 64;
+	trailing = 0;
+
+	for (i = 0; i < count; i++) {
+		if (i) {
+			if (!get_dod(block->data, &pos, &dod))
+				return -EINVAL;
+			delta += dod;
+			t += delta;
+		}
+		samples[i].t = t;
+
+		if (sensor.type != 'd') {
+			if (!get_int(block->data, &pos, &bits, &valid))
+				return -EINVAL;
+			sensor.value.t = bits;
+			samples[i].value = valid ?
+				sensor_value_double(&sensor) : NAN;
+			continue;
+		}
+
+		if (!i) {
+			if (!get_bits(block->data, &pos, 64, &bits))
+				return -EINVAL;
+		} else if (!get_double(block->data, &pos, &bits, &leading,
+					&trailing)) {
+			return -EINVAL;
+		}
+		memcpy(&samples[i].value, &bits, sizeof(bits));
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&block->seq, __ATOMIC_RELAXED) != seq)
+		return -EAGAIN;
+
+	return count;
+}
+
+static void bucket_end(struct history_reader *reader, const char *path)
+{
+	struct history_point *point = &reader->point;
+
+	if (!reader->open)
+		return;
+
+	if (point->count) {
+		point->avg = reader->sum / point->count;
+	} else {
+		point->min = NAN;
+		point->avg = NAN;
+		point->max = NAN;
+	}
+
+	reader->fn(path, point, reader->data);
+	reader->open = false;
+}
+
+static void add_sample(struct history_reader *reader, const char *path,
+		const struct history_sample *sample)
+{
+	struct history_point *point = &reader->point;
+	uint64_t start;
+
+	if (!reader->bucket) {
+		point->t = sample->t;
+		point->min = sample->value;
+		point->avg = sample->value;
+		point->max = sample->value;
+		point->count = !isnan(sample->value);
+		reader->fn(path, point, reader->data);
+		return;
+	}
+
+	start = sample->t - sample->t % reader->bucket;
+	if (reader->open && point->t != start)
+		bucket_end(reader, path);
+
+	if (!reader->open) {
+		point->t = start;
+		point->count = 0;
+		reader->sum = 0;
+		reader->open = true;
+	}
+
+	if (isnan(sample->value))
+		return;
+
+	if (!point->count || sample->value < point->min)
+		point->min = sample->value;
+	if (!point->count || sample->value > point->max)
+		point->max = sample->value;
+	reader->sum += sample->value;
+	point->count++;
+}
+
+static void query_ring(struct history_reader *reader, unsigned int r)
+{
+	const struct history_ring *ring = &reader->rings[r];
+	const unsigned int per_ring = reader->hdr->blocks_per_ring;
+	const struct history_block *block;
+	unsigned int n, oldest, lo, hi, mid, k;
+	int i, count;
+
+	n = __atomic_load_n(&ring->n_blocks, __ATOMIC_ACQUIRE);
+	if (n > per_ring)
+		n = per_ring;
+	oldest = n < per_ring ? 0 :
+		(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1) %
+		per_ring;
+
+	/* the first block that ends at or after since */
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		block = reader_block(reader, r, (oldest + mid) % per_ring);
+		if (__atomic_load_n(&block->t_last, __ATOMIC_RELAXED) <
+				reader->since)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (k = lo; k < n; k++) {
+		block = reader_block(reader, r, (oldest + k) % per_ring);
+		if (block->t_first > reader->until)
+			break;
+
+		count = read_block(reader, block);
+		for (i = 0; i < count; i++) {
+			if (reader->samples[i].t < reader->since)
+				continue;
+			if (reader->samples[i].t > reader->until)
+				break;
+			add_sample(reader, ring->path, &reader->samples[i]);
+		}
+	}
+
+	bucket_end(reader, ring->path);
+}
+
+/* match is a sensor's path, or a type: the path component after the
+ * sensors root */
+static bool path_matches(const char *path, const char *match)
+{
+	size_t root_len = strlen(SENSORS_ROOT "/"), len;
+
+	if (match[0] == '/')
+		return !strcmp(path, match);
+
+	if (!match[0])
+		return true;
+
+	len = strlen(match);
+	return !strncmp(path, SENSORS_ROOT "/", root_len) &&
+		!strncmp(path + root_len, match, len) &&
+		path[root_len + len] == '/';
+}
+
+static int ring_path_cmp(const void *a, const void *b)
+{
+	const struct history_ring * const *ra = a, * const *rb = b;
+
+	return strcmp((*ra)->path, (*rb)->path);
+}
+
+/* Query a history file for the sensors matching match (a path, a type,
+ * or "" for all), between since and until (in ms since the epoch, inclusive).
+ * fn is called for each sample, or, if bucket is nonzero, for each
+ * bucket of that many ms that has samples; sensors are taken in path
+ * order.
+ */
+int history_query(const char *file, const char *match, uint64_t since,
+		uint64_t until, uint64_t bucket, history_point_fn fn,
+		void *data)
+{
+	struct history_reader reader = { 0 };
+	const struct history_ring **rings;
+	unsigned int i, n, n_match;
+	size_t len;
+	void *map;
+	int rc;
+
+	rc = history_map(file, false, &map, &len);
+	if (rc < 0)
+		return rc;
+
+	reader.hdr = map;
+	reader.rings = (const struct history_ring *)(reader.hdr + 1);
+	reader.blocks = (const uint8_t *)map +
+		blocks_offset(reader.hdr->capacity);
+	reader.since = since;
+	reader.until = until;
+	reader.bucket = bucket;
+	reader.fn = fn;
+	reader.data = data;
+
+	/* as validated, if more have been added since */
+	n = __atomic_load_n(&reader.hdr->n_rings, __ATOMIC_ACQUIRE);
+	if (n > reader.hdr->capacity)
+		n = reader.hdr->capacity;
+
+	rings = calloc(n ? n : 1, sizeof(*rings));
+	reader.samples = calloc(BLOCK_SAMPLES_MAX, sizeof(*reader.samples));
+	if (!rings || !reader.samples) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0, n_match = 0; i < n; i++) {
+		if (!memchr(reader.rings[i].path, '\0', HISTORY_PATH_MAX))
+			continue;
+
+		if (path_matches(reader.rings[i].path, match))
+			rings[n_match++] = &reader.rings[i];
+	}
+
+	qsort(rings, n_match, sizeof(*rings), ring_path_cmp);
+
+	for (i = 0; i < n_match; i++)
+		query_ring(&reader, rings[i] - reader.rings);
+
+	rc = n_match;
+
+out:
+	free(reader.samples);
+	free(rings);
+	munmap(map, len);
+	return rc;
+}
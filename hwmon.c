@@ -0,0 +1,736 @@
+/* hwmon source: read sensors directly from their hwmon sysfs attributes,
+ * rather than through the sensor daemon over D-Bus.
+ *
+ * Each sensor object is matched to an hwmon attribute once, when the
+ * source is opened, and the attribute files are kept open. Each scan
+ * then reads them all as one io_uring batch, or where io_uring isn't
+ * available, with a pread() of each file. Objects are matched by their
+ * final path component, against (in order of preference):
+ *
+ *  - the attribute's label (<attr>_label), with spaces as underscores;
+ *  - the device name, where the device has a single attribute of that
+ *    kind; and
+ *  - <name>_<attr>, eg. tmp75_temp1.
+ *
+ * Sensors that can't be matched are queried over D-Bus as usual, as are
+ * all but temperatures (see hwmon_kinds).
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sensor-query.h"
+
+/* hwmon attribute kind for each sensor type, and the scale from sysfs
+ * units to the D-Bus ones.
+ *
+ * Only temperatures are read from sysfs. For the other types, the sensor
+ * daemons apply calibration that hwmon doesn't know about (ADC
+ * ScaleFactors, PSU PowerFactors, offsets), so the raw attributes would
+ * disagree with the D-Bus values.
+ */
+static const struct hwmon_kind {
+	const char	*type;
+	const char	*prefix;
+	double		scale;
+} hwmon_kinds[] = {
+	{ "temperature",	"temp",		1e-3 },	/* millidegrees C */
+};
+
+/* alarm attribute suffixes, in sensor_data threshold order */
+enum {
+	ALARM_LOWER_CRIT,
+	ALARM_UPPER_CRIT,
+	ALARM_LOWER_WARN,
+	ALARM_UPPER_WARN,
+	N_ALARMS,
+};
+
+static const char * const alarm_suffixes[N_ALARMS] = {
+	[ALARM_LOWER_CRIT]	= "lcrit_alarm",
+	[ALARM_UPPER_CRIT]	= "crit_alarm",
+	[ALARM_LOWER_WARN]	= "min_alarm",
+	[ALARM_UPPER_WARN]	= "max_alarm",
+};
+
+/* Each sensor has up to five files: the input, then the alarms */
+#define SLOT_INPUT	0
+#define SLOT_ALARM(n)	(1 + (n))
+#define N_SLOTS		(1 + N_ALARMS)
+
+/* read buffer per file; attribute values are short integers */
+#define ATTR_BUF_SIZE	32
+
+struct hwmon_sensor {
+	char		*object;
+	/* index into the source's files for each slot, or -1 */
+	int		files[N_SLOTS];
+	double		scale;
+};
+
+/* All attribute files are kept open, with a read buffer for each. These
+ * are registered with the io_uring, if we have one, so reads are
+ * fixed-file, fixed-buffer operations.
+ */
+struct hwmon_source {
+	/* sorted by object path */
+	struct hwmon_sensor	*sensors;
+	unsigned int		n_sensors;
+
+	int			*fds;
+	unsigned int		n_fds;
+	char			*bufs;
+	int			*lens;		/* read result, per file */
+
+	struct uring		*ring;
+	unsigned long		n_syscalls;	/* pread()s */
+};
+
+/* an attribute found while scanning sysfs */
+struct hwmon_attr {
+	const struct hwmon_kind	*kind;
+	char			*dir;
+	char			*attr;		/* eg. "temp1" */
+	char			*label;
+	char			*name;		/* device name */
+	bool			only;		/* only one of its kind */
+};
+
+static int hwmon_sensor_cmp(const void *a, const void *b)
+{
+	const struct hwmon_sensor *sa = a, *sb = b;
+
+	return strcmp(sa->object, sb->object);
+}
+
+static int hwmon_sensor_key_cmp(const void *key, const void *elem)
+{
+	const struct hwmon_sensor *sensor = elem;
+
+	return strcmp(key, sensor->object);
+}
+
+/* read a (short) sysfs file into buf, stripping the trailing newline */
+static int read_attr_file(const char *dir, const char *file, char *buf,
+		size_t len)
+{
+	char path[512];
+	ssize_t rc;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	rc = read(fd, buf, len - 1);
+	close(fd);
+	if (rc < 0)
+		return -errno;
+
+	buf[rc] = '\0';
+	if (rc && buf[rc - 1] == '\n')
+		buf[rc - 1] = '\0';
+
+	return 0;
+}
+
+static const struct hwmon_kind *kind_for_attr(const char *file,
+		size_t *attr_len)
+{
+	const char *p, *suffix = "_input";
+	unsigned int i;
+	size_t len;
+
+	len = strlen(file);
+	if (len <= strlen(suffix) || strcmp(file + len - strlen(suffix),
+				suffix))
+		return NULL;
+
+	*attr_len = len - strlen(suffix);
+
+	for (i = 0; i < ARRAY_SIZE(hwmon_kinds); i++) {
+		const struct hwmon_kind *kind = &hwmon_kinds[i];
+		size_t prefix_len = strlen(kind->prefix);
+
+		if (strncmp(file, kind->prefix, prefix_len))
+			continue;
+
+		/* the rest of the attribute name must be the index */
+		for (p = file + prefix_len; p < file + *attr_len; p++)
+			if (*p < '0' || *p > '9')
+				break;
+
+		if (p == file + *attr_len && p > file + prefix_len)
+			return kind;
+	}
+
+	return NULL;
+}
+
+static void free_attrs(struct hwmon_attr *attrs, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		free(attrs[i].dir);
+		free(attrs[i].attr);
+		free(attrs[i].label);
+		free(attrs[i].name);
+	}
+	free(attrs);
+}
+
+/* Collect the *_input attributes of one hwmon device */
+static int scan_device(const char *dir, struct hwmon_attr **attrsp,
+		unsigned int *n_attrs)
+{
+	unsigned int first, i, j, n;
+	struct hwmon_attr *attrs;
+	char name[128], file[128], label[128];
+	struct dirent *dirent;
+	size_t attr_len;
+	DIR *d;
+	int rc;
+
+	if (read_attr_file(dir, "name", name, sizeof(name)))
+		return 0;
+
+	d = opendir(dir);
+	if (!d)
+		return 0;
+
+	rc = 0;
+	first = *n_attrs;
+
+	while ((dirent = readdir(d))) {
+		const struct hwmon_kind *kind;
+		struct hwmon_attr *attr;
+		char *p;
+
+		kind = kind_for_attr(dirent->d_name, &attr_len);
+		if (!kind)
+			continue;
+
+		attrs = realloc(*attrsp, (*n_attrs + 1) * sizeof(*attrs));
+		if (!attrs) {
+			rc = -ENOMEM;
+			break;
+		}
+		*attrsp = attrs;
+
+		attr = &attrs[(*n_attrs)++];
+		memset(attr, 0, sizeof(*attr));
+		attr->kind = kind;
+		attr->dir = strdup(dir);
+		attr->attr = strndup(dirent->d_name, attr_len);
+		attr->name = strdup(name);
+		if (!attr->dir || !attr->attr || !attr->name) {
+			rc = -ENOMEM;
+			break;
+		}
+
+		snprintf(file, sizeof(file), "%s_label", attr->attr);
+		if (!read_attr_file(dir, file, label, sizeof(label))) {
+			for (p = label; *p; p++)
+				if (*p == ' ')
+					*p = '_';
+			attr->label = strdup(label);
+		}
+	}
+
+	closedir(d);
+
+	/* flag attributes that are the only one of their kind on this
+	 * device, so can be matched by device name alone */
+	attrs = *attrsp;
+	for (i = first; i < *n_attrs; i++) {
+		for (j = first, n = 0; j < *n_attrs; j++)
+			if (attrs[j].kind == attrs[i].kind)
+				n++;
+		attrs[i].only = n == 1;
+	}
+
+	return rc;
+}
+
+static bool attr_matches(const struct hwmon_attr *attr, const char *name,
+		int pass)
+{
+	size_t len;
+
+	switch (pass) {
+	case 0:
+		return attr->label && !strcmp(attr->label, name);
+	case 1:
+		return attr->only && !strcmp(attr->name, name);
+	case 2:
+		len = strlen(attr->name);
+		return !strncmp(attr->name, name, len) && name[len] == '_' &&
+			!strcmp(attr->attr, name + len + 1);
+	}
+
+	return false;
+}
+
+static const struct hwmon_attr *find_attr(const struct hwmon_attr *attrs,
+		unsigned int n_attrs, const char *object)
+{
+	const struct hwmon_kind *kind = NULL;
+	const char *type, *name;
+	unsigned int i;
+	size_t root_len;
+	int pass;
+
+	/* object is SENSORS_ROOT/<type>/<name> */
+	root_len = strlen(SENSORS_ROOT);
+	if (strncmp(object, SENSORS_ROOT "/", root_len + 1))
+		return NULL;
+
+	type = object + root_len + 1;
+	name = strchr(type, '/');
+	if (!name || strchr(name + 1, '/'))
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(hwmon_kinds); i++) {
+		if (strlen(hwmon_kinds[i].type) == (size_t)(name - type) &&
+				!strncmp(hwmon_kinds[i].type, type,
+					name - type)) {
+			kind = &hwmon_kinds[i];
+			break;
+		}
+	}
+	if (!kind)
+		return NULL;
+
+	name++;
+
+	for (pass = 0; pass < 3; pass++)
+		for (i = 0; i < n_attrs; i++)
+			if (attrs[i].kind == kind &&
+					attr_matches(&attrs[i], name, pass))
+				return &attrs[i];
+
+	return NULL;
+}
+
+static void hwmon_source_close_files(struct hwmon_source *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < src->n_fds; i++)
+		close(src->fds[i]);
+}
+
+/* open an attribute file, adding it to the source's file set; returns
+ * its index, or -1 if it doesn't exist */
+static int add_file(struct hwmon_source *src, const char *dir,
+		const char *attr, const char *suffix)
+{
+	char path[512];
+	int fd, *fds;
+
+	snprintf(path, sizeof(path), "%s/%s_%s", dir, attr, suffix);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	fds = realloc(src->fds, (src->n_fds + 1) * sizeof(*fds));
+	if (!fds) {
+		close(fd);
+		return -1;
+	}
+
+	src->fds = fds;
+	src->fds[src->n_fds] = fd;
+	return src->n_fds++;
+}
+
+static int hwmon_source_add(struct hwmon_source *src,
+		const struct hwmon_attr *attr, const char *object)
+{
+	struct hwmon_sensor *sensor;
+	unsigned int i;
+	int file;
+
+	file = add_file(src, attr->dir, attr->attr, "input");
+	if (file < 0)
+		return 0;
+
+	sensor = &src->sensors[src->n_sensors];
+	sensor->files[SLOT_INPUT] = file;
+	for (i = 0; i < N_ALARMS; i++)
+		sensor->files[SLOT_ALARM(i)] = add_file(src, attr->dir,
+				attr->attr, alarm_suffixes[i]);
+
+	sensor->scale = attr->kind->scale;
+	sensor->object = strdup(object);
+	if (!sensor->object)
+		return -ENOMEM;
+
+	src->n_sensors++;
+	return 0;
+}
+
+/* Match the given sensors to hwmon attributes under root (normally
+ * /sys/class/hwmon), and open their files. If use_uring is set, reads
+ * are batched through io_uring where the kernel allows it. Returns the
+ * number of sensors matched, or a negative error.
+ */
+int hwmon_source_open(struct hwmon_source **srcp, const char *root,
+		const struct sensor_desc *descs, unsigned int n_descs,
+		bool use_uring)
+{
+	struct hwmon_attr *attrs = NULL;
+	struct hwmon_source *src;
+	unsigned int i, n_attrs;
+	struct dirent *dirent;
+	char dir[512];
+	DIR *d;
+	int rc;
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return -ENOMEM;
+
+	d = opendir(root);
+	if (!d) {
+		free(src);
+		return -errno;
+	}
+
+	n_attrs = 0;
+	rc = 0;
+	while (!rc && (dirent = readdir(d))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		snprintf(dir, sizeof(dir), "%s/%s", root, dirent->d_name);
+		rc = scan_device(dir, &attrs, &n_attrs);
+	}
+	closedir(d);
+
+	if (!rc) {
+		src->sensors = calloc(n_descs ? n_descs : 1,
+				sizeof(*src->sensors));
+		if (!src->sensors)
+			rc = -ENOMEM;
+	}
+
+	for (i = 0; !rc && i < n_descs; i++) {
+		const struct hwmon_attr *attr;
+
+		attr = find_attr(attrs, n_attrs, descs[i].object);
+		if (attr)
+			rc = hwmon_source_add(src, attr, descs[i].object);
+	}
+
+	free_attrs(attrs, n_attrs);
+
+	if (!rc) {
+		src->bufs = calloc(src->n_fds ? src->n_fds : 1, ATTR_BUF_SIZE);
+		src->lens = calloc(src->n_fds ? src->n_fds : 1,
+				sizeof(*src->lens));
+		if (!src->bufs || !src->lens)
+			rc = -ENOMEM;
+	}
+
+	if (rc) {
+		hwmon_source_free(src);
+		return rc;
+	}
+
+	/* on any failure here (no kernel support, or blocked by a
+	 * seccomp policy), we just use pread() */
+	if (use_uring && src->n_fds)
+		uring_open(&src->ring, src->n_fds, src->fds, src->n_fds,
+				src->bufs, src->n_fds * ATTR_BUF_SIZE);
+
+	qsort(src->sensors, src->n_sensors, sizeof(*src->sensors),
+			hwmon_sensor_cmp);
+
+	*srcp = src;
+	return src->n_sensors;
+}
+
+void hwmon_source_free(struct hwmon_source *src)
+{
+	unsigned int i;
+
+	if (!src)
+		return;
+
+	uring_close(src->ring);
+	hwmon_source_close_files(src);
+	for (i = 0; i < src->n_sensors; i++)
+		free(src->sensors[i].object);
+	free(src->sensors);
+	free(src->fds);
+	free(src->bufs);
+	free(src->lens);
+	free(src);
+}
+
+static void read_file(struct hwmon_source *src, unsigned int file)
+{
+	ssize_t len;
+
+	len = pread(src->fds[file], src->bufs + file * ATTR_BUF_SIZE,
+			ATTR_BUF_SIZE - 1, 0);
+	src->lens[file] = len < 0 ? -errno : len;
+	src->n_syscalls++;
+}
+
+static void read_complete(uint64_t data, int res, void *arg)
+{
+	struct hwmon_source *src = arg;
+
+	src->lens[data] = res;
+}
+
+static void queue_file(struct hwmon_source *src, unsigned int file)
+{
+	if (!src->ring) {
+		read_file(src, file);
+		return;
+	}
+
+	src->lens[file] = -EINPROGRESS;
+
+	if (uring_queue_read(src->ring, file,
+				src->bufs + file * ATTR_BUF_SIZE,
+				ATTR_BUF_SIZE - 1, file) == -EBUSY) {
+		uring_submit_wait(src->ring, read_complete, src);
+		uring_queue_read(src->ring, file,
+				src->bufs + file * ATTR_BUF_SIZE,
+				ATTR_BUF_SIZE - 1, file);
+	}
+}
+
+/* Read the first n_slots files of the matched sensors: with io_uring,
+ * as a single batch, otherwise one pread() each. Returns the number of
+ * syscalls made.
+ */
+static unsigned long read_files(struct hwmon_source *src,
+		const struct hwmon_sensor **matches, unsigned int n,
+		unsigned int n_slots)
+{
+	unsigned long n_syscalls;
+	unsigned int i, j;
+	int file;
+
+	n_syscalls = src->n_syscalls +
+		(src->ring ? uring_syscalls(src->ring) : 0);
+
+	for (i = 0; i < n; i++) {
+		if (!matches[i])
+			continue;
+		for (j = 0; j < n_slots; j++) {
+			file = matches[i]->files[j];
+			if (file >= 0)
+				queue_file(src, file);
+		}
+	}
+
+	if (src->ring) {
+		uring_submit_wait(src->ring, read_complete, src);
+
+		/* retry anything the ring didn't complete with a plain
+		 * pread; a read that completed with an error stands */
+		for (i = 0; i < n; i++) {
+			if (!matches[i])
+				continue;
+			for (j = 0; j < n_slots; j++) {
+				file = matches[i]->files[j];
+				if (file >= 0 &&
+						src->lens[file] == -EINPROGRESS)
+					read_file(src, file);
+			}
+		}
+	}
+
+	return src->n_syscalls + (src->ring ? uring_syscalls(src->ring) : 0)
+		- n_syscalls;
+}
+
+/* parse an ASCII integer attribute value, as read into the file's
+ * buffer; -ERANGE if it doesn't fit */
+static int parse_file(const struct hwmon_source *src, int file,
+		long long *val)
+{
+	unsigned long long v, max;
+	const char *buf;
+	bool neg;
+	int i, len, digit;
+
+	len = src->lens[file];
+	if (len < 0)
+		return len;
+
+	buf = src->bufs + file * ATTR_BUF_SIZE;
+	i = 0;
+	neg = len && buf[0] == '-';
+	if (neg)
+		i++;
+
+	if (i == len || buf[i] < '0' || buf[i] > '9')
+		return -EINVAL;
+
+	max = neg ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+	for (v = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++) {
+		digit = buf[i] - '0';
+		if (v > (max - digit) / 10)
+			return -ERANGE;
+		v = v * 10 + digit;
+	}
+
+	/* without overflow, for LLONG_MIN */
+	*val = neg && v ? -(long long)(v - 1) - 1 : (long long)v;
+	return 0;
+}
+
+static int hwmon_parse(const struct hwmon_source *src,
+		const struct hwmon_sensor *hs, struct sensor_data *sensor,
+		bool thresholds)
+{
+	bool *alarms[N_ALARMS] = {
+		[ALARM_LOWER_CRIT]	= &sensor->lower_crit,
+		[ALARM_UPPER_CRIT]	= &sensor->upper_crit,
+		[ALARM_LOWER_WARN]	= &sensor->lower_warn,
+		[ALARM_UPPER_WARN]	= &sensor->upper_warn,
+	};
+	long long val;
+	unsigned int i;
+	int rc, file;
+
+	rc = parse_file(src, hs->files[SLOT_INPUT], &val);
+	if (rc)
+		return rc;
+
+	sensor->type = 'd';
+	sensor->scale = 0;
+	sensor->value.d = val * hs->scale;
+
+	if (!thresholds)
+		return 0;
+
+	for (i = 0; i < N_ALARMS; i++) {
+		file = hs->files[SLOT_ALARM(i)];
+		*alarms[i] = file >= 0 && !parse_file(src, file, &val) && val;
+	}
+
+	return 0;
+}
+
+/* D-Bus results for the unmatched sensors, collected so that output
+ * stays in order */
+struct dbus_results {
+	struct sensor_data	*sensors;
+	int			*rcs;
+	unsigned int		n;
+};
+
+static void dbus_result(const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, void *data)
+{
+	struct dbus_results *results = data;
+
+	(void)desc;
+
+	results->sensors[results->n] = *sensor;
+	results->rcs[results->n++] = rc;
+}
+
+/* Query sensors from hwmon, falling back to the configured D-Bus engine
+ * for any that aren't matched to an attribute.
+ */
+int hwmon_query_sensors(sd_bus *bus, const struct query_config *config,
+		const struct sensor_desc **sensors, unsigned int n,
+		sensor_result_fn result, void *result_data)
+{
+	struct hwmon_source *src = config->hwmon;
+	const struct hwmon_sensor **matches;
+	const struct sensor_desc **unmatched;
+	struct dbus_results results = { 0 };
+	struct query_config dbus_config;
+	struct sensor_data sensor;
+	unsigned int i, j, n_unmatched;
+	unsigned long n_syscalls;
+	uint64_t start;
+	int rc;
+
+	matches = calloc(n ? n : 1, sizeof(*matches));
+	unmatched = calloc(n ? n : 1, sizeof(*unmatched));
+	if (!matches || !unmatched) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0, n_unmatched = 0; i < n; i++) {
+		matches[i] = bsearch(sensors[i]->object, src->sensors,
+				src->n_sensors, sizeof(*src->sensors),
+				hwmon_sensor_key_cmp);
+		if (!matches[i])
+			unmatched[n_unmatched++] = sensors[i];
+	}
+
+	if (n_unmatched) {
+		results.sensors = calloc(n_unmatched,
+				sizeof(*results.sensors));
+		results.rcs = calloc(n_unmatched, sizeof(*results.rcs));
+		if (!results.sensors || !results.rcs) {
+			rc = -ENOMEM;
+			goto out;
+		}
+
+		dbus_config = *config;
+		dbus_config.hwmon = NULL;
+		rc = query_sensors(bus, &dbus_config, unmatched, n_unmatched,
+				dbus_result, &results);
+		if (rc < 0)
+			goto out;
+	}
+
+	if (n_unmatched < n) {
+		start = stats_start();
+		/* with --values-only, we don't need the alarms */
+		n_syscalls = read_files(src, matches, n,
+				config->thresholds ? N_SLOTS : 1);
+		if (start) {
+			stats_record(STATS_HWMON_SCAN, start);
+			stats_record_hwmon_scan(
+					src->ring ? "io_uring" : "pread",
+					n_syscalls);
+		}
+	}
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (!matches[i]) {
+			result(sensors[i], &results.sensors[j],
+					results.rcs[j], result_data);
+			j++;
+			continue;
+		}
+
+		memset(&sensor, 0, sizeof(sensor));
+		rc = hwmon_parse(src, matches[i], &sensor,
+				config->thresholds);
+		result(sensors[i], &sensor, rc, result_data);
+	}
+
+	rc = 0;
+
+out:
+	free(results.sensors);
+	free(results.rcs);
+	free(unmatched);
+	free(matches);
+	return rc;
+}
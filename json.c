@@ -0,0 +1,233 @@
+/* JSON output: a minimal streaming writer, and the sensor record format
+ * for --format=json and --format=jsonl.
+ *
+ * The writer appends to a caller-supplied buffer and never allocates. As
+ * with snprintf(), it keeps counting once the buffer is full, so the
+ * caller can find the length needed and retry with more room (which is
+ * what output.c does).
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "sensor-query.h"
+
+struct json_writer {
+	char	*buf;
+	size_t	size;
+	size_t	len;	/* may exceed size */
+	bool	comma;	/* a value precedes, in the current container */
+};
+
+static void json_init(struct json_writer *w, char *buf, size_t size)
+{
+	w->buf = buf;
+	w->size = size;
+	w->len = 0;
+	w->comma = false;
+}
+
+static void json_putc(struct json_writer *w, char c)
+{
+	if (w->len < w->size)
+		w->buf[w->len] = c;
+	w->len++;
+}
+
+static void json_write(struct json_writer *w, const char *str, size_t len)
+{
+	size_t room;
+
+	if (w->len < w->size) {
+		room = w->size - w->len;
+		memcpy(w->buf + w->len, str, len < room ? len : room);
+	}
+	w->len += len;
+}
+
+/* terminate, if there's room; returns the length of the full output */
+static size_t json_finish(struct json_writer *w)
+{
+	if (w->size)
+		w->buf[w->len < w->size ? w->len : w->size - 1] = '\0';
+	return w->len;
+}
+
+static void json_string(struct json_writer *w, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *p;
+
+	json_putc(w, '"');
+
+	for (p = str; *p; p++) {
+		unsigned char c = *p;
+
+		if (c == '"' || c == '\\') {
+			json_putc(w, '\\');
+			json_putc(w, c);
+		} else if (c < 0x20) {
+			json_write(w, "\\u00", 4);
+			json_putc(w, hex[c >> 4]);
+			json_putc(w, hex[c & 0xf]);
+		} else {
+			json_putc(w, c);
+		}
+	}
+
+	json_putc(w, '"');
+}
+
+static void json_begin_object(struct json_writer *w)
+{
+	json_putc(w, '{');
+	w->comma = false;
+}
+
+static void json_end_object(struct json_writer *w)
+{
+	json_putc(w, '}');
+	w->comma = true;
+}
+
+/* start a member, with its key; the value must follow */
+static void json_key(struct json_writer *w, const char *key)
+{
+	if (w->comma)
+		json_putc(w, ',');
+	json_string(w, key);
+	json_putc(w, ':');
+	w->comma = true;
+}
+
+static void json_member_string(struct json_writer *w, const char *key,
+		const char *str)
+{
+	json_key(w, key);
+	json_string(w, str);
+}
+
+static void json_member_bool(struct json_writer *w, const char *key,
+		bool val)
+{
+	json_key(w, key);
+	if (val)
+		json_write(w, "true", 4);
+	else
+		json_write(w, "false", 5);
+}
+
+/* a number member, already formatted */
+static void json_member_number(struct json_writer *w, const char *key,
+		const char *num, size_t len)
+{
+	json_key(w, key);
+	json_write(w, num, len);
+}
+
+/* The sensor type: the path component after the sensors root, or
+ * "unknown" for objects outside it. Copied into type, of size len.
+ */
+static void sensor_type(const struct sensor_desc *desc, char *type,
+		size_t len)
+{
+	const char *p, *sep;
+	size_t n;
+
+	p = desc->object;
+	if (strncmp(p, SENSORS_ROOT "/", strlen(SENSORS_ROOT "/"))) {
+		strcpy(type, "unknown");
+		return;
+	}
+
+	p += strlen(SENSORS_ROOT "/");
+	sep = strchr(p, '/');
+	n = sep ? (size_t)(sep - p) : strlen(p);
+	if (n >= len)
+		n = len - 1;
+
+	memcpy(type, p, n);
+	type[n] = '\0';
+}
+
+static const char *sensor_error(int rc)
+{
+	switch (rc) {
+	case -ENOMSG:
+		return "no Value property";
+	case -EPROTO:
+		return "invalid Value type";
+	default:
+		return "failed to read sensor object";
+	}
+}
+
+/* Format a sensor's JSON record (with no trailing newline), like
+ * format_sensor_line(): returns the length of the full record, which
+ * may be larger than len. Values that JSON can't represent (NaN and
+ * infinities) are written as null.
+ */
+int format_sensor_json(char *buf, size_t len, const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, bool thresholds,
+		unsigned int digits, uint64_t timestamp_ms)
+{
+	char num[FORMAT_VALUE_MAX], type[64];
+	struct json_writer w;
+	uint64_t start;
+	size_t n;
+
+	start = stats_start();
+
+	json_init(&w, buf, len);
+	json_begin_object(&w);
+
+	json_member_string(&w, "path", desc->object);
+	json_member_string(&w, "service", desc->service ? desc->service : "");
+	sensor_type(desc, type, sizeof(type));
+	json_member_string(&w, "type", type);
+	n = format_u64(num, timestamp_ms);
+	json_member_number(&w, "timestamp", num, n);
+
+	if (rc) {
+		json_member_number(&w, "value", "null", 4);
+		json_member_string(&w, "error", sensor_error(rc));
+	} else if (sensor->type == 'd' &&
+			!isfinite(sensor_value_double(sensor))) {
+		json_member_number(&w, "value", "null", 4);
+	} else {
+		n = format_sensor_value(num, sensor, digits);
+		json_member_number(&w, "value", num, n);
+	}
+
+	if (!rc && thresholds) {
+		json_member_bool(&w, "lower_crit", sensor->lower_crit);
+		json_member_bool(&w, "upper_crit", sensor->upper_crit);
+		json_member_bool(&w, "lower_warn", sensor->lower_warn);
+		json_member_bool(&w, "upper_warn", sensor->upper_warn);
+	}
+
+	json_end_object(&w);
+
+	stats_end(STATS_FORMAT, start);
+	return json_finish(&w);
+}
+
+/* a record for a sensor that has disappeared, in watch mode */
+int format_removed_json(char *buf, size_t len, const struct sensor_desc *desc,
+		uint64_t timestamp_ms)
+{
+	char num[FORMAT_VALUE_MAX];
+	struct json_writer w;
+	size_t n;
+
+	json_init(&w, buf, len);
+	json_begin_object(&w);
+	json_member_string(&w, "path", desc->object);
+	n = format_u64(num, timestamp_ms);
+	json_member_number(&w, "timestamp", num, n);
+	json_member_bool(&w, "removed", true);
+	json_end_object(&w);
+
+	return json_finish(&w);
+}
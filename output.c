@@ -0,0 +1,699 @@
+/* Output buffering: sensor lines are formatted straight into one growable
+ * buffer, which is written out in a single write() when the caller
+ * flushes it, rather than passing each line through stdio. A scan then
+ * costs one write however many sensors it has, and watch mode one per
+ * event loop iteration (or per OUTPUT_WATERMARK bytes, if a burst of
+ * changes produces more than that). The daemon builds its responses in
+ * the same way.
+ *
+ * For --format=cbor and arrow, the buffer also keeps the stream's path
+ * dictionary, so each path goes out once, however many scans refer to
+ * it. Arrow rows are collected in columns, and written a batch at a time.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sensor-query.h"
+
+#define OUTPUT_MIN_ALLOC	4096
+
+/* make room for at least size more bytes */
+static int output_reserve(struct output_buf *out, size_t size)
+{
+	size_t alloc;
+	char *tmp;
+
+	if (out->alloc - out->len >= size)
+		return 0;
+
+	alloc = out->alloc ? out->alloc : OUTPUT_MIN_ALLOC;
+	while (alloc - out->len < size)
+		alloc *= 2;
+
+	tmp = realloc(out->buf, alloc);
+	if (!tmp)
+		return -ENOMEM;
+
+	out->buf = tmp;
+	out->alloc = alloc;
+	return 0;
+}
+
+/* A record to append: the formatters all work like snprintf(), so they
+ * can format straight into the buffer, and only need to be repeated if
+ * the record doesn't fit in the space left.
+ */
+struct record {
+	const struct sensor_desc	*desc;
+	struct sensor_data		*sensor;
+	int				rc;
+	bool				thresholds;
+	unsigned int			digits;
+	uint64_t			timestamp_ms;
+};
+
+typedef int (*record_fn)(char *buf, size_t len, const struct record *rec);
+
+static int output_append(struct output_buf *out, record_fn fn,
+		const struct record *rec)
+{
+	int len, rc;
+
+	rc = output_reserve(out, 1);
+	if (rc < 0)
+		return rc;
+
+	len = fn(out->buf + out->len, out->alloc - out->len, rec);
+	if (len < 0)
+		return -EINVAL;
+
+	if ((size_t)len >= out->alloc - out->len) {
+		rc = output_reserve(out, len + 1);
+		if (rc < 0)
+			return rc;
+		fn(out->buf + out->len, out->alloc - out->len, rec);
+	}
+
+	out->len += len;
+	return 0;
+}
+
+static int text_record(char *buf, size_t len, const struct record *rec)
+{
+	return format_sensor_line(buf, len, rec->desc, rec->sensor, rec->rc,
+			rec->thresholds, rec->digits);
+}
+
+static int json_record(char *buf, size_t len, const struct record *rec)
+{
+	return format_sensor_json(buf, len, rec->desc, rec->sensor, rec->rc,
+			rec->thresholds, rec->digits, rec->timestamp_ms);
+}
+
+static int json_removed(char *buf, size_t len, const struct record *rec)
+{
+	return format_removed_json(buf, len, rec->desc, rec->timestamp_ms);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Append a sensor's output line (see format_sensor_line()) */
+int output_sensor(struct output_buf *out, const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, bool thresholds,
+		unsigned int digits)
+{
+	const struct record rec = {
+		.desc		= desc,
+		.sensor		= sensor,
+		.rc		= rc,
+		.thresholds	= thresholds,
+		.digits		= digits,
+	};
+
+	return output_append(out, text_record, &rec);
+}
+
+static int output_write(struct output_buf *out, const void *data,
+		size_t len)
+{
+	int rc;
+
+	rc = output_reserve(out, len);
+	if (rc < 0)
+		return rc;
+
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+	return 0;
+}
+
+static int output_byte(struct output_buf *out, unsigned char c)
+{
+	return output_write(out, &c, 1);
+}
+
+static uint32_t path_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a */
+	for (; *path; path++)
+		hash = (hash ^ (unsigned char)*path) * 16777619u;
+	return hash;
+}
+
+/* the slot holding path, or the empty slot where it would go */
+static unsigned int *path_dict_slot(const struct path_dict *dict,
+		const char *path)
+{
+	unsigned int i, mask = dict->n_slots - 1;
+
+	for (i = path_hash(path) & mask;; i = (i + 1) & mask) {
+		unsigned int id = dict->slots[i];
+
+		if (!id || !strcmp(dict->paths[id - 1], path))
+			return &dict->slots[i];
+	}
+}
+
+static int path_dict_grow(struct path_dict *dict)
+{
+	unsigned int i, n_slots, *slots;
+	char **paths;
+
+	if (dict->n == dict->alloc) {
+		paths = reallocarray(dict->paths,
+				dict->alloc ? dict->alloc * 2 : 64,
+				sizeof(*paths));
+		if (!paths)
+			return -ENOMEM;
+		dict->paths = paths;
+		dict->alloc = dict->alloc ? dict->alloc * 2 : 64;
+	}
+
+	/* keep the table no more than half full */
+	if ((dict->n + 1) * 2 <= dict->n_slots)
+		return 0;
+
+	n_slots = dict->n_slots ? dict->n_slots * 2 : 128;
+	slots = calloc(n_slots, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	free(dict->slots);
+	dict->slots = slots;
+	dict->n_slots = n_slots;
+
+	for (i = 0; i < dict->n; i++)
+		*path_dict_slot(dict, dict->paths[i]) = i + 1;
+
+	return 0;
+}
+
+/* the path's ID, giving it the next one if it's new */
+int path_dict_intern(struct path_dict *dict, const char *path)
+{
+	unsigned int *slot;
+	char *copy;
+	int rc;
+
+	if (dict->n_slots) {
+		slot = path_dict_slot(dict, path);
+		if (*slot)
+			return *slot - 1;
+	}
+
+	rc = path_dict_grow(dict);
+	if (rc < 0)
+		return rc;
+
+	copy = strdup(path);
+	if (!copy)
+		return -ENOMEM;
+
+	dict->paths[dict->n] = copy;
+	*path_dict_slot(dict, path) = ++dict->n;
+	return dict->n - 1;
+}
+
+void path_dict_free(struct path_dict *dict)
+{
+	unsigned int i;
+
+	for (i = 0; i < dict->n; i++)
+		free(dict->paths[i]);
+	free(dict->paths);
+	free(dict->slots);
+	memset(dict, 0, sizeof(*dict));
+}
+
+/* Start the CBOR sequence, if we haven't, and send a dictionary of the
+ * paths added since the last. A dictionary can't go inside a scan's
+ * array, so if one is open, it's closed; records that follow start
+ * another.
+ */
+static int cbor_send_paths(struct output_buf *out)
+{
+	struct path_dict *dict = &out->paths;
+	unsigned int first = dict->n_sent;
+	char magic[16];
+	size_t room;
+	int len, rc;
+
+	if (!out->started) {
+		len = format_magic_cbor(magic, sizeof(magic));
+		rc = output_write(out, magic, len);
+		if (rc < 0)
+			return rc;
+		out->started = true;
+	}
+
+	if (dict->n_sent == dict->n)
+		return 0;
+
+	if (out->scan_open) {
+		out->scan_open = false;
+		rc = output_byte(out, CBOR_BREAK);
+		if (rc < 0)
+			return rc;
+	}
+
+	room = out->alloc - out->len;
+	len = format_paths_cbor(out->buf + out->len, room, first,
+			dict->paths + first, dict->n - first);
+	if ((size_t)len > room) {
+		rc = output_reserve(out, len);
+		if (rc < 0)
+			return rc;
+		format_paths_cbor(out->buf + out->len, len, first,
+				dict->paths + first, dict->n - first);
+	}
+
+	out->len += len;
+	dict->n_sent = dict->n;
+	return 0;
+}
+
+typedef int (*message_fn)(char *buf, size_t len, const void *arg);
+
+/* append a binary message from one of the arrow.c formatters, which only
+ * write it if it fits */
+static int output_message(struct output_buf *out, message_fn fn,
+		const void *arg)
+{
+	int len, rc;
+
+	rc = output_reserve(out, 1);
+	if (rc < 0)
+		return rc;
+
+	len = fn(out->buf + out->len, out->alloc - out->len, arg);
+	if (len < 0)
+		return len;
+
+	if ((size_t)len > out->alloc - out->len) {
+		rc = output_reserve(out, len);
+		if (rc < 0)
+			return rc;
+		fn(out->buf + out->len, out->alloc - out->len, arg);
+	}
+
+	out->len += len;
+	return 0;
+}
+
+static int arrow_schema(char *buf, size_t len, const void *arg)
+{
+	(void)arg;
+
+	return format_schema_arrow(buf, len);
+}
+
+static int arrow_dictionary(char *buf, size_t len, const void *arg)
+{
+	const struct path_dict *dict = arg;
+
+	return format_dictionary_arrow(buf, len, dict->n_sent,
+			dict->paths + dict->n_sent, dict->n - dict->n_sent);
+}
+
+static int arrow_batch(char *buf, size_t len, const void *arg)
+{
+	return format_batch_arrow(buf, len, arg);
+}
+
+static int arrow_eos(char *buf, size_t len, const void *arg)
+{
+	(void)arg;
+
+	return format_eos_arrow(buf, len);
+}
+
+/* Write out the rows collected, after the paths they need */
+static int arrow_write_batch(struct output_buf *out)
+{
+	int rc;
+
+	if (!arrow_batch_rows(out->batch))
+		return 0;
+
+	if (out->paths.n_sent < out->paths.n) {
+		rc = output_message(out, arrow_dictionary, &out->paths);
+		if (rc < 0)
+			return rc;
+		out->paths.n_sent = out->paths.n;
+	}
+
+	rc = output_message(out, arrow_batch, out->batch);
+	arrow_batch_reset(out->batch);
+	return rc;
+}
+
+/* Give a sensor's path an ID ahead of its records, for --format=cbor, so
+ * that the paths of a scan can go out in one dictionary before it. Paths
+ * first seen in a record are sent then, which splits the scan.
+ */
+int output_declare(struct output_buf *out, enum output_format format,
+		const struct sensor_desc *desc)
+{
+	int rc;
+
+	if (format != OUTPUT_CBOR)
+		return 0;
+
+	rc = path_dict_intern(&out->paths, desc->object);
+	return rc < 0 ? rc : 0;
+}
+
+/* In --format=json, the records of a scan are collected into a single
+ * object, {"sensors":[...]}, which is opened by output_begin_scan() (or
+ * implicitly, by the first record) and closed by output_end_scan().
+ * --format=cbor works in the same way, with an array, after sending any
+ * newly declared paths.
+ */
+int output_begin_scan(struct output_buf *out, enum output_format format)
+{
+	int rc;
+
+	if (format == OUTPUT_ARROW) {
+		if (out->started)
+			return 0;
+		rc = output_message(out, arrow_schema, NULL);
+		if (rc >= 0)
+			out->started = true;
+		return rc;
+	}
+
+	if (format == OUTPUT_CBOR) {
+		rc = cbor_send_paths(out);
+		if (rc < 0 || out->scan_open)
+			return rc;
+		out->scan_open = true;
+		return output_byte(out, CBOR_BEGIN_SCAN);
+	}
+
+	if (format != OUTPUT_JSON || out->scan_open)
+		return 0;
+
+	out->scan_open = true;
+	out->n_records = 0;
+	return output_printf(out, "{\"sensors\":[");
+}
+
+int output_end_scan(struct output_buf *out, enum output_format format)
+{
+	if (format == OUTPUT_ARROW)
+		return arrow_write_batch(out);
+
+	if (!out->scan_open)
+		return 0;
+
+	if (format == OUTPUT_CBOR) {
+		out->scan_open = false;
+		return output_byte(out, CBOR_BREAK);
+	}
+
+	if (format != OUTPUT_JSON)
+		return 0;
+
+	out->scan_open = false;
+	return output_printf(out, "]}\n");
+}
+
+/* In watch mode, whether the output collected is due to be completed and
+ * flushed: always, except for --format=arrow, where many scans go into
+ * a batch, up to ARROW_BATCH_ROWS rows or ARROW_BATCH_MS old.
+ */
+bool output_scan_due(const struct output_buf *out, enum output_format format)
+{
+	unsigned int rows;
+
+	if (format != OUTPUT_ARROW)
+		return true;
+
+	rows = arrow_batch_rows(out->batch);
+	return rows >= ARROW_BATCH_ROWS || (rows &&
+			now_ms() - arrow_batch_start(out->batch) >=
+				ARROW_BATCH_MS);
+}
+
+/* Complete the output, at the end of the stream: for --format=arrow, with
+ * the end-of-stream marker
+ */
+int output_end_stream(struct output_buf *out, enum output_format format)
+{
+	int rc;
+
+	rc = output_end_scan(out, format);
+	if (rc < 0 || format != OUTPUT_ARROW || !out->started)
+		return rc;
+
+	return output_message(out, arrow_eos, NULL);
+}
+
+/* Append a CBOR record, for a sensor or (with no sensor) its removal */
+static int cbor_append(struct output_buf *out,
+		const struct sensor_desc *desc, struct sensor_data *sensor,
+		int rc)
+{
+	int id, ret;
+
+	id = path_dict_intern(&out->paths, desc->object);
+	if (id < 0)
+		return id;
+
+	ret = output_begin_scan(out, OUTPUT_CBOR);
+	if (ret >= 0)
+		ret = output_reserve(out, CBOR_RECORD_SIZE);
+	if (ret < 0)
+		return ret;
+
+	if (sensor)
+		out->len += format_sensor_cbor(out->buf + out->len,
+				CBOR_RECORD_SIZE, id, sensor, rc);
+	else
+		out->len += format_removed_cbor(out->buf + out->len,
+				CBOR_RECORD_SIZE, id);
+	return 0;
+}
+
+static int arrow_append(struct output_buf *out,
+		const struct sensor_desc *desc, struct sensor_data *sensor,
+		int rc)
+{
+	int id, ret;
+
+	ret = output_begin_scan(out, OUTPUT_ARROW);
+	if (ret < 0)
+		return ret;
+
+	id = path_dict_intern(&out->paths, desc->object);
+	if (id < 0)
+		return id;
+
+	return arrow_batch_append(&out->batch, id, sensor, rc, now_ms());
+}
+
+/* separate a JSON record from the one before, or start a JSON object */
+static int json_begin_record(struct output_buf *out,
+		enum output_format format)
+{
+	if (format != OUTPUT_JSON)
+		return 0;
+
+	if (!out->scan_open)
+		return output_begin_scan(out, format);
+
+	return out->n_records ? output_printf(out, ",") : 0;
+}
+
+static int json_end_record(struct output_buf *out, enum output_format format)
+{
+	out->n_records++;
+	return format == OUTPUT_JSONL ? output_printf(out, "\n") : 0;
+}
+
+/* Append a sensor's record, in the given output format */
+int output_record(struct output_buf *out, enum output_format format,
+		const struct sensor_desc *desc, struct sensor_data *sensor,
+		int rc, bool thresholds, unsigned int digits)
+{
+	struct record rec = {
+		.desc		= desc,
+		.sensor		= sensor,
+		.rc		= rc,
+		.thresholds	= thresholds,
+		.digits		= digits,
+	};
+	int ret;
+
+	if (format == OUTPUT_TEXT)
+		return output_append(out, text_record, &rec);
+	if (format == OUTPUT_CBOR)
+		return cbor_append(out, desc, sensor, rc);
+	if (format == OUTPUT_ARROW)
+		return arrow_append(out, desc, sensor, rc);
+
+	rec.timestamp_ms = now_ms();
+
+	ret = json_begin_record(out, format);
+	if (ret >= 0)
+		ret = output_append(out, json_record, &rec);
+	if (ret >= 0)
+		ret = json_end_record(out, format);
+	return ret;
+}
+
+/* Append a record of a sensor's removal, in watch mode */
+int output_removed(struct output_buf *out, enum output_format format,
+		const struct sensor_desc *desc)
+{
+	struct record rec = { .desc = desc };
+	int ret;
+
+	if (format == OUTPUT_TEXT)
+		return output_printf(out, "%s: removed\n", desc->object);
+	if (format == OUTPUT_CBOR)
+		return cbor_append(out, desc, NULL, 0);
+	/* Arrow rows are readings; there's no row for a removal */
+	if (format == OUTPUT_ARROW)
+		return 0;
+
+	rec.timestamp_ms = now_ms();
+
+	ret = json_begin_record(out, format);
+	if (ret >= 0)
+		ret = output_append(out, json_removed, &rec);
+	if (ret >= 0)
+		ret = json_end_record(out, format);
+	return ret;
+}
+
+/* Append a line of a history query's output: the path, the time, and
+ * the value, or for a bucket, the minimum, average, maximum and count */
+int output_history_point(struct output_buf *out, const char *path,
+		const struct history_point *point, bool bucket,
+		unsigned int digits)
+{
+	size_t path_len = strlen(path);
+	char *p;
+	int rc;
+
+	rc = output_reserve(out, path_len + 2 + 21 +
+			3 * (FORMAT_VALUE_MAX + 1) + 21);
+	if (rc < 0)
+		return rc;
+
+	p = out->buf + out->len;
+	memcpy(p, path, path_len);
+	p += path_len;
+	*p++ = ':';
+	*p++ = ' ';
+	p += format_u64(p, point->t);
+	*p++ = ' ';
+
+	if (!bucket) {
+		p += format_double(p, point->avg, digits);
+	} else {
+		p += format_double(p, point->min, digits);
+		*p++ = ' ';
+		p += format_double(p, point->avg, digits);
+		*p++ = ' ';
+		p += format_double(p, point->max, digits);
+		*p++ = ' ';
+		p += format_u64(p, point->count);
+	}
+
+	*p++ = '\n';
+	out->len = p - out->buf;
+	return 0;
+}
+
+int output_printf(struct output_buf *out, const char *fmt, ...)
+{
+	va_list ap;
+	int len, rc;
+
+	rc = output_reserve(out, 1);
+	if (rc < 0)
+		return rc;
+
+	va_start(ap, fmt);
+	len = vsnprintf(out->buf + out->len, out->alloc - out->len, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return -EINVAL;
+
+	if ((size_t)len >= out->alloc - out->len) {
+		rc = output_reserve(out, len + 1);
+		if (rc < 0)
+			return rc;
+		va_start(ap, fmt);
+		vsnprintf(out->buf + out->len, out->alloc - out->len, fmt, ap);
+		va_end(ap);
+	}
+
+	out->len += len;
+	return 0;
+}
+
+/* Write out everything buffered to fd, which must be blocking. The buffer
+ * is emptied even on error: there's no sense in retrying output that a
+ * closed pipe won't take.
+ */
+int output_flush(struct output_buf *out, int fd)
+{
+	uint64_t start;
+	size_t done;
+	ssize_t rc;
+
+	if (!out->len)
+		return 0;
+
+	start = stats_start();
+
+	for (done = 0; done < out->len; done += rc) {
+		rc = write(fd, out->buf + done, out->len - done);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				rc = 0;
+				continue;
+			}
+			rc = -errno;
+			out->len = 0;
+			return rc;
+		}
+	}
+
+	if (start) {
+		stats_record(STATS_OUTPUT, start);
+		stats_record_output(out->len);
+	}
+
+	out->len = 0;
+	return 0;
+}
+
+void output_free(struct output_buf *out)
+{
+	free(out->buf);
+	out->buf = NULL;
+	out->len = out->alloc = 0;
+	out->scan_open = false;
+	out->started = false;
+	path_dict_free(&out->paths);
+	arrow_batch_free(out->batch);
+	out->batch = NULL;
+}
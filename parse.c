@@ -0,0 +1,426 @@
+/* Parsing of sensor properties from D-Bus messages: GetAll replies,
+ * GetManagedObjects entries and PropertiesChanged signals all carry a{sv}
+ * property dictionaries, which are decoded into a sensor_data here.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <systemd/sd-bus.h>
+
+#include "sensor-query.h"
+
+/* Read a variant containing a single basic type, whose signature the
+ * caller has already checked, with read_basic(). That avoids
+ * sd_bus_message_read()'s varargs and the signature string parsing it
+ * does for each of its two levels.
+ */
+static int read_variant_basic(sd_bus_message *reply, const char *contents,
+		void *p)
+{
+	int rc;
+
+	rc = sd_bus_message_enter_container(reply, 'v', contents);
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_message_read_basic(reply, contents[0], p);
+	if (rc < 0)
+		return rc;
+
+	return sd_bus_message_exit_container(reply);
+}
+
+/* Read a variant holding any of the D-Bus integer types into an int64_t
+ * (or, for 't', a uint64_t), returning its type. The narrower types are
+ * widened, so that sensor_data only needs to distinguish signed and
+ * unsigned 64-bit values from doubles.
+ */
+static int read_variant_int(sd_bus_message *reply, const char *contents,
+		int64_t *val)
+{
+	union {
+		uint8_t		y;
+		int16_t		n;
+		uint16_t	q;
+		int32_t		i;
+		uint32_t	u;
+		int64_t		x;
+		uint64_t	t;
+	} tmp;
+	int rc;
+
+	rc = read_variant_basic(reply, contents, &tmp);
+	if (rc < 0)
+		return rc;
+
+	switch (contents[0]) {
+	case 'y':
+		*val = tmp.y;
+		break;
+	case 'n':
+		*val = tmp.n;
+		break;
+	case 'q':
+		*val = tmp.q;
+		break;
+	case 'i':
+		*val = tmp.i;
+		break;
+	case 'u':
+		*val = tmp.u;
+		break;
+	case 't':
+		/* stored as the bits of the uint64_t */
+		memcpy(val, &tmp.t, sizeof(*val));
+		return 't';
+	default:
+		*val = tmp.x;
+	}
+
+	return 'x';
+}
+
+/* parses a reply message (currently referencing a variant) into a
+ * sensor value. Will consume the variant from the reply. */
+static int parse_sensor_value(sd_bus_message *reply, struct sensor_data *data)
+{
+	const char *type_str = NULL;
+	char c;
+	int rc;
+
+	rc = sd_bus_message_peek_type(reply, &c, &type_str);
+	if (rc < 0)
+		return rc;
+
+	if (c != 'v' || !type_str[0] || type_str[1]) {
+		data->type = c == 'v' ? type_str[0] : c;
+		return -EPROTO;
+	}
+
+	if (type_str[0] == 'd') {
+		data->type = 'd';
+		return read_variant_basic(reply, type_str, &data->value.d);
+	}
+
+	if (!strchr("ynqiuxt", type_str[0])) {
+		data->type = type_str[0];
+		return -EPROTO;
+	}
+
+	rc = read_variant_int(reply, type_str, &data->value.x);
+	if (rc < 0)
+		return rc;
+
+	data->type = rc;
+	return 0;
+}
+
+/* Parse the Scale property: any integer type, as a power of ten. A scale
+ * beyond the range of an int64_t can't be a real one, so we ignore it,
+ * rather than fail the sensor.
+ */
+static int parse_scale(sd_bus_message *reply, int8_t *scale)
+{
+	const char *type_str;
+	int64_t val;
+	int rc;
+
+	rc = sd_bus_message_peek_type(reply, NULL, &type_str);
+	if (rc < 0)
+		return rc;
+
+	if (!rc || !type_str[0] || type_str[1] ||
+			!strchr("ynqiuxt", type_str[0]))
+		return -ENXIO;
+
+	rc = read_variant_int(reply, type_str, &val);
+	if (rc < 0)
+		return rc;
+
+	if (rc == 'x' && val >= -SENSOR_SCALE_MAX && val <= SENSOR_SCALE_MAX)
+		*scale = val;
+	else
+		*scale = 0;
+
+	return 0;
+}
+
+/* parse a boolean property's variant, as an int (as read_basic()
+ * requires) */
+static int parse_flag(sd_bus_message *reply, bool *flag)
+{
+	const char *type_str;
+	int rc, tmp;
+
+	rc = sd_bus_message_peek_type(reply, NULL, &type_str);
+	if (rc < 0)
+		return rc;
+
+	if (!rc || strcmp(type_str, "b"))
+		return -ENXIO;
+
+	rc = read_variant_basic(reply, type_str, &tmp);
+	if (rc < 0)
+		return rc;
+
+	*flag = !!tmp;
+	return 0;
+}
+
+/* reset the properties that a reply may not set: any that are on an
+ * interface the sensor doesn't implement */
+void reset_sensor_data(struct sensor_data *sensor)
+{
+	sensor->scale = 0;
+	sensor->lower_crit = false;
+	sensor->upper_crit = false;
+	sensor->lower_warn = false;
+	sensor->upper_warn = false;
+}
+
+/* The properties we track, and where each goes in a sensor_data. To
+ * track another property, add a field for it to sensor_data, and an
+ * entry here.
+ */
+enum prop_kind {
+	PROP_VALUE,	/* the sensor value, any numeric variant */
+	PROP_SCALE,	/* the value's power-of-ten scale */
+	PROP_FLAG,	/* a boolean, stored at offset */
+};
+
+static const struct sensor_prop {
+	const char	*name;
+	enum prop_kind	kind;
+	size_t		offset;
+} sensor_props[] = {
+	{ "Value",		PROP_VALUE,	0 },
+	{ "Scale",		PROP_SCALE,	0 },
+	{ "CriticalAlarmLow",	PROP_FLAG,
+		offsetof(struct sensor_data, lower_crit) },
+	{ "CriticalAlarmHigh",	PROP_FLAG,
+		offsetof(struct sensor_data, upper_crit) },
+	{ "WarningAlarmLow",	PROP_FLAG,
+		offsetof(struct sensor_data, lower_warn) },
+	{ "WarningAlarmHigh",	PROP_FLAG,
+		offsetof(struct sensor_data, upper_warn) },
+};
+
+/* Property names are looked up in an open-addressed hash of sensor_props,
+ * built on first use. The hash is just the name's length and its first
+ * and last characters, which separates the tracked names, and the other
+ * names on the Sensor.Value, Threshold, Availability and
+ * OperationalStatus interfaces, into distinct buckets. So a tracked name
+ * costs one string compare, and most of the others none at all.
+ */
+#define PROP_HASH_SIZE	64
+
+static const struct sensor_prop *prop_hash[PROP_HASH_SIZE];
+static bool prop_hash_built;
+
+static unsigned int prop_hash_fn(const char *name, size_t len)
+{
+	return (len + name[0] + name[len - 1] * 5) & (PROP_HASH_SIZE - 1);
+}
+
+static void prop_hash_build(void)
+{
+	unsigned int i, h;
+
+	for (i = 0; i < ARRAY_SIZE(sensor_props); i++) {
+		h = prop_hash_fn(sensor_props[i].name,
+				strlen(sensor_props[i].name));
+		while (prop_hash[h])
+			h = (h + 1) & (PROP_HASH_SIZE - 1);
+		prop_hash[h] = &sensor_props[i];
+	}
+
+	prop_hash_built = true;
+}
+
+static const struct sensor_prop *lookup_prop(const char *name)
+{
+	const struct sensor_prop *prop;
+	size_t len;
+	unsigned int h;
+
+	len = strlen(name);
+	if (!len)
+		return NULL;
+
+	for (h = prop_hash_fn(name, len); (prop = prop_hash[h]);
+			h = (h + 1) & (PROP_HASH_SIZE - 1))
+		if (!strcmp(prop->name, name))
+			return prop;
+
+	return NULL;
+}
+
+/* Parse one a{sv} property dictionary into a sensor_data, setting
+ * *value_set if a Value property was present. A sensor's properties may
+ * be spread over several dictionaries (one per interface, in a
+ * GetManagedObjects reply), so this can be called multiple times for
+ * the same sensor.
+ *
+ * A property of the wrong type fails the sensor (with -EPROTO for the
+ * Value, -ENXIO for the others), but the rest of the dictionary is still
+ * consumed, so a caller can go on to the next object in the message.
+ */
+int parse_sensor_props(sd_bus_message *reply, struct sensor_data *sensor,
+		bool *value_set)
+{
+	const struct sensor_prop *prop;
+	const char *name;
+	uint64_t start;
+	int rc, err;
+
+	if (!prop_hash_built)
+		prop_hash_build();
+
+	start = stats_start();
+
+	rc = sd_bus_message_enter_container(reply, 'a', "{sv}");
+	if (rc < 0)
+		return rc;
+
+	err = 0;
+	for (;;) {
+		rc = sd_bus_message_enter_container(reply, 'e', "sv");
+		if (rc <= 0)
+			break;
+
+		rc = sd_bus_message_read_basic(reply, 's', &name);
+		if (rc < 0)
+			break;
+
+		prop = lookup_prop(name);
+
+		if (!prop) {
+			rc = sd_bus_message_skip(reply, "v");
+
+		} else if (prop->kind == PROP_VALUE) {
+			rc = parse_sensor_value(reply, sensor);
+			if (rc >= 0)
+				*value_set = true;
+
+		} else if (prop->kind == PROP_SCALE) {
+			rc = parse_scale(reply, &sensor->scale);
+
+		} else {
+			rc = parse_flag(reply,
+				(bool *)((char *)sensor + prop->offset));
+		}
+
+		/* the variant is still unread; the first such error is
+		 * the one returned */
+		if (rc == -EPROTO || rc == -ENXIO) {
+			if (!err)
+				err = rc;
+			rc = sd_bus_message_skip(reply, "v");
+		}
+
+		if (rc < 0)
+			break;
+
+		rc = sd_bus_message_exit_container(reply);
+		if (rc < 0)
+			break;
+	}
+
+	if (rc >= 0)
+		rc = sd_bus_message_exit_container(reply);
+
+	stats_end(STATS_PARSE, start);
+	return rc < 0 ? rc : err;
+}
+
+/* Parse the reply to a GetAll on one interface into a sensor_data. Only
+ * the reply for the Value interface (or for all interfaces) needs to
+ * carry a Value; the others just add threshold states.
+ */
+int parse_iface_reply(sd_bus_message *reply, bool value_iface,
+		struct sensor_data *sensor)
+{
+	bool value_set;
+	int rc;
+
+	value_set = false;
+	rc = parse_sensor_props(reply, sensor, &value_set);
+	if (rc < 0)
+		return rc;
+
+	if (value_iface && !value_set)
+		return -ENOMSG;
+
+	return 0;
+}
+
+/* Parse a GetAll reply (an a{sv} of properties) into a sensor_data. Used
+ * by both the synchronous and asynchronous query paths.
+ */
+int parse_sensor_reply(sd_bus_message *reply, struct sensor_data *sensor)
+{
+	reset_sensor_data(sensor);
+	return parse_iface_reply(reply, true, sensor);
+}
+
+/* Parse the a{sa{sv}} interface dictionary for one object, as in a
+ * GetManagedObjects reply, into a sensor_data. As for
+ * parse_sensor_props(), a bad property fails the sensor but the whole
+ * dictionary is consumed; -ENOMSG if no interface carried a Value.
+ */
+int parse_object_ifaces(sd_bus_message *reply, struct sensor_data *sensor)
+{
+	bool value_set;
+	int rc, err;
+
+	reset_sensor_data(sensor);
+	value_set = false;
+	err = 0;
+
+	rc = sd_bus_message_enter_container(reply, 'a', "{sa{sv}}");
+	if (rc < 0)
+		return rc;
+
+	for (;;) {
+		const char *iface;
+
+		rc = sd_bus_message_enter_container(reply, 'e', "sa{sv}");
+		if (rc <= 0)
+			break;
+
+		rc = sd_bus_message_read_basic(reply, 's', &iface);
+		if (rc < 0)
+			break;
+
+		/* a bad property has been read past; keep going, so the
+		 * next object can be parsed */
+		rc = parse_sensor_props(reply, sensor, &value_set);
+		if (rc == -EPROTO || rc == -ENXIO) {
+			if (!err)
+				err = rc;
+		} else if (rc < 0) {
+			break;
+		}
+
+		rc = sd_bus_message_exit_container(reply);
+		if (rc < 0)
+			break;
+	}
+
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_message_exit_container(reply);
+	if (rc < 0)
+		return rc;
+
+	if (err)
+		return err;
+	if (!value_set)
+		return -ENOMSG;
+
+	return 0;
+}
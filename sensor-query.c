@@ -1,24 +1,32 @@
 /* Minimal application to query sensor values and threshold states, for
- * a predefined set of sensor objects.
+ * the sensor objects found through the ObjectMapper (or, failing that, a
+ * predefined set).
  */
 
 #include <err.h>
-#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <systemd/sd-bus.h>
 
-#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#include "sensor-query.h"
+#include "sensor-shm.h"
 
-struct sensor_desc {
-	const char *service;
-	const char *object;
-};
+#define DEFAULT_CACHE_PATH	"/run/sensor-query.cache"
+#define DEFAULT_SOCKET_PATH	"/run/sensor-query.sock"
+#define DEFAULT_CHANGES_PATH	"/run/sensor-query.changes"
+#define DEFAULT_HISTORY_PATH	"/run/sensor-query.history"
+#define HWMON_ROOT		"/sys/class/hwmon"
 
-/* Service name and object path for each sensor to query.
+/* Service name and object path for each sensor to query, when sensors
+ * can't be discovered through the ObjectMapper.
  * Expand as necessary
  */
 static const struct sensor_desc descs[] = {
@@ -28,142 +36,72 @@ static const struct sensor_desc descs[] = {
 	},
 };
 
-struct sensor_data {
-	char	type;
-	union {
-		double d;
-		int64_t x;
-	} value;
-	bool	lower_crit;
-	bool	upper_crit;
-	bool	lower_warn;
-	bool	upper_warn;
-};
+/* By default, we GetAll on every interface (with an empty interface
+ * name), so a single call provides the threshold states and value. With
+ * --filter-ifaces, we instead GetAll the Value interface, and each of
+ * the threshold interfaces: more calls, but the replies don't carry the
+ * units, limits, associations and other properties that we'd only skip
+ * over. With --values-only, the Value interface is all we need: a Get
+ * of Value alone would be smaller still, but an integer Value means
+ * nothing without its Scale.
+ */
+#define MAX_QUERY_IFACES	3
 
-/* parses a reply message (currently referencing a variant) into a
- * sensor value. Will consume the variant from the reply. */
-static int parse_sensor_value(sd_bus_message *reply, struct sensor_data *data,
-		const char *obj)
+static unsigned int query_ifaces(const struct query_config *config,
+		const char **ifaces)
 {
-	const char *type_str = NULL;
-	char c;
-	int rc;
-
-	rc = sd_bus_message_peek_type(reply, &c, &type_str);
-	if (rc < 0)
-		return rc;
-
-	if (c != 'v' || strlen(type_str) != 1) {
-		printf("%s: invalid sensor type %c:%s\n", obj, c, type_str);
-		return -1;
+	if (!config->thresholds) {
+		ifaces[0] = VALUE_IFACE;
+		return 1;
 	}
 
-	data->type = type_str[0];
-
-	if (data->type == 'd') {
-		rc = sd_bus_message_read(reply, "v", "d", &data->value.d);
-
-	} else if (data->type == 'x') {
-		rc = sd_bus_message_read(reply, "v", "x", &data->value.x);
-
-	} else {
-		printf("%s: invalid type '%c', expected 'd/x'\n",
-				obj, data->type);
-		rc = -1;
+	if (!config->filter_ifaces) {
+		ifaces[0] = "";
+		return 1;
 	}
 
-	return rc;
+	ifaces[0] = VALUE_IFACE;
+	ifaces[1] = CRIT_IFACE;
+	ifaces[2] = WARN_IFACE;
+	return 3;
 }
 
-/* Query a sensor object over dbus, by performing a single GetAll method
- * on the properties interface. That provides the threhold states and
- * value in a single dbus call.
+/* Query a sensor object over dbus, with a GetAll method call on the
+ * properties interface for each of the query interfaces. A sensor
+ * without one of the threshold interfaces just has those thresholds
+ * unset.
  */
-static int query_sensor(sd_bus *bus, const struct sensor_desc *desc,
-		struct sensor_data *sensor)
+static int query_sensor(sd_bus *bus, const struct query_config *config,
+		const struct sensor_desc *desc, struct sensor_data *sensor)
 {
+	const char *ifaces[MAX_QUERY_IFACES];
 	sd_bus_message *reply;
-	bool value_set;
+	unsigned int i, n;
+	uint64_t start;
 	int rc;
 
-	sensor->lower_crit = false;
-	sensor->upper_crit = false;
-	sensor->lower_warn = false;
-	sensor->upper_warn = false;
-
-        rc = sd_bus_call_method(bus, desc->service, desc->object,
-			"org.freedesktop.DBus.Properties", "GetAll",
-			NULL, &reply, "s", "");
-	if (rc < 0)
-		return rc;
-
-	rc = sd_bus_message_enter_container(reply, 'a', "{sv}");
-	if (rc < 0)
-		return rc;
-
-	value_set = false;
-	for (;;) {
-		bool *threshold_p;
-		const char *prop;
-		bool is_value;
-
-		rc = sd_bus_message_enter_container(reply, 'e', "sv");
-		if (rc <= 0)
-			break;
-
-		rc = sd_bus_message_read(reply, "s", &prop);
-		if (rc < 0)
-			break;
-
-		threshold_p = NULL;
-		is_value = false;
+	n = query_ifaces(config, ifaces);
+	reset_sensor_data(sensor);
 
-		if (!strcmp(prop, "Value")) {
-			is_value = true;
-		} else if (!strcmp(prop, "CriticalAlarmLow")) {
-			threshold_p = &sensor->lower_crit;
-		} else if (!strcmp(prop, "CriticalAlarmHigh")) {
-			threshold_p = &sensor->upper_crit;
-		} else if (!strcmp(prop, "WarningAlarmLow")) {
-			threshold_p = &sensor->lower_warn;
-		} else if (!strcmp(prop, "WarningAlarmHigh")) {
-			threshold_p = &sensor->upper_warn;
+	for (i = 0; i < n; i++) {
+		start = stats_start();
+		rc = sd_bus_call_method(bus, desc->service, desc->object,
+				"org.freedesktop.DBus.Properties", "GetAll",
+				NULL, &reply, "s", ifaces[i]);
+		stats_end_call(desc->service, start, rc);
+		if (rc < 0) {
+			if (i)
+				continue;
+			return rc;
 		}
 
-		if (is_value) {
-			rc = parse_sensor_value(reply, sensor, desc->object);
-			if (rc < 0)
-				break;
-
-			value_set = true;
-
-		} else if (threshold_p) {
-			int tmp;
-			rc = sd_bus_message_read(reply, "v", "b", &tmp);
-			*threshold_p = !!tmp;
-			if (rc < 0)
-				break;
-
-		} else {
-			rc = sd_bus_message_skip(reply, "v");
-			if (rc < 0)
-				break;
-		}
-
-		rc = sd_bus_message_exit_container(reply);
+		rc = parse_iface_reply(reply, !i, sensor);
+		sd_bus_message_unref(reply);
 		if (rc < 0)
-			break;
+			return rc;
 	}
 
-	sd_bus_message_exit_container(reply);
-	sd_bus_message_unref(reply);
-
-	if (!value_set) {
-		printf("%s: no Value property\n", desc->object);
-		return -1;
-	}
-
-	return rc;
+	return 0;
 }
 
 /* str must have enough capacity for all thresholds to be set:
@@ -200,42 +138,50 @@ static void format_thresholds(struct sensor_data *sensor, char *str)
 		strcpy(p, "ok");
 }
 
-/* str assumed to be 12 bytes */
-static void format_value(const struct sensor_data *sensor, char *str)
+/* Format a sensor's output line, as output by output_sensor(). As with
+ * snprintf(), returns the length of the full line, which may be larger
+ * than len. Errors found in parsing get a line of their own first, so
+ * that they're reported in order with the rest of the output.
+ */
+int format_sensor_line(char *buf, size_t len, const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, bool thresholds,
+		unsigned int digits)
 {
-	const size_t str_size = 12;
+	char threshold_str[12], value_str[FORMAT_VALUE_MAX];
+	uint64_t start;
+	int ret;
 
-	switch (sensor->type) {
-	case 'd':
-		snprintf(str, str_size, "%f", sensor->value.d);
-		break;
-	case 'x':
-		snprintf(str, str_size, "%" PRId64, sensor->value.x);
-		break;
-	default:
-		strncpy(str, "(unknown)", str_size);
-	}
-}
+	if (rc == -ENOMSG)
+		return snprintf(buf, len, "%s: no Value property\n"
+				"%s: failed to read sensor object\n",
+				desc->object, desc->object);
+	if (rc == -EPROTO)
+		return snprintf(buf, len,
+				"%s: invalid type '%c', expected a number\n"
+				"%s: failed to read sensor object\n",
+				desc->object, sensor->type, desc->object);
+	if (rc)
+		return snprintf(buf, len, "%s: failed to read sensor object\n",
+				desc->object);
 
-static void print_sensor(sd_bus *bus, const struct sensor_desc *desc)
-{
-	char threshold_str[12], value_str[12];
-	struct sensor_data sensor;
-	int rc;
+	start = stats_start();
 
-	rc = query_sensor(bus, desc, &sensor);
-	if (rc) {
-		printf("%s: failed to read sensor object\n", desc->object);
-		return;
-	}
+	format_sensor_value(value_str, sensor, digits);
 
-	format_value(&sensor, value_str);
-	format_thresholds(&sensor, threshold_str);
+	if (thresholds) {
+		format_thresholds(sensor, threshold_str);
+		ret = snprintf(buf, len, "%s: %s %s\n", desc->object,
+				value_str, threshold_str);
+	} else {
+		ret = snprintf(buf, len, "%s: %s\n", desc->object,
+				value_str);
+	}
 
-	printf("%s: %s %s\n", desc->object, value_str, threshold_str);
+	stats_end(STATS_FORMAT, start);
+	return ret;
 }
 
-static bool sensor_matches_type(const struct sensor_desc *desc,
+bool sensor_matches_type(const struct sensor_desc *desc,
 		const char *type)
 {
 	const char *sensor_root = "/xyz/openbmc_project/sensors/";
@@ -261,29 +207,1347 @@ static bool sensor_matches_type(const struct sensor_desc *desc,
 	return !strncmp(path + root_len, type, type_len);
 }
 
-int main(int argc, char **argv)
+/* Asynchronous query engine: rather than waiting for each GetAll reply
+ * before sending the next request, we keep up to max_inflight calls
+ * outstanding on the bus, and parse replies as they arrive. Output is
+ * still produced in descs[] order; a sensor is printed once it, and
+ * every sensor before it, has completed.
+ */
+struct async_ctx;
+
+enum query_state {
+	QUERY_PENDING,	/* waiting for a GetAll to be sent */
+	QUERY_SENT,	/* GetAll in flight */
+	QUERY_BULK,	/* waiting on a service-wide GetManagedObjects */
+	QUERY_DONE,
+};
+
+/* a GetAll call on one of the query interfaces */
+struct async_call {
+	struct async_query		*query;
+	sd_bus_slot			*slot;
+	uint64_t			sent;	/* for --stats */
+};
+
+struct async_query {
+	struct async_ctx		*ctx;
+	const struct sensor_desc	*desc;
+	struct sensor_data		sensor;
+	struct async_call		calls[MAX_QUERY_IFACES];
+	unsigned int			n_pending;	/* calls in flight */
+	int				rc;
+	enum query_state		state;
+};
+
+/* In bulk mode, sensors are grouped by service, and we fetch all of a
+ * service's objects with a single ObjectManager.GetManagedObjects call.
+ * queries[] is sorted by object path, so replies can be matched up with
+ * a bsearch.
+ */
+struct bulk_service {
+	struct async_ctx	*ctx;
+	const char		*service;
+	const char		*manager_path;
+	struct async_query	**queries;
+	unsigned int		n_queries;
+	sd_bus_slot		*slot;
+	uint64_t		sent;
+};
+
+struct async_ctx {
+	sd_bus			*bus;
+	sensor_result_fn	result;
+	void			*result_data;
+	struct async_query	*queries;
+	unsigned int		n_queries;
+	unsigned int		next_send;
+	unsigned int		next_print;
+	unsigned int		n_inflight;
+	unsigned int		max_inflight;
+	const char		*ifaces[MAX_QUERY_IFACES];
+	unsigned int		n_ifaces;
+	struct bulk_service	*services;
+	unsigned int		n_services;
+};
+
+/* print the prefix of queries that have completed */
+static void async_flush(struct async_ctx *ctx)
+{
+	struct async_query *query;
+
+	while (ctx->next_print < ctx->n_queries) {
+		query = &ctx->queries[ctx->next_print];
+		if (query->state != QUERY_DONE)
+			break;
+		ctx->result(query->desc, &query->sensor, query->rc,
+				ctx->result_data);
+		ctx->next_print++;
+	}
+}
+
+static int async_reply(sd_bus_message *reply, void *data,
+		sd_bus_error *ret_error)
+{
+	struct async_call *call = data;
+	struct async_query *query = call->query;
+	unsigned int idx = call - query->calls;
+	int rc;
+
+	(void)ret_error;
+
+	if (sd_bus_message_is_method_error(reply, NULL)) {
+		rc = -sd_bus_message_get_errno(reply);
+		if (!rc)
+			rc = -EIO;
+		stats_end_call(query->desc->service, call->sent, rc);
+		/* the sensor doesn't have this threshold interface */
+		if (idx)
+			rc = 0;
+	} else {
+		stats_end_call(query->desc->service, call->sent, 0);
+		rc = parse_iface_reply(reply, !idx, &query->sensor);
+	}
+
+	if (rc < 0 && !query->rc)
+		query->rc = rc;
+
+	call->slot = sd_bus_slot_unref(call->slot);
+	query->ctx->n_inflight--;
+	if (!--query->n_pending)
+		query->state = QUERY_DONE;
+
+	return 0;
+}
+
+static int async_call_send(struct async_ctx *ctx, struct async_call *call,
+		unsigned int idx)
+{
+	const struct sensor_desc *desc = call->query->desc;
+
+	call->sent = stats_start();
+
+	return sd_bus_call_method_async(ctx->bus, &call->slot,
+			desc->service, desc->object,
+			"org.freedesktop.DBus.Properties", "GetAll",
+			async_reply, call, "s", ctx->ifaces[idx]);
+}
+
+/* fill the request window, up to max_inflight outstanding calls */
+static void async_send(struct async_ctx *ctx)
+{
+	while (ctx->next_send < ctx->n_queries &&
+			ctx->n_inflight < ctx->max_inflight) {
+		struct async_query *query = &ctx->queries[ctx->next_send++];
+		struct async_call *call;
+		unsigned int i;
+		int rc;
+
+		if (query->state != QUERY_PENDING)
+			continue;
+
+		reset_sensor_data(&query->sensor);
+		query->rc = 0;
+
+		for (i = 0; i < ctx->n_ifaces; i++) {
+			call = &query->calls[i];
+			call->query = query;
+			rc = async_call_send(ctx, call, i);
+			if (rc < 0) {
+				query->rc = rc;
+				break;
+			}
+
+			query->n_pending++;
+			ctx->n_inflight++;
+		}
+
+		query->state = query->n_pending ? QUERY_SENT : QUERY_DONE;
+	}
+}
+
+/* Any of a service's sensors not satisfied by the bulk reply (because
+ * the service has no ObjectManager, or the object was outside of its
+ * scope) are queued for an individual GetAll instead.
+ */
+static void bulk_fallback(struct bulk_service *svc)
+{
+	unsigned int i;
+
+	for (i = 0; i < svc->n_queries; i++) {
+		struct async_query *query = svc->queries[i];
+
+		if (query->state != QUERY_BULK)
+			continue;
+
+		query->state = QUERY_PENDING;
+		if (query - svc->ctx->queries < svc->ctx->next_send)
+			svc->ctx->next_send = query - svc->ctx->queries;
+	}
+}
+
+static int bulk_query_cmp(const void *a, const void *b)
+{
+	const struct async_query *qa = *(struct async_query * const *)a;
+	const struct async_query *qb = *(struct async_query * const *)b;
+
+	return strcmp(qa->desc->object, qb->desc->object);
+}
+
+static int bulk_query_key_cmp(const void *key, const void *elem)
+{
+	const struct async_query *query = *(struct async_query * const *)elem;
+
+	return strcmp(key, query->desc->object);
+}
+
+static int bulk_send(struct bulk_service *svc);
+
+static int bulk_reply(sd_bus_message *reply, void *data,
+		sd_bus_error *ret_error)
+{
+	struct bulk_service *svc = data;
+	int rc;
+
+	(void)ret_error;
+
+	svc->slot = sd_bus_slot_unref(svc->slot);
+
+	stats_end_call(svc->service, svc->sent,
+			sd_bus_message_is_method_error(reply, NULL) ? -EIO : 0);
+
+	if (sd_bus_message_is_method_error(reply, NULL)) {
+		/* dbus-sensors daemons place their ObjectManager at the
+		 * sensors root, but older daemons have it at /.
+		 */
+		if (strcmp(svc->manager_path, "/")) {
+			svc->manager_path = "/";
+			if (bulk_send(svc) >= 0)
+				return 0;
+		}
+		bulk_fallback(svc);
+		return 0;
+	}
+
+	rc = sd_bus_message_enter_container(reply, 'a', "{oa{sa{sv}}}");
+	if (rc < 0)
+		goto out;
+
+	for (;;) {
+		struct async_query **queryp, *query;
+		const char *path;
+
+		rc = sd_bus_message_enter_container(reply, 'e', "oa{sa{sv}}");
+		if (rc <= 0)
+			break;
+
+		rc = sd_bus_message_read_basic(reply, 'o', &path);
+		if (rc < 0)
+			break;
+
+		queryp = bsearch(path, svc->queries, svc->n_queries,
+				sizeof(*svc->queries), bulk_query_key_cmp);
+		query = queryp ? *queryp : NULL;
+
+		if (!query || query->state != QUERY_BULK) {
+			rc = sd_bus_message_skip(reply, "a{sa{sv}}");
+			if (rc < 0)
+				break;
+		} else {
+			/* a bad sensor fails only itself; anything else
+			 * leaves us lost in the message */
+			rc = parse_object_ifaces(reply, &query->sensor);
+			query->rc = rc;
+			query->state = QUERY_DONE;
+			if (rc < 0 && rc != -ENOMSG && rc != -EPROTO &&
+					rc != -ENXIO)
+				break;
+		}
+
+		rc = sd_bus_message_exit_container(reply);
+		if (rc < 0)
+			break;
+	}
+
+out:
+	bulk_fallback(svc);
+	return 0;
+}
+
+static int bulk_send(struct bulk_service *svc)
+{
+	svc->sent = stats_start();
+	return sd_bus_call_method_async(svc->ctx->bus, &svc->slot,
+			svc->service, svc->manager_path,
+			"org.freedesktop.DBus.ObjectManager",
+			"GetManagedObjects", bulk_reply, svc, NULL);
+}
+
+/* Group queries by service, and send one GetManagedObjects to each.
+ * These don't count against max_inflight; there are generally only a
+ * handful of sensor services.
+ */
+static int bulk_init(struct async_ctx *ctx)
+{
+	struct async_query **queries;
+	unsigned int i, j, *svc_idx;
+
+	ctx->services = calloc(ctx->n_queries, sizeof(*ctx->services));
+	queries = calloc(ctx->n_queries, sizeof(*queries));
+	svc_idx = calloc(ctx->n_queries, sizeof(*svc_idx));
+	if (!ctx->services || !queries || !svc_idx) {
+		free(queries);
+		free(svc_idx);
+		return -ENOMEM;
+	}
+
+	/* find (or create) the service for each query */
+	for (i = 0; i < ctx->n_queries; i++) {
+		struct async_query *query = &ctx->queries[i];
+		struct bulk_service *svc;
+
+		for (j = 0; j < ctx->n_services; j++)
+			if (!strcmp(ctx->services[j].service,
+						query->desc->service))
+				break;
+
+		svc = &ctx->services[j];
+		if (j == ctx->n_services) {
+			svc->ctx = ctx;
+			svc->service = query->desc->service;
+			svc->manager_path = "/xyz/openbmc_project/sensors";
+			ctx->n_services++;
+		}
+
+		svc->n_queries++;
+		svc_idx[i] = j;
+		query->state = QUERY_BULK;
+	}
+
+	/* partition queries[] into per-service runs */
+	for (i = 0, j = 0; i < ctx->n_services; i++) {
+		ctx->services[i].queries = &queries[j];
+		j += ctx->services[i].n_queries;
+		ctx->services[i].n_queries = 0;
+	}
+
+	for (i = 0; i < ctx->n_queries; i++) {
+		struct bulk_service *svc = &ctx->services[svc_idx[i]];
+
+		svc->queries[svc->n_queries++] = &ctx->queries[i];
+	}
+
+	free(svc_idx);
+
+	for (i = 0; i < ctx->n_services; i++) {
+		struct bulk_service *svc = &ctx->services[i];
+
+		qsort(svc->queries, svc->n_queries, sizeof(*svc->queries),
+				bulk_query_cmp);
+
+		if (bulk_send(svc) < 0)
+			bulk_fallback(svc);
+	}
+
+	return 0;
+}
+
+static void bulk_free(struct async_ctx *ctx)
+{
+	unsigned int i;
+
+	if (!ctx->services)
+		return;
+
+	for (i = 0; i < ctx->n_services; i++)
+		sd_bus_slot_unref(ctx->services[i].slot);
+
+	/* all per-service query lists share the first service's array */
+	if (ctx->n_services)
+		free(ctx->services[0].queries);
+	free(ctx->services);
+}
+
+static int query_sensors_async(sd_bus *bus,
+		const struct query_config *config,
+		const struct sensor_desc **sensors, unsigned int n,
+		sensor_result_fn result, void *result_data)
+{
+	struct async_ctx ctx;
+	unsigned int i, j;
+	int rc;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.result = result;
+	ctx.result_data = result_data;
+	ctx.n_queries = n;
+	ctx.max_inflight = config->max_inflight ? config->max_inflight : 1;
+	ctx.n_ifaces = query_ifaces(config, ctx.ifaces);
+	ctx.queries = calloc(n ? n : 1, sizeof(*ctx.queries));
+	if (!ctx.queries)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		ctx.queries[i].ctx = &ctx;
+		ctx.queries[i].desc = sensors[i];
+		ctx.queries[i].state = QUERY_PENDING;
+	}
+
+	if (config->engine == ENGINE_BULK && n) {
+		rc = bulk_init(&ctx);
+		if (rc < 0)
+			goto out;
+	}
+
+	rc = 0;
+	for (;;) {
+		async_send(&ctx);
+		async_flush(&ctx);
+
+		if (ctx.next_print == ctx.n_queries)
+			break;
+
+		rc = sd_bus_process(bus, NULL);
+		if (rc < 0)
+			break;
+		if (rc > 0)
+			continue;
+
+		rc = sd_bus_wait(bus, UINT64_MAX);
+		if (rc < 0)
+			break;
+	}
+
+out:
+	bulk_free(&ctx);
+	for (i = 0; i < n; i++)
+		for (j = 0; j < ctx.n_ifaces; j++)
+			sd_bus_slot_unref(ctx.queries[i].calls[j].slot);
+	free(ctx.queries);
+
+	return rc < 0 ? rc : 0;
+}
+
+/* Query a set of sensors with the configured engine, passing each
+ * result to the result callback, in order.
+ */
+int query_sensors(sd_bus *bus, const struct query_config *config,
+		const struct sensor_desc **sensors, unsigned int n,
+		sensor_result_fn result, void *result_data)
+{
+	struct sensor_data sensor;
+	unsigned int i;
+	int rc;
+
+	if (config->hwmon)
+		return hwmon_query_sensors(bus, config, sensors, n,
+				result, result_data);
+
+	switch (config->engine) {
+	case ENGINE_SYNC:
+		for (i = 0; i < n; i++) {
+			rc = query_sensor(bus, config, sensors[i], &sensor);
+			result(sensors[i], &sensor, rc, result_data);
+		}
+		return 0;
+	case ENGINE_ASYNC:
+	case ENGINE_BULK:
+		return query_sensors_async(bus, config, sensors, n,
+				result, result_data);
+	}
+
+	return -EINVAL;
+}
+
+/* Output goes through a buffer, flushed to stdout once a scan completes,
+ * or in watch mode, at the end of each event loop iteration.
+ */
+struct print_ctx {
+	const struct query_config	*config;
+	struct output_buf		out;
+	/* --changes: only output sensors whose state has changed */
+	struct change_filter		*changes;
+};
+
+static void print_result(const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, void *data)
+{
+	struct print_ctx *ctx = data;
+	int ret;
+
+	/* skip unchanged sensors before any formatting; if we can't tell,
+	 * output them */
+	if (ctx->changes) {
+		ret = change_filter_check(ctx->changes, desc, sensor, rc);
+		if (ret < 0)
+			warnx("out of memory for change tracking");
+		else if (!ret)
+			return;
+	}
+
+	if (output_record(&ctx->out, ctx->config->format, desc, sensor, rc,
+				ctx->config->thresholds,
+				ctx->config->digits) < 0)
+		warnx("out of memory for output");
+}
+
+/* flush, completing any JSON object or CBOR array for the scan (or, in
+ * watch mode, for the updates since the last flush) */
+static void print_flush(struct print_ctx *ctx)
+{
+	int rc;
+
+	rc = output_end_scan(&ctx->out, ctx->config->format);
+	if (rc >= 0)
+		rc = output_flush(&ctx->out, STDOUT_FILENO);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't write output: %s", strerror(-rc));
+}
+
+/* flush the last of the output, ending the stream */
+static void print_finish(struct print_ctx *ctx)
+{
+	if (output_end_stream(&ctx->out, ctx->config->format) < 0)
+		warnx("out of memory for output");
+	print_flush(ctx);
+	output_free(&ctx->out);
+}
+
+/* watch mode: print each sensor as it changes */
+static void watch_print_updated(struct watch_ctx *ctx,
+		const struct watch_sensor *ws, void *data)
+{
+	struct print_ctx *print = data;
+	struct sensor_data sensor = ws->data;
+
+	(void)ctx;
+
+	print_result(&ws->desc, &sensor, ws->valid ? 0 : -1, print);
+	if (print->out.len >= OUTPUT_WATERMARK)
+		print_flush(print);
+}
+
+static void watch_print_removed(struct watch_ctx *ctx,
+		const struct sensor_desc *desc, void *data)
+{
+	struct print_ctx *print = data;
+
+	(void)ctx;
+
+	if (print->changes)
+		change_filter_forget(print->changes, desc);
+
+	if (output_removed(&print->out, print->config->format, desc) < 0)
+		warnx("out of memory for output");
+}
+
+static void watch_print_flush(struct watch_ctx *ctx, void *data)
+{
+	struct print_ctx *print = data;
+
+	(void)ctx;
+
+	if (output_scan_due(&print->out, print->config->format))
+		print_flush(print);
+}
+
+/* --format=arrow batches rows until they're due, which is only checked
+ * as events arrive; this makes sure a quiet stream gets its rows too */
+static int watch_print_timer(sd_event_source *s, uint64_t usec, void *data)
+{
+	watch_print_flush(NULL, data);
+
+	sd_event_source_set_time(s, usec + ARROW_BATCH_MS * 1000);
+	sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+	return 0;
+}
+
+static int watch_print_setup(struct watch_ctx *ctx, sd_event *event,
+		void *data)
+{
+	struct print_ctx *print = data;
+	uint64_t now;
+	int rc;
+
+	(void)ctx;
+
+	if (print->config->format != OUTPUT_ARROW)
+		return 0;
+
+	rc = sd_event_now(event, CLOCK_MONOTONIC, &now);
+	if (rc < 0)
+		return rc;
+
+	return sd_event_add_time(event, NULL, CLOCK_MONOTONIC,
+			now + ARROW_BATCH_MS * 1000, 0, watch_print_timer,
+			print);
+}
+
+/* give new sensors their path IDs, before their first records */
+static void watch_print_changed(struct watch_ctx *ctx, void *data)
 {
-	const char *type;
+	const struct watch_sensor *sensors;
+	struct print_ctx *print = data;
+	unsigned int i, n;
+
+	sensors = watch_get_sensors(ctx, &n);
+	for (i = 0; i < n; i++)
+		if (output_declare(&print->out, print->config->format,
+					&sensors[i].desc) < 0)
+			warnx("out of memory for output");
+}
+
+static const struct watch_ops watch_print_ops = {
+	.setup		= watch_print_setup,
+	.updated	= watch_print_updated,
+	.removed	= watch_print_removed,
+	.changed	= watch_print_changed,
+	.flush		= watch_print_flush,
+};
+
+/* Find the set of sensors to query. A valid cache lets us skip the
+ * mapper query entirely, provided each service is still owned by the
+ * same connection as when the cache was written. Otherwise we discover
+ * through the mapper and refresh the cache. If there's no mapper, use
+ * the compiled-in descs[].
+ */
+static void load_sensor_table(sd_bus *bus, struct sensor_table *table,
+		const char *cache_path, bool rescan)
+{
+	int rc;
+
+	if (cache_path && !rescan) {
+		rc = sensor_cache_load(cache_path, table);
+		if (!rc) {
+			rc = sensor_table_validate(bus, table);
+			if (!rc)
+				return;
+			sensor_table_free(table);
+		}
+	}
+
+	rc = discover_sensors(bus, table);
+	if (rc < 0) {
+		table->descs = descs;
+		table->n_descs = ARRAY_SIZE(descs);
+		return;
+	}
+
+	if (cache_path) {
+		rc = sensor_cache_save(cache_path, table);
+		if (rc < 0)
+			warnx("can't write sensor cache %s: %s", cache_path,
+					strerror(-rc));
+	}
+}
+
+/* a size in bytes, with an optional K, M or G suffix */
+static int parse_size(const char *arg, uint64_t *size)
+{
+	unsigned int shift;
+	char *endp;
+
+	*size = strtoull(arg, &endp, 10);
+	if (endp == arg)
+		return -EINVAL;
+
+	switch (*endp) {
+	case 'K':
+		shift = 10;
+		break;
+	case 'M':
+		shift = 20;
+		break;
+	case 'G':
+		shift = 30;
+		break;
+	case '\0':
+		return 0;
+	default:
+		return -EINVAL;
+	}
+
+	if (endp[1] || *size > UINT64_MAX >> shift)
+		return -EINVAL;
+
+	*size <<= shift;
+	return 0;
+}
+
+/* a duration: a number, with a unit of ms, s, m, h or d */
+static int parse_duration(const char *arg, uint64_t *ms)
+{
+	static const struct {
+		const char	*suffix;
+		uint64_t	ms;
+	} units[] = {
+		{ "ms", 1 },
+		{ "s", 1000 },
+		{ "m", 60 * 1000 },
+		{ "h", 60 * 60 * 1000 },
+		{ "d", 24 * 60 * 60 * 1000 },
+	};
 	unsigned int i;
+	char *endp;
+
+	*ms = strtoull(arg, &endp, 10);
+	if (endp == arg || *arg == '-')
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(units); i++) {
+		if (strcmp(endp, units[i].suffix))
+			continue;
+		if (*ms > UINT64_MAX / units[i].ms)
+			return -EINVAL;
+		*ms *= units[i].ms;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* decimal places to print doubles with: 0 to FORMAT_MAX_DIGITS */
+static int parse_digits(const char *arg, unsigned int *digits)
+{
+	unsigned long val;
+	char *endp;
+
+	val = strtoul(arg, &endp, 10);
+	if (endp == arg || *endp || val > FORMAT_MAX_DIGITS)
+		return -EINVAL;
+
+	*digits = val;
+	return 0;
+}
+
+/* A time, in ms since the epoch: "now", @SECONDS since the epoch, or a
+ * duration before now */
+static int parse_time(const char *arg, uint64_t now, uint64_t *ms)
+{
+	uint64_t ago;
+	char *endp;
+
+	if (!strcmp(arg, "now")) {
+		*ms = now;
+		return 0;
+	}
+
+	if (*arg == '@') {
+		*ms = strtoull(arg + 1, &endp, 10);
+		if (endp == arg + 1 || *endp || arg[1] == '-' ||
+				*ms > UINT64_MAX / 1000)
+			return -EINVAL;
+		*ms *= 1000;
+		return 0;
+	}
+
+	if (parse_duration(arg, &ago) < 0)
+		return -EINVAL;
+
+	*ms = ago < now ? now - ago : 0;
+	return 0;
+}
+
+struct history_print_ctx {
+	struct output_buf	out;
+	bool			bucket;
+	unsigned int		digits;
+	int			rc;
+};
+
+static void history_print(const char *path,
+		const struct history_point *point, void *data)
+{
+	struct history_print_ctx *ctx = data;
+	int rc;
+
+	if (ctx->rc < 0)
+		return;
+
+	rc = output_history_point(&ctx->out, path, point, ctx->bucket,
+			ctx->digits);
+	if (rc >= 0 && ctx->out.len >= OUTPUT_WATERMARK)
+		rc = output_flush(&ctx->out, STDOUT_FILENO);
+	if (rc < 0)
+		ctx->rc = rc;
+}
+
+static void history_usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s history [options] TYPE|PATH\n"
+		"Print the samples recorded with --history for a sensor, or "
+						"all sensors\n"
+		"of a type: a line each, of the path, the time in ms since "
+						"the epoch\n"
+		"and the value. With --bucket, a line per bucket, of the "
+						"path, its\n"
+		"start time, and the minimum, average and maximum value, and "
+						"the\n"
+		"number of samples with a value.\n"
+		"options:\n"
+		"  -f, --file=FILE          history file (default %s)\n"
+		"      --since=TIME         from TIME: now, @SECONDS since the "
+						"epoch, or\n"
+		"                           a duration ago (ms, s, m, h or d, "
+						"as in 24h)\n"
+		"      --until=TIME         up to TIME (default now)\n"
+		"      --bucket=DURATION    summarise each DURATION of samples\n"
+		"      --digits=N           decimal places for values "
+						"(default %u, max %u)\n"
+		"  -h, --help               show this help\n",
+		progname, DEFAULT_HISTORY_PATH, FORMAT_DEFAULT_DIGITS,
+		FORMAT_MAX_DIGITS);
+}
+
+/* long-only options, for both the query and history commands */
+enum {
+	OPT_DIGITS = 0x200,
+};
+
+/* long-only options, for history */
+enum {
+	OPT_SINCE = 0x100,
+	OPT_UNTIL,
+	OPT_BUCKET,
+};
+
+/* sensor-query history: query the file written by --history */
+static int history_main(const char *progname, int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "file",	required_argument,	NULL, 'f' },
+		{ "since",	required_argument,	NULL, OPT_SINCE },
+		{ "until",	required_argument,	NULL, OPT_UNTIL },
+		{ "bucket",	required_argument,	NULL, OPT_BUCKET },
+		{ "digits",	required_argument,	NULL, OPT_DIGITS },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ 0 },
+	};
+	struct history_print_ctx ctx = { 0 };
+	uint64_t now, since, until, bucket;
+	const char *file, *match;
+	struct timespec ts;
+	int rc;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	file = DEFAULT_HISTORY_PATH;
+	since = 0;
+	until = now;
+	bucket = 0;
+	ctx.digits = FORMAT_DEFAULT_DIGITS;
+
+	for (;;) {
+		rc = getopt_long(argc, argv, "f:h", options, NULL);
+		if (rc == -1)
+			break;
+
+		switch (rc) {
+		case 'f':
+			file = optarg;
+			break;
+		case OPT_SINCE:
+			if (parse_time(optarg, now, &since) < 0)
+				errx(EXIT_FAILURE, "invalid time '%s'",
+						optarg);
+			break;
+		case OPT_UNTIL:
+			if (parse_time(optarg, now, &until) < 0)
+				errx(EXIT_FAILURE, "invalid time '%s'",
+						optarg);
+			break;
+		case OPT_BUCKET:
+			if (parse_duration(optarg, &bucket) < 0 || !bucket)
+				errx(EXIT_FAILURE, "invalid bucket '%s'",
+						optarg);
+			break;
+		case OPT_DIGITS:
+			if (parse_digits(optarg, &ctx.digits) < 0)
+				errx(EXIT_FAILURE, "invalid digits '%s'",
+						optarg);
+			break;
+		case 'h':
+			history_usage(progname);
+			return EXIT_SUCCESS;
+		default:
+			history_usage(progname);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		history_usage(progname);
+		return EXIT_FAILURE;
+	}
+	match = argv[optind];
+
+	ctx.bucket = bucket;
+	rc = history_query(file, match, since, until, bucket, history_print,
+			&ctx);
+	if (rc < 0)
+		errx(EXIT_FAILURE, "can't read history %s: %s", file,
+				strerror(-rc));
+	if (!rc)
+		errx(EXIT_FAILURE, "no history for '%s'", match);
+
+	if (ctx.rc >= 0)
+		ctx.rc = output_flush(&ctx.out, STDOUT_FILENO);
+	output_free(&ctx.out);
+	if (ctx.rc < 0)
+		errx(EXIT_FAILURE, "write failed: %s", strerror(-ctx.rc));
+
+	return EXIT_SUCCESS;
+}
+
+/* long-only options */
+enum {
+	OPT_BROAD_MATCH = 0x100,
+	OPT_SHM,
+	OPT_SOURCE,
+	OPT_HWMON_IO,
+	OPT_FILTER_IFACES,
+	OPT_VALUES_ONLY,
+	OPT_FORMAT,
+	OPT_CHANGES,
+	OPT_DEADBAND,
+	OPT_HISTORY,
+	OPT_HISTORY_SIZE,
+};
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [options] [type]\n"
+		"       %s history [options] TYPE|PATH\n"
+		"options:\n"
+		"  -e, --engine=ENGINE      query engine: sync, async (default), "
+						"bulk\n"
+		"  -j, --max-inflight=N     max outstanding async calls "
+						"(default %u)\n"
+		"      --source=SOURCE      read sensors from: dbus (default), "
+						"or hwmon\n"
+		"                           for temperatures, where possible\n"
+		"      --hwmon-io=METHOD    hwmon reads: io_uring (default, "
+						"if available),\n"
+		"                           or pread\n"
+		"      --filter-ifaces      request only the properties of "
+						"interfaces we use\n"
+		"      --values-only        only fetch and print sensor values, "
+						"not thresholds\n"
+		"      --format=FORMAT      output format: text (default), json "
+						"(an object per\n"
+		"                           scan), jsonl (an object per "
+						"sensor), cbor (binary\n"
+		"                           records, with path IDs), or arrow "
+						"(an Arrow IPC\n"
+		"                           stream, batching scans in watch "
+						"mode); records\n"
+		"                           have a timestamp in ms since the "
+						"epoch\n"
+		"      --digits=N           decimal places for non-integer "
+						"values, in text\n"
+		"                           and JSON (default %u, max %u)\n"
+		"      --changes[=FILE]     only output sensors whose state has "
+						"changed since\n"
+		"                           they were last output; one-shot "
+						"queries keep\n"
+		"                           states in FILE (default %s)\n"
+		"      --deadband=[TYPE:]N[%%]\n"
+		"                           with --changes, ignore value changes "
+						"up to N (or\n"
+		"                           N%% of the last value), for all "
+						"sensors or TYPE\n"
+		"  -c, --cache=FILE         sensor discovery cache "
+						"(default %s)\n"
+		"  -C, --no-cache           don't read or write the cache\n"
+		"  -r, --rescan             ignore the cache, and rediscover "
+						"sensors\n"
+		"  -w, --watch              after the initial scan, print "
+						"sensors as they change\n"
+		"      --broad-match        watch: don't filter signals by "
+						"path and interface\n"
+		"  -d, --daemon             serve queries over a unix socket\n"
+		"  -S, --socket=PATH        daemon socket (default %s)\n"
+		"      --shm[=NAME]         daemon: also publish sensors to "
+						"shared memory\n"
+		"                           (default %s)\n"
+		"      --history[=FILE]     watch, daemon: record every update "
+						"in FILE\n"
+		"                           (default %s)\n"
+		"      --history-size=SIZE  size of the history file, in bytes "
+						"or with a\n"
+		"                           K, M or G suffix (default %uM,\n"
+		"                           %s)\n"
+		"  -D, --direct             query the bus directly, even if "
+						"a daemon is running;\n"
+		"                           implied by -e, -j, --source, "
+						"--hwmon-io and\n"
+		"                           --filter-ifaces\n"
+		"  -s, --stats              print timing statistics to stderr on "
+						"exit\n"
+		"  -h, --help               show this help\n",
+		progname, progname, DEFAULT_MAX_INFLIGHT,
+		FORMAT_DEFAULT_DIGITS, FORMAT_MAX_DIGITS, DEFAULT_CHANGES_PATH,
+		DEFAULT_CACHE_PATH,
+		DEFAULT_SOCKET_PATH, SENSOR_SHM_DEFAULT_NAME,
+		DEFAULT_HISTORY_PATH, HISTORY_DEFAULT_SIZE >> 20,
+		HISTORY_DEFAULT_COVERAGE);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "engine",		required_argument,	NULL, 'e' },
+		{ "max-inflight",	required_argument,	NULL, 'j' },
+		{ "source",		required_argument,	NULL, OPT_SOURCE },
+		{ "hwmon-io",		required_argument,	NULL, OPT_HWMON_IO },
+		{ "filter-ifaces",	no_argument,		NULL, OPT_FILTER_IFACES },
+		{ "values-only",	no_argument,		NULL, OPT_VALUES_ONLY },
+		{ "format",		required_argument,	NULL, OPT_FORMAT },
+		{ "digits",		required_argument,	NULL, OPT_DIGITS },
+		{ "changes",		optional_argument,	NULL, OPT_CHANGES },
+		{ "deadband",		required_argument,	NULL, OPT_DEADBAND },
+		{ "cache",		required_argument,	NULL, 'c' },
+		{ "no-cache",		no_argument,		NULL, 'C' },
+		{ "rescan",		no_argument,		NULL, 'r' },
+		{ "watch",		no_argument,		NULL, 'w' },
+		{ "broad-match",	no_argument,		NULL, OPT_BROAD_MATCH },
+		{ "stats",		no_argument,		NULL, 's' },
+		{ "daemon",		no_argument,		NULL, 'd' },
+		{ "socket",		required_argument,	NULL, 'S' },
+		{ "shm",		optional_argument,	NULL, OPT_SHM },
+		{ "history",		optional_argument,	NULL, OPT_HISTORY },
+		{ "history-size",	required_argument,	NULL, OPT_HISTORY_SIZE },
+		{ "direct",		no_argument,		NULL, 'D' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ 0 },
+	};
+	const struct sensor_desc **sensors;
+	struct sensor_table table = { 0 };
+	struct query_config config;
+	struct print_ctx print = { .config = &config };
+	const char *type, *cache_path, *socket_path, *shm_name, *changes_path;
+	const char *history_path;
+	uint64_t history_size;
+	bool history_size_set;
+	struct change_filter changes = { 0 };
+	bool rescan, watch, daemon, direct, hwmon, hwmon_uring, query_opts;
+	unsigned int i, n;
+	uint64_t start;
 	sd_bus *bus;
+	char *endp;
 	int rc;
 
+	config.engine = ENGINE_ASYNC;
+	config.max_inflight = DEFAULT_MAX_INFLIGHT;
+	config.broad_match = false;
+	config.filter_ifaces = false;
+	config.thresholds = true;
+	config.format = OUTPUT_TEXT;
+	config.digits = FORMAT_DEFAULT_DIGITS;
+	config.stats = false;
+	config.hwmon = NULL;
+	config.history = NULL;
+	hwmon = false;
+	hwmon_uring = true;
+	cache_path = DEFAULT_CACHE_PATH;
+	socket_path = DEFAULT_SOCKET_PATH;
+	shm_name = NULL;
+	changes_path = NULL;
+	history_path = NULL;
+	history_size = HISTORY_DEFAULT_SIZE;
+	history_size_set = false;
+	rescan = false;
+	watch = false;
+	daemon = false;
+	direct = false;
+	query_opts = false;
+
+	if (argc > 1 && !strcmp(argv[1], "history"))
+		return history_main(argv[0], argc - 1, argv + 1);
+
+	for (;;) {
+		rc = getopt_long(argc, argv, "e:j:c:CrwsdS:Dh", options, NULL);
+		if (rc == -1)
+			break;
+
+		/* options saying how to query the bus, which a daemon
+		 * wouldn't honour */
+		if (rc == 'e' || rc == 'j' || rc == OPT_SOURCE ||
+				rc == OPT_HWMON_IO || rc == OPT_FILTER_IFACES)
+			query_opts = true;
+
+		switch (rc) {
+		case 'e':
+			if (!strcmp(optarg, "sync"))
+				config.engine = ENGINE_SYNC;
+			else if (!strcmp(optarg, "async"))
+				config.engine = ENGINE_ASYNC;
+			else if (!strcmp(optarg, "bulk"))
+				config.engine = ENGINE_BULK;
+			else
+				errx(EXIT_FAILURE, "invalid engine '%s'",
+						optarg);
+			break;
+		case 'j':
+			config.max_inflight = strtoul(optarg, &endp, 10);
+			if (*endp || !config.max_inflight)
+				errx(EXIT_FAILURE, "invalid max-inflight '%s'",
+						optarg);
+			break;
+		case OPT_SOURCE:
+			if (!strcmp(optarg, "dbus"))
+				hwmon = false;
+			else if (!strcmp(optarg, "hwmon"))
+				hwmon = true;
+			else
+				errx(EXIT_FAILURE, "invalid source '%s'",
+						optarg);
+			break;
+		case OPT_HWMON_IO:
+			if (!strcmp(optarg, "io_uring"))
+				hwmon_uring = true;
+			else if (!strcmp(optarg, "pread"))
+				hwmon_uring = false;
+			else
+				errx(EXIT_FAILURE, "invalid hwmon-io '%s'",
+						optarg);
+			break;
+		case OPT_FILTER_IFACES:
+			config.filter_ifaces = true;
+			break;
+		case OPT_VALUES_ONLY:
+			config.thresholds = false;
+			break;
+		case OPT_FORMAT:
+			if (!strcmp(optarg, "text"))
+				config.format = OUTPUT_TEXT;
+			else if (!strcmp(optarg, "json"))
+				config.format = OUTPUT_JSON;
+			else if (!strcmp(optarg, "jsonl"))
+				config.format = OUTPUT_JSONL;
+			else if (!strcmp(optarg, "cbor"))
+				config.format = OUTPUT_CBOR;
+			else if (!strcmp(optarg, "arrow"))
+				config.format = OUTPUT_ARROW;
+			else
+				errx(EXIT_FAILURE, "invalid format '%s'",
+						optarg);
+			break;
+		case OPT_DIGITS:
+			if (parse_digits(optarg, &config.digits) < 0)
+				errx(EXIT_FAILURE, "invalid digits '%s'",
+						optarg);
+			break;
+		case 'c':
+			cache_path = optarg;
+			break;
+		case 'C':
+			cache_path = NULL;
+			break;
+		case 'r':
+			rescan = true;
+			break;
+		case 'w':
+			watch = true;
+			break;
+		case OPT_BROAD_MATCH:
+			config.broad_match = true;
+			break;
+		case 's':
+			config.stats = true;
+			break;
+		case 'd':
+			daemon = true;
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'D':
+			direct = true;
+			break;
+		case OPT_SHM:
+			shm_name = optarg ? optarg : SENSOR_SHM_DEFAULT_NAME;
+			break;
+		case OPT_HISTORY:
+			history_path = optarg ? optarg : DEFAULT_HISTORY_PATH;
+			break;
+		case OPT_HISTORY_SIZE:
+			if (parse_size(optarg, &history_size) < 0 ||
+					!history_size)
+				errx(EXIT_FAILURE, "invalid history size '%s'",
+						optarg);
+			history_size_set = true;
+			break;
+		case OPT_CHANGES:
+			changes_path = optarg ? optarg : DEFAULT_CHANGES_PATH;
+			break;
+		case OPT_DEADBAND:
+			rc = change_filter_add_deadband(&changes, optarg);
+			if (rc < 0)
+				errx(EXIT_FAILURE, "invalid deadband '%s'",
+						optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (shm_name && !daemon)
+		errx(EXIT_FAILURE, "--shm requires --daemon");
+
+	if (history_path && !watch && !daemon)
+		errx(EXIT_FAILURE, "--history requires --watch or --daemon");
+	if (history_size_set && !history_path)
+		errx(EXIT_FAILURE, "--history-size requires --history");
+
+	if (changes_path && daemon)
+		errx(EXIT_FAILURE, "--changes can't be used with --daemon");
+	/* the daemon serves clients that print thresholds */
+	if (!config.thresholds && daemon)
+		errx(EXIT_FAILURE, "--values-only can't be used with --daemon");
+	if (changes.n_bands && !changes_path)
+		errx(EXIT_FAILURE, "--deadband requires --changes");
+	if (changes_path)
+		print.changes = &changes;
+
+	if (config.stats) {
+		stats_enabled = true;
+		atexit(stats_report);
+	}
+
 	type = NULL;
-	if (argc > 1)
-		type = argv[1];
+	if (optind < argc)
+		type = argv[optind];
+
+	/* if a daemon is running, it can answer from its live table, and
+	 * we don't need a bus connection at all. It only serves text, at
+	 * the default precision: JSON records carry the time of the
+	 * reading, which it doesn't track, and --changes needs the
+	 * readings themselves. Asking for a way of querying (an engine,
+	 * source, or interface filter) implies --direct: the daemon has
+	 * its own */
+	if (!watch && !daemon && !direct && !query_opts &&
+			config.format == OUTPUT_TEXT &&
+			config.digits == FORMAT_DEFAULT_DIGITS &&
+			!print.changes) {
+		start = stats_start();
+		rc = daemon_query(socket_path, type, config.thresholds);
+		stats_end(STATS_DAEMON_QUERY, start);
+		if (!rc)
+			return EXIT_SUCCESS;
+		if (rc != -ENOTCONN)
+			errx(EXIT_FAILURE, "daemon query failed: %s",
+					strerror(-rc));
+	}
 
+	start = stats_start();
 	rc = sd_bus_default(&bus);
 	if (rc < 0)
 		errx(EXIT_FAILURE, "can't connect to dbus: %s", strerror(-rc));
+	stats_end(STATS_CONNECT, start);
+
+	start = stats_start();
+	load_sensor_table(bus, &table, cache_path, rescan);
+	stats_end(STATS_TABLE, start);
+
+	if (hwmon) {
+		rc = hwmon_source_open(&config.hwmon, HWMON_ROOT,
+				table.descs, table.n_descs, hwmon_uring);
+		if (rc < 0)
+			warnx("can't read hwmon devices: %s", strerror(-rc));
+	}
 
-	for (i = 0; i < ARRAY_SIZE(descs); i++) {
-		const struct sensor_desc *desc = &descs[i];
+	if (history_path) {
+		rc = history_open(&config.history, history_path,
+				history_size);
+		if (rc == -EBUSY)
+			errx(EXIT_FAILURE, "history %s is being recorded by "
+					"another process", history_path);
+		if (rc == -EEXIST)
+			errx(EXIT_FAILURE, "%s isn't a history file",
+					history_path);
+		if (rc < 0)
+			errx(EXIT_FAILURE, "can't open history: %s",
+					strerror(-rc));
+	}
+
+	if (daemon) {
+		rc = daemon_run(bus, &config, &table, socket_path, shm_name);
+		history_close(config.history);
+		if (rc == -EADDRINUSE)
+			errx(EXIT_FAILURE, "another daemon is serving %s",
+					socket_path);
+		if (rc < 0)
+			errx(EXIT_FAILURE, "daemon failed: %s", strerror(-rc));
+		hwmon_source_free(config.hwmon);
+		sensor_table_free(&table);
+		return EXIT_SUCCESS;
+	}
+
+	if (watch) {
+		rc = watch_sensors(bus, &config, &table, type,
+				&watch_print_ops, &print);
+		print_finish(&print);
+		change_filter_free(&changes);
+		history_close(config.history);
+		if (rc < 0)
+			errx(EXIT_FAILURE, "watch failed: %s", strerror(-rc));
+		hwmon_source_free(config.hwmon);
+		sensor_table_free(&table);
+		return EXIT_SUCCESS;
+	}
+
+	sensors = calloc(table.n_descs ? table.n_descs : 1, sizeof(*sensors));
+	if (!sensors)
+		err(EXIT_FAILURE, "calloc");
+
+	for (i = 0, n = 0; i < table.n_descs; i++) {
+		const struct sensor_desc *desc = &table.descs[i];
 
 		if (!sensor_matches_type(desc, type))
 			continue;
 
-		print_sensor(bus, desc);
+		sensors[n++] = desc;
+		if (output_declare(&print.out, config.format, desc) < 0)
+			errx(EXIT_FAILURE, "out of memory for output");
 	}
 
+	/* an unreadable state file only means everything is output */
+	if (print.changes)
+		change_filter_load(&changes, changes_path);
+
+	/* so that an empty scan still gets its JSON object (and, for CBOR,
+	 * the dictionary goes out before it) */
+	if (output_begin_scan(&print.out, config.format) < 0)
+		errx(EXIT_FAILURE, "out of memory for output");
+
+	start = stats_start();
+	rc = query_sensors(bus, &config, sensors, n, print_result, &print);
+	stats_end(STATS_SCAN, start);
+
+	/* the whole scan's output, in one write (and before any stats) */
+	print_finish(&print);
+
+	/* only once it's been written is the output the last state */
+	if (print.changes) {
+		if (change_filter_save(&changes, changes_path) < 0)
+			warnx("can't write state file %s", changes_path);
+		change_filter_free(&changes);
+	}
+
+	if (rc < 0)
+		errx(EXIT_FAILURE, "dbus error: %s", strerror(-rc));
+
+	free(sensors);
+	hwmon_source_free(config.hwmon);
+	sensor_table_free(&table);
+
 	return EXIT_SUCCESS;
 }
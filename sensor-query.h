@@ -0,0 +1,457 @@
+/* Shared definitions for sensor-query */
+
+#ifndef SENSOR_QUERY_H
+#define SENSOR_QUERY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+#define SENSORS_ROOT	"/xyz/openbmc_project/sensors"
+#define VALUE_IFACE	"xyz.openbmc_project.Sensor.Value"
+#define CRIT_IFACE	"xyz.openbmc_project.Sensor.Threshold.Critical"
+#define WARN_IFACE	"xyz.openbmc_project.Sensor.Threshold.Warning"
+
+struct sensor_desc {
+	const char *service;
+	const char *object;
+};
+
+/* A sensor value is kept in its D-Bus wire type: type is 'd' for
+ * value.d, 't' for value.t, and 'x' for value.x, which also holds the
+ * narrower integer types (y, n, q, i, u), widened. scale is the object's
+ * Scale property, a power of ten to apply to the value, or zero if it
+ * has none.
+ */
+/* the largest scale magnitude: 10^18 is the largest power of ten in an
+ * int64_t */
+#define SENSOR_SCALE_MAX	18
+
+struct sensor_data {
+	char	type;
+	int8_t	scale;
+	union {
+		double d;
+		int64_t x;
+		uint64_t t;
+	} value;
+	bool	lower_crit;
+	bool	upper_crit;
+	bool	lower_warn;
+	bool	upper_warn;
+};
+
+/* A service providing sensors, and the unique bus name that owned it
+ * when the table was built (NULL if unowned). sensor_desc.service
+ * pointers refer to the name here.
+ */
+struct sensor_service {
+	const char	*name;
+	const char	*owner;
+};
+
+/* The set of sensors to query: either the compiled-in list, or one built
+ * by discovery. Discovered tables are loaded from a single cache image
+ * (in the on-disk cache format), which descs[] reference directly, and
+ * are kept sorted by object path.
+ */
+struct sensor_table {
+	const struct sensor_desc	*descs;
+	unsigned int			n_descs;
+	struct sensor_service		*services;
+	unsigned int			n_services;
+
+	/* bumped whenever sensor_table_watch() patches descs[]; any
+	 * references into descs[] are invalid after a change */
+	unsigned int			generation;
+	void				(*changed)(struct sensor_table *,
+						void *);
+	void				*changed_data;
+
+	/* backing storage, for discovered tables */
+	struct sensor_desc		*alloc_descs;
+	unsigned int			alloc_size;
+	void				*image;
+	size_t				image_len;
+	char				**strings;
+	unsigned int			n_strings;
+	sd_bus_slot			*slots[3];
+};
+
+/* Number of GetAll calls the async engine will keep outstanding at once.
+ * Large enough to hide the broker and sensor-daemon latency, small
+ * enough not to flood a single-threaded sensor daemon's socket.
+ */
+#define DEFAULT_MAX_INFLIGHT	64
+
+enum engine {
+	ENGINE_SYNC,
+	ENGINE_ASYNC,
+	ENGINE_BULK,
+};
+
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,	/* an object per scan, of an array of records */
+	OUTPUT_JSONL,	/* a record per line */
+	OUTPUT_CBOR,	/* binary records; see cbor.c */
+	OUTPUT_ARROW,	/* an Arrow IPC stream; see arrow.c */
+};
+
+struct hwmon_source;
+struct history_store;
+struct history_point;
+
+struct query_config {
+	enum engine	engine;
+	unsigned int	max_inflight;
+	/* if set, read sensors from hwmon where possible (--source=hwmon) */
+	struct hwmon_source	*hwmon;
+	/* if set, watch and daemon modes record every update (--history) */
+	struct history_store	*history;
+	bool		broad_match;	/* watch: unfiltered subscriptions */
+	/* GetAll only the interfaces we output (--filter-ifaces) */
+	bool		filter_ifaces;
+	/* output threshold states; if not, we only fetch Value
+	 * (--values-only) */
+	bool		thresholds;
+	enum output_format	format;		/* --format */
+	unsigned int	digits;		/* decimal places (--digits) */
+	bool		stats;		/* report statistics on exit */
+};
+
+/* called once per sensor queried, in order; rc is zero on success,
+ * -ENOMSG if the object has no Value, or -EPROTO if the Value isn't a
+ * number (with sensor->type set to the type found) */
+typedef void (*sensor_result_fn)(const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, void *data);
+
+/* parse.c */
+void reset_sensor_data(struct sensor_data *sensor);
+int parse_sensor_props(sd_bus_message *reply, struct sensor_data *sensor,
+		bool *value_set);
+int parse_iface_reply(sd_bus_message *reply, bool value_iface,
+		struct sensor_data *sensor);
+int parse_sensor_reply(sd_bus_message *reply, struct sensor_data *sensor);
+int parse_object_ifaces(sd_bus_message *reply, struct sensor_data *sensor);
+
+/* sensor-query.c */
+int format_sensor_line(char *buf, size_t len, const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, bool thresholds,
+		unsigned int digits);
+bool sensor_matches_type(const struct sensor_desc *desc, const char *type);
+int query_sensors(sd_bus *bus, const struct query_config *config,
+		const struct sensor_desc **sensors, unsigned int n,
+		sensor_result_fn result, void *result_data);
+
+/* format.c */
+
+/* decimal places for double values; we print as many as "%f" */
+#define FORMAT_DEFAULT_DIGITS	6
+#define FORMAT_MAX_DIGITS	9
+/* enough for any value: a sign, the 309 integer digits of DBL_MAX, and
+ * the point and fraction */
+#define FORMAT_VALUE_MAX	(1 + 309 + 1 + FORMAT_MAX_DIGITS + 1)
+
+size_t format_u64(char *buf, uint64_t val);
+size_t format_i64(char *buf, int64_t val);
+size_t format_double(char *buf, double val, unsigned int digits);
+size_t format_sensor_value(char *buf, const struct sensor_data *sensor,
+		unsigned int digits);
+double sensor_value_double(const struct sensor_data *sensor);
+
+/* json.c */
+int format_sensor_json(char *buf, size_t len, const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, bool thresholds,
+		unsigned int digits, uint64_t timestamp_ms);
+int format_removed_json(char *buf, size_t len, const struct sensor_desc *desc,
+		uint64_t timestamp_ms);
+
+/* cbor.c */
+/* every record's size, and the bytes that open and close a scan */
+#define CBOR_RECORD_SIZE	19
+#define CBOR_BEGIN_SCAN		0x9f
+#define CBOR_BREAK		0xff
+
+int format_magic_cbor(char *buf, size_t len);
+int format_paths_cbor(char *buf, size_t len, uint32_t first,
+		char *const *paths, unsigned int n);
+int format_sensor_cbor(char *buf, size_t len, uint32_t id,
+		const struct sensor_data *sensor, int rc);
+int format_removed_cbor(char *buf, size_t len, uint32_t id);
+
+/* arrow.c */
+struct arrow_batch;
+
+/* in watch mode, rows are batched until there are this many, or the
+ * oldest is this old */
+#define ARROW_BATCH_ROWS	65536
+#define ARROW_BATCH_MS		1000
+
+int format_schema_arrow(char *buf, size_t len);
+int format_dictionary_arrow(char *buf, size_t len, uint32_t first,
+		char *const *paths, unsigned int n);
+int format_batch_arrow(char *buf, size_t len,
+		const struct arrow_batch *batch);
+int format_eos_arrow(char *buf, size_t len);
+int arrow_batch_append(struct arrow_batch **batchp, uint32_t id,
+		const struct sensor_data *sensor, int rc,
+		uint64_t timestamp_ms);
+unsigned int arrow_batch_rows(const struct arrow_batch *batch);
+uint64_t arrow_batch_start(const struct arrow_batch *batch);
+void arrow_batch_reset(struct arrow_batch *batch);
+void arrow_batch_free(struct arrow_batch *batch);
+
+/* output.c */
+
+/* Paths, given IDs in the order they were added: for --format=cbor and
+ * arrow, of which the first n_sent have been output, and for --changes */
+struct path_dict {
+	char		**paths;
+	unsigned int	n;
+	unsigned int	alloc;
+	unsigned int	n_sent;
+	/* open addressing, of ID + 1; zero for an empty slot */
+	unsigned int	*slots;
+	unsigned int	n_slots;
+};
+
+struct output_buf {
+	char		*buf;
+	size_t		len;
+	size_t		alloc;
+	/* --format=json and cbor: within a scan's object or array; for
+	 * json, after n_records */
+	bool		scan_open;
+	unsigned int	n_records;
+	/* --format=cbor and arrow: the stream has started */
+	bool		started;
+	struct path_dict	paths;
+	/* --format=arrow: rows not yet written */
+	struct arrow_batch	*batch;
+};
+
+int path_dict_intern(struct path_dict *dict, const char *path);
+void path_dict_free(struct path_dict *dict);
+
+/* in watch mode, flush before the buffer grows beyond this */
+#define OUTPUT_WATERMARK	65536
+
+int output_sensor(struct output_buf *out, const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, bool thresholds,
+		unsigned int digits);
+int output_record(struct output_buf *out, enum output_format format,
+		const struct sensor_desc *desc, struct sensor_data *sensor,
+		int rc, bool thresholds, unsigned int digits);
+int output_removed(struct output_buf *out, enum output_format format,
+		const struct sensor_desc *desc);
+int output_declare(struct output_buf *out, enum output_format format,
+		const struct sensor_desc *desc);
+int output_begin_scan(struct output_buf *out, enum output_format format);
+int output_end_scan(struct output_buf *out, enum output_format format);
+bool output_scan_due(const struct output_buf *out, enum output_format format);
+int output_end_stream(struct output_buf *out, enum output_format format);
+int output_history_point(struct output_buf *out, const char *path,
+		const struct history_point *point, bool bucket,
+		unsigned int digits);
+int output_printf(struct output_buf *out, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int output_flush(struct output_buf *out, int fd);
+void output_free(struct output_buf *out);
+
+/* changes.c */
+struct change_entry;
+struct deadband;
+
+/* --changes: the state last output for each sensor, by path ID */
+struct change_filter {
+	struct path_dict	paths;
+	struct change_entry	*entries;
+	unsigned int		alloc;
+	struct deadband		*bands;
+	unsigned int		n_bands;
+	bool			dirty;	/* since loaded or saved */
+};
+
+int change_filter_add_deadband(struct change_filter *filter,
+		const char *arg);
+int change_filter_check(struct change_filter *filter,
+		const struct sensor_desc *desc,
+		const struct sensor_data *sensor, int rc);
+void change_filter_forget(struct change_filter *filter,
+		const struct sensor_desc *desc);
+int change_filter_load(struct change_filter *filter, const char *path);
+int change_filter_save(struct change_filter *filter, const char *path);
+void change_filter_free(struct change_filter *filter);
+
+/* discovery.c */
+int discover_sensors(sd_bus *bus, struct sensor_table *table);
+int sensor_table_validate(sd_bus *bus, const struct sensor_table *table);
+int sensor_table_watch(sd_bus *bus, struct sensor_table *table,
+		void (*changed)(struct sensor_table *, void *), void *data);
+int sensor_cache_load(const char *path, struct sensor_table *table);
+int sensor_cache_save(const char *path, const struct sensor_table *table);
+int read_whole_file(const char *path, void **datap, size_t *lenp);
+int write_file_atomic(const char *path, const void *data, size_t len);
+void sensor_table_free(struct sensor_table *table);
+
+/* hwmon.c */
+int hwmon_source_open(struct hwmon_source **src, const char *root,
+		const struct sensor_desc *descs, unsigned int n_descs,
+		bool use_uring);
+void hwmon_source_free(struct hwmon_source *src);
+int hwmon_query_sensors(sd_bus *bus, const struct query_config *config,
+		const struct sensor_desc **sensors, unsigned int n,
+		sensor_result_fn result, void *result_data);
+
+/* uring.c */
+struct uring;
+
+int uring_open(struct uring **ring, unsigned int n_reads, const int *fds,
+		unsigned int n_fds, void *buf, size_t buf_len);
+void uring_close(struct uring *ring);
+int uring_queue_read(struct uring *ring, unsigned int file_idx, void *buf,
+		unsigned int len, uint64_t data);
+int uring_submit_wait(struct uring *ring,
+		void (*complete)(uint64_t data, int res, void *arg), void *arg);
+unsigned long uring_syscalls(const struct uring *ring);
+
+/* watch.c */
+
+/* watched sensors take a copy of the table's sensor_desc: the table's
+ * strings are stable, but descs[] may be reallocated by patching.
+ */
+struct watch_sensor {
+	struct sensor_desc	desc;
+	struct sensor_data	data;
+	bool			valid;
+};
+
+struct watch_ctx;
+
+struct watch_ops {
+	/* called once the event loop is set up, to add event sources */
+	int	(*setup)(struct watch_ctx *ctx, sd_event *event, void *data);
+	/* a sensor's state has been read (in the initial scan, or when it
+	 * appears) or has changed */
+	void	(*updated)(struct watch_ctx *ctx,
+			const struct watch_sensor *sensor, void *data);
+	/* a sensor has disappeared from the table */
+	void	(*removed)(struct watch_ctx *ctx,
+			const struct sensor_desc *desc, void *data);
+	/* the set of watched sensors has been built (before the initial
+	 * scan), or has changed, after any removals; previous
+	 * watch_get_sensors() results are invalid */
+	void	(*changed)(struct watch_ctx *ctx, void *data);
+	/* all pending events have been processed, after the initial scan
+	 * and on each event loop iteration: a point to flush output */
+	void	(*flush)(struct watch_ctx *ctx, void *data);
+};
+
+int watch_sensors(sd_bus *bus, const struct query_config *config,
+		struct sensor_table *table, const char *type,
+		const struct watch_ops *ops, void *ops_data);
+/* current sensor states, sorted by object path */
+const struct watch_sensor *watch_get_sensors(struct watch_ctx *ctx,
+		unsigned int *n);
+
+/* daemon.c */
+int daemon_run(sd_bus *bus, const struct query_config *config,
+		struct sensor_table *table, const char *socket_path,
+		const char *shm_name);
+/* returns -ENOTCONN if no daemon is available */
+int daemon_query(const char *socket_path, const char *type,
+		bool thresholds);
+
+/* stats.c */
+enum stats_phase {
+	STATS_CONNECT,
+	STATS_TABLE,		/* cache load and validation, or discovery */
+	STATS_SCAN,		/* one full query_sensors() */
+	STATS_CALL,		/* a method call round-trip */
+	STATS_HWMON_SCAN,	/* reading all hwmon attributes for a scan */
+	STATS_PARSE,		/* parsing one property dictionary */
+	STATS_FORMAT,
+	STATS_OUTPUT,		/* a write() of buffered output */
+	STATS_DAEMON_QUERY,	/* a client query to the daemon */
+	N_STATS_PHASES,
+};
+
+extern bool stats_enabled;
+
+uint64_t stats_clock(void);
+void stats_record(enum stats_phase phase, uint64_t start);
+void stats_record_call(const char *service, uint64_t start, int rc);
+void stats_record_output(size_t bytes);
+void stats_record_hwmon_scan(const char *backend, unsigned long syscalls);
+void stats_report(void);
+
+/* Instrumentation points, for the hot paths. A zero start time means
+ * stats are disabled, so each point costs a single test when they're
+ * off.
+ */
+static inline uint64_t stats_start(void)
+{
+	return stats_enabled ? stats_clock() : 0;
+}
+
+static inline void stats_end(enum stats_phase phase, uint64_t start)
+{
+	if (start)
+		stats_record(phase, start);
+}
+
+static inline void stats_end_call(const char *service, uint64_t start,
+		int rc)
+{
+	if (start)
+		stats_record_call(service, start, rc);
+}
+
+/* shm.c */
+struct shm_publisher;
+int shm_publisher_open(struct shm_publisher **pub, const char *name);
+int shm_publisher_layout(struct shm_publisher *pub,
+		const struct watch_sensor *sensors, unsigned int n);
+void shm_publisher_update(struct shm_publisher *pub, unsigned int idx,
+		const struct watch_sensor *sensor);
+void shm_publisher_close(struct shm_publisher *pub);
+
+/* history.c */
+/* enough for about 2 hours of 300 sensors updating once a second: in
+ * bench-history, 1.7 hours of dbus-sensors' doubles, and 2.3 hours of
+ * phosphor-hwmon's integers */
+#define HISTORY_DEFAULT_SIZE	(8 << 20)
+#define HISTORY_DEFAULT_COVERAGE	"about 2 hours of 300 sensors at 1 Hz"
+
+/* a sample; or, when a query has a bucket size, the samples in a bucket,
+ * starting at t, of which count have a value */
+struct history_point {
+	uint64_t	t;		/* ms since the epoch */
+	double		min;
+	double		avg;
+	double		max;
+	unsigned long	count;
+};
+
+typedef void (*history_point_fn)(const char *path,
+		const struct history_point *point, void *data);
+
+int history_open(struct history_store **store, const char *path,
+		uint64_t size);
+int history_layout(struct history_store *store,
+		const struct watch_sensor *sensors, unsigned int n);
+void history_record(struct history_store *store, unsigned int idx,
+		const struct watch_sensor *sensor, uint64_t t);
+void history_report(const struct history_store *store);
+void history_close(struct history_store *store);
+int history_query(const char *file, const char *match, uint64_t since,
+		uint64_t until, uint64_t bucket, history_point_fn fn,
+		void *data);
+
+#endif /* SENSOR_QUERY_H */
@@ -0,0 +1,331 @@
+/* Reader interface for the sensor-query shared-memory snapshot table.
+ *
+ * `sensor-query --daemon --shm` publishes the current state of every
+ * sensor into a POSIX shared memory object (default "/sensor-query"),
+ * laid out as a header followed by a fixed-stride array of slots,
+ * sorted by object path. Once mapped, readers get consistent values
+ * without locks, syscalls or allocation:
+ *
+ *  - each slot has its own sequence counter, which the publisher makes
+ *    odd while it updates the slot; and
+ *  - the header has a layout sequence counter, which is odd while the
+ *    set of sensors (and so the slot for each path) is changing.
+ *
+ * Typical use:
+ *
+ *	struct sensor_shm shm;
+ *	struct sensor_shm_reading r;
+ *	uint32_t layout;
+ *	int idx;
+ *
+ *	sensor_shm_open(&shm, NULL);
+ *	idx = sensor_shm_find(&shm, "/xyz/openbmc_project/sensors/...",
+ *			&layout);
+ *	...
+ *	if (sensor_shm_read(&shm, idx, &r) == 0 && r.layout == layout)
+ *		use(r.value.d);
+ *	else
+ *		look the sensor up again (or reopen, on -ESTALE)
+ *
+ * This header is self-contained, and doesn't depend on the rest of
+ * sensor-query.
+ */
+
+#ifndef SENSOR_SHM_H
+#define SENSOR_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SENSOR_SHM_DEFAULT_NAME	"/sensor-query"
+#define SENSOR_SHM_MAGIC	0x314d5153	/* "SQM1" */
+#define SENSOR_SHM_VERSION	1
+#define SENSOR_SHM_PATH_MAX	240
+
+/* slot flags */
+#define SENSOR_SHM_LOWER_CRIT	0x01
+#define SENSOR_SHM_UPPER_CRIT	0x02
+#define SENSOR_SHM_LOWER_WARN	0x04
+#define SENSOR_SHM_UPPER_WARN	0x08
+
+/* attempts at a consistent read before giving up with -EAGAIN */
+#define SENSOR_SHM_RETRIES	1000
+
+struct sensor_shm_header {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	slot_size;
+	uint32_t	capacity;
+	uint32_t	n_slots;
+	uint32_t	layout_seq;
+	/* nonzero once the publisher has replaced (or removed) this
+	 * object; readers should close and reopen */
+	uint32_t	stale;
+	/* incremented on every change, for cheap polling */
+	uint64_t	update_seq;
+	uint8_t		reserved[32];
+};
+
+struct sensor_shm_slot {
+	uint32_t	seq;
+	char		type;	/* 'd', 'x', or 0 if there's no valid value */
+	uint8_t		flags;
+	uint16_t	path_len;
+	union {
+		double	d;
+		int64_t	x;
+	} value;
+	char		path[SENSOR_SHM_PATH_MAX];
+};
+
+struct sensor_shm {
+	const struct sensor_shm_header	*hdr;
+	const struct sensor_shm_slot	*slots;
+	size_t				len;
+};
+
+struct sensor_shm_reading {
+	uint32_t	layout;		/* the layout_seq this was read under */
+	char		type;
+	uint8_t		flags;
+	union {
+		double	d;
+		int64_t	x;
+	} value;
+};
+
+static inline int sensor_shm_open(struct sensor_shm *shm, const char *name)
+{
+	const struct sensor_shm_header *hdr;
+	struct stat statbuf;
+	void *map;
+	int fd;
+
+	shm->hdr = NULL;
+	shm->slots = NULL;
+	shm->len = 0;
+
+	fd = shm_open(name ? name : SENSOR_SHM_DEFAULT_NAME,
+			O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &statbuf)) {
+		close(fd);
+		return -errno;
+	}
+
+	/* the publisher may still be setting up the object */
+	if ((size_t)statbuf.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EAGAIN;
+	}
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SENSOR_SHM_MAGIC
+			|| hdr->version != SENSOR_SHM_VERSION
+			|| hdr->slot_size != sizeof(struct sensor_shm_slot)
+			|| sizeof(*hdr) + (size_t)hdr->capacity *
+				hdr->slot_size > (size_t)statbuf.st_size) {
+		munmap(map, statbuf.st_size);
+		return -EPROTO;
+	}
+
+	shm->hdr = hdr;
+	shm->slots = (const struct sensor_shm_slot *)(hdr + 1);
+	shm->len = statbuf.st_size;
+	return 0;
+}
+
+static inline void sensor_shm_close(struct sensor_shm *shm)
+{
+	munmap((void *)shm->hdr, shm->len);
+	shm->hdr = NULL;
+	shm->slots = NULL;
+}
+
+static inline uint64_t sensor_shm_updates(const struct sensor_shm *shm)
+{
+	return __atomic_load_n(&shm->hdr->update_seq, __ATOMIC_ACQUIRE);
+}
+
+/* read the layout sequence, waiting out any layout change in progress */
+static inline int sensor_shm_layout_begin(const struct sensor_shm *shm,
+		uint32_t *layout)
+{
+	unsigned int i;
+
+	*layout = 0;
+
+	for (i = 0; i < SENSOR_SHM_RETRIES; i++) {
+		if (__atomic_load_n(&shm->hdr->stale, __ATOMIC_ACQUIRE))
+			return -ESTALE;
+		*layout = __atomic_load_n(&shm->hdr->layout_seq,
+				__ATOMIC_ACQUIRE);
+		if (!(*layout & 1))
+			return 0;
+	}
+
+	return -EAGAIN;
+}
+
+static inline int sensor_shm_layout_end(const struct sensor_shm *shm,
+		uint32_t layout)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&shm->hdr->layout_seq, __ATOMIC_RELAXED)
+		== layout;
+}
+
+static inline int sensor_shm_read_slot(const struct sensor_shm_slot *slot,
+		struct sensor_shm_reading *r)
+{
+	uint32_t seq;
+	unsigned int i;
+
+	for (i = 0; i < SENSOR_SHM_RETRIES; i++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		r->type = slot->type;
+		r->flags = slot->flags;
+		memcpy(&r->value, &slot->value, sizeof(r->value));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+
+	return -EAGAIN;
+}
+
+/* Find the slot for an object path; returns the slot index, -ENOENT, or
+ * a negative error. The index stays valid for as long as the layout
+ * sequence (returned in *layout) is unchanged.
+ */
+static inline int sensor_shm_find(const struct sensor_shm *shm,
+		const char *path, uint32_t *layout)
+{
+	unsigned int i, lo, hi, mid;
+	size_t len;
+	int rc, cmp;
+
+	len = strlen(path);
+
+	for (i = 0; i < SENSOR_SHM_RETRIES; i++) {
+		rc = sensor_shm_layout_begin(shm, layout);
+		if (rc)
+			return rc;
+
+		lo = 0;
+		hi = __atomic_load_n(&shm->hdr->n_slots, __ATOMIC_RELAXED);
+		if (hi > shm->hdr->capacity)
+			hi = 0;
+		rc = -ENOENT;
+
+		while (lo < hi) {
+			const struct sensor_shm_slot *slot;
+			size_t slot_len;
+
+			mid = lo + (hi - lo) / 2;
+			slot = &shm->slots[mid];
+			slot_len = slot->path_len;
+			if (slot_len > SENSOR_SHM_PATH_MAX)
+				break;
+
+			cmp = memcmp(path, slot->path,
+					len < slot_len ? len : slot_len);
+			if (!cmp)
+				cmp = (len > slot_len) - (len < slot_len);
+
+			if (!cmp) {
+				rc = mid;
+				break;
+			}
+			if (cmp < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+
+		if (sensor_shm_layout_end(shm, *layout))
+			return rc;
+	}
+
+	return -EAGAIN;
+}
+
+/* Read one slot; compare r->layout against the layout returned by
+ * sensor_shm_find() to check the slot still holds the same sensor.
+ */
+static inline int sensor_shm_read(const struct sensor_shm *shm,
+		unsigned int idx, struct sensor_shm_reading *r)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < SENSOR_SHM_RETRIES; i++) {
+		rc = sensor_shm_layout_begin(shm, &r->layout);
+		if (rc)
+			return rc;
+
+		if (idx >= __atomic_load_n(&shm->hdr->n_slots,
+					__ATOMIC_RELAXED))
+			rc = -ERANGE;
+		else
+			rc = sensor_shm_read_slot(&shm->slots[idx], r);
+
+		if (sensor_shm_layout_end(shm, r->layout))
+			return rc;
+	}
+
+	return -EAGAIN;
+}
+
+/* Read every slot, under a single layout: readings[i] corresponds to
+ * slot i. Returns the number of slots read (which may exceed max, in
+ * which case only the first max are filled), or a negative error.
+ */
+static inline int sensor_shm_snapshot(const struct sensor_shm *shm,
+		struct sensor_shm_reading *readings, unsigned int max)
+{
+	unsigned int i, j, n;
+	uint32_t layout;
+	int rc;
+
+	for (i = 0; i < SENSOR_SHM_RETRIES; i++) {
+		rc = sensor_shm_layout_begin(shm, &layout);
+		if (rc)
+			return rc;
+
+		n = __atomic_load_n(&shm->hdr->n_slots, __ATOMIC_RELAXED);
+		if (n > shm->hdr->capacity)
+			n = 0;
+
+		for (j = 0; j < n && j < max; j++) {
+			rc = sensor_shm_read_slot(&shm->slots[j],
+					&readings[j]);
+			if (rc)
+				break;
+			readings[j].layout = layout;
+		}
+
+		if (sensor_shm_layout_end(shm, layout))
+			return rc ? rc : (int)n;
+	}
+
+	return -EAGAIN;
+}
+
+#endif /* SENSOR_SHM_H */
@@ -0,0 +1,246 @@
+/* Shared-memory snapshot publisher, for the daemon: mirrors the watched
+ * sensor state into a POSIX shared memory object, for local readers that
+ * can't afford a socket round-trip per query. The layout and the reader
+ * side are in sensor-shm.h.
+ *
+ * We are the only writer, so the sequence counters only need to order
+ * our stores for readers; no atomic read-modify-write is needed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sensor-query.h"
+#include "sensor-shm.h"
+
+#define MIN_CAPACITY	64
+
+struct shm_publisher {
+	char				*name;
+	struct sensor_shm_header	*hdr;
+	struct sensor_shm_slot		*slots;
+	size_t				len;
+
+	/* slot index for each watched sensor, or -1 if its path doesn't
+	 * fit in a slot */
+	int				*slot_map;
+	unsigned int			n_map;
+};
+
+static void seq_begin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_end(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static void publish_bump(struct shm_publisher *pub)
+{
+	__atomic_store_n(&pub->hdr->update_seq, pub->hdr->update_seq + 1,
+			__ATOMIC_RELEASE);
+}
+
+/* Readers only see 'd' and 'x' values, so unscaled integers that fit
+ * go out as 'x', and anything else is converted to a double.
+ */
+static void slot_set(struct sensor_shm_slot *slot,
+		const struct watch_sensor *ws)
+{
+	const struct sensor_data *data = &ws->data;
+
+	if (!ws->valid) {
+		slot->type = 0;
+	} else if (data->type == 'd' || data->scale ||
+			(data->type == 't' && data->value.t > INT64_MAX)) {
+		slot->type = 'd';
+		slot->value.d = sensor_value_double(data);
+	} else {
+		slot->type = 'x';
+		slot->value.x = data->value.x;
+	}
+
+	slot->flags = (ws->data.lower_crit ? SENSOR_SHM_LOWER_CRIT : 0) |
+		(ws->data.upper_crit ? SENSOR_SHM_UPPER_CRIT : 0) |
+		(ws->data.lower_warn ? SENSOR_SHM_LOWER_WARN : 0) |
+		(ws->data.upper_warn ? SENSOR_SHM_UPPER_WARN : 0);
+}
+
+/* Mark the current object as replaced, and unmap it. Readers holding a
+ * mapping see the stale flag, and reopen. */
+static void shm_retire(struct shm_publisher *pub)
+{
+	if (!pub->hdr)
+		return;
+
+	__atomic_store_n(&pub->hdr->stale, 1, __ATOMIC_RELEASE);
+	munmap(pub->hdr, pub->len);
+	shm_unlink(pub->name);
+	pub->hdr = NULL;
+	pub->slots = NULL;
+}
+
+/* Create a new object with room for capacity slots, replacing any
+ * existing one. The magic number is written last, so readers never
+ * accept a partially initialised header.
+ */
+static int shm_create(struct shm_publisher *pub, unsigned int capacity)
+{
+	struct sensor_shm_header *hdr;
+	size_t len;
+	void *map;
+	int fd;
+
+	shm_retire(pub);
+
+	/* also removes a leftover object from a previous instance */
+	shm_unlink(pub->name);
+
+	fd = shm_open(pub->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	len = sizeof(*hdr) + (size_t)capacity * sizeof(struct sensor_shm_slot);
+
+	if (ftruncate(fd, len)) {
+		close(fd);
+		shm_unlink(pub->name);
+		return -errno;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(pub->name);
+		return -errno;
+	}
+
+	/* ftruncate gives us zeroed memory */
+	hdr = map;
+	hdr->version = SENSOR_SHM_VERSION;
+	hdr->slot_size = sizeof(struct sensor_shm_slot);
+	hdr->capacity = capacity;
+	__atomic_store_n(&hdr->magic, SENSOR_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	pub->hdr = hdr;
+	pub->slots = (struct sensor_shm_slot *)(hdr + 1);
+	pub->len = len;
+	return 0;
+}
+
+int shm_publisher_open(struct shm_publisher **pubp, const char *name)
+{
+	struct shm_publisher *pub;
+
+	pub = calloc(1, sizeof(*pub));
+	if (!pub)
+		return -ENOMEM;
+
+	pub->name = strdup(name ? name : SENSOR_SHM_DEFAULT_NAME);
+	if (!pub->name) {
+		free(pub);
+		return -ENOMEM;
+	}
+
+	*pubp = pub;
+	return 0;
+}
+
+/* Lay out slots for a new set of sensors (sorted by path, as the watch
+ * core keeps them), and publish their current state.
+ */
+int shm_publisher_layout(struct shm_publisher *pub,
+		const struct watch_sensor *sensors, unsigned int n)
+{
+	struct sensor_shm_slot *slot;
+	unsigned int i, n_slots, capacity;
+	size_t path_len;
+	int *map, rc;
+
+	map = realloc(pub->slot_map, (n ? n : 1) * sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+	pub->slot_map = map;
+	pub->n_map = n;
+
+	for (i = 0, n_slots = 0; i < n; i++) {
+		if (strlen(sensors[i].desc.object) > SENSOR_SHM_PATH_MAX) {
+			fprintf(stderr, "shm: path too long, not published: "
+					"%s\n", sensors[i].desc.object);
+			map[i] = -1;
+			continue;
+		}
+		map[i] = n_slots++;
+	}
+
+	if (!pub->hdr || n_slots > pub->hdr->capacity) {
+		capacity = MIN_CAPACITY;
+		while (capacity < n_slots)
+			capacity *= 2;
+
+		rc = shm_create(pub, capacity);
+		if (rc < 0) {
+			pub->n_map = 0;
+			return rc;
+		}
+	}
+
+	seq_begin(&pub->hdr->layout_seq);
+
+	for (i = 0; i < n; i++) {
+		if (map[i] < 0)
+			continue;
+
+		slot = &pub->slots[map[i]];
+		path_len = strlen(sensors[i].desc.object);
+
+		seq_begin(&slot->seq);
+		memset(slot->path, 0, sizeof(slot->path));
+		memcpy(slot->path, sensors[i].desc.object, path_len);
+		slot->path_len = path_len;
+		slot_set(slot, &sensors[i]);
+		seq_end(&slot->seq);
+	}
+
+	__atomic_store_n(&pub->hdr->n_slots, n_slots, __ATOMIC_RELAXED);
+	seq_end(&pub->hdr->layout_seq);
+	publish_bump(pub);
+
+	return 0;
+}
+
+/* Publish the state of sensor idx, in the last layout */
+void shm_publisher_update(struct shm_publisher *pub, unsigned int idx,
+		const struct watch_sensor *ws)
+{
+	struct sensor_shm_slot *slot;
+
+	if (!pub->hdr || idx >= pub->n_map || pub->slot_map[idx] < 0)
+		return;
+
+	slot = &pub->slots[pub->slot_map[idx]];
+
+	seq_begin(&slot->seq);
+	slot_set(slot, ws);
+	seq_end(&slot->seq);
+	publish_bump(pub);
+}
+
+void shm_publisher_close(struct shm_publisher *pub)
+{
+	if (!pub)
+		return;
+
+	shm_retire(pub);
+	free(pub->slot_map);
+	free(pub->name);
+	free(pub);
+}
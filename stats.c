@@ -0,0 +1,224 @@
+/* Latency statistics, for --stats: per-phase and per-service histograms
+ * of CLOCK_MONOTONIC durations, reported on exit.
+ *
+ * Histograms are log-bucketed: bucket n counts durations of n
+ * significant bits (in ns), so [2^(n-1), 2^n). That's coarse, but makes
+ * recording cheap and needs no allocation; percentiles are interpolated
+ * within a bucket.
+ *
+ * When stats are disabled, the instrumentation points in the hot paths
+ * reduce to a test of stats_enabled (see stats_start() and stats_end()).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensor-query.h"
+
+#define N_BUCKETS	64
+
+struct histogram {
+	unsigned long	buckets[N_BUCKETS];
+	unsigned long	count;
+	uint64_t	max;
+};
+
+struct service_stats {
+	const char		*name;
+	struct histogram	calls;
+	unsigned long		errors;
+};
+
+static const char * const phase_names[] = {
+	[STATS_CONNECT]		= "connect",
+	[STATS_TABLE]		= "load table",
+	[STATS_SCAN]		= "scan",
+	[STATS_CALL]		= "method call",
+	[STATS_HWMON_SCAN]	= "hwmon scan",
+	[STATS_PARSE]		= "parse",
+	[STATS_FORMAT]		= "format",
+	[STATS_OUTPUT]		= "output",
+	[STATS_DAEMON_QUERY]	= "daemon query",
+};
+
+bool stats_enabled;
+
+static struct histogram phases[N_STATS_PHASES];
+static struct service_stats *services;
+static unsigned int n_services;
+static unsigned long n_calls;
+static unsigned long n_output_writes;
+static unsigned long long n_output_bytes;
+static const char *hwmon_backend;
+static unsigned long n_hwmon_scans;
+static unsigned long n_hwmon_syscalls;
+
+uint64_t stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void histogram_add(struct histogram *hist, uint64_t ns)
+{
+	unsigned int bucket;
+
+	bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= N_BUCKETS)
+		bucket = N_BUCKETS - 1;
+
+	hist->buckets[bucket]++;
+	hist->count++;
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+/* estimate the p'th percentile, interpolating linearly within the
+ * bucket (whose upper bound is capped at the maximum seen) */
+static double histogram_percentile(const struct histogram *hist, double p)
+{
+	unsigned long target, seen;
+	double lo, hi, est;
+	unsigned int i;
+
+	if (!hist->count)
+		return 0;
+
+	target = (unsigned long)(hist->count * p / 100.0);
+	if (target >= hist->count)
+		target = hist->count - 1;
+
+	for (i = 0, seen = 0; i < N_BUCKETS; i++) {
+		if (seen + hist->buckets[i] > target)
+			break;
+		seen += hist->buckets[i];
+	}
+
+	lo = i ? (double)(1ull << (i - 1)) : 0;
+	hi = i ? lo * 2 : 1;
+	if (hi > (double)hist->max)
+		hi = hist->max;
+	est = lo + (hi - lo) * (target - seen + 1) / hist->buckets[i];
+
+	return est;
+}
+
+static struct service_stats *service_stats(const char *name)
+{
+	struct service_stats *tmp;
+	unsigned int i;
+
+	/* there are only ever a handful of services */
+	for (i = 0; i < n_services; i++)
+		if (services[i].name == name ||
+				!strcmp(services[i].name, name))
+			return &services[i];
+
+	tmp = realloc(services, (n_services + 1) * sizeof(*services));
+	if (!tmp)
+		return NULL;
+	services = tmp;
+
+	memset(&services[n_services], 0, sizeof(*services));
+	services[n_services].name = strdup(name);
+	if (!services[n_services].name)
+		return NULL;
+
+	return &services[n_services++];
+}
+
+void stats_record(enum stats_phase phase, uint64_t start)
+{
+	histogram_add(&phases[phase], stats_clock() - start);
+}
+
+/* a method call to service has completed (with rc < 0 on error) */
+void stats_record_call(const char *service, uint64_t start, int rc)
+{
+	struct service_stats *svc;
+	uint64_t ns;
+
+	ns = stats_clock() - start;
+	histogram_add(&phases[STATS_CALL], ns);
+	n_calls++;
+
+	svc = service_stats(service ? service : "(unknown)");
+	if (!svc)
+		return;
+
+	histogram_add(&svc->calls, ns);
+	if (rc < 0)
+		svc->errors++;
+}
+
+/* a write() of buffered output has completed */
+void stats_record_output(size_t bytes)
+{
+	n_output_writes++;
+	n_output_bytes += bytes;
+}
+
+/* an hwmon scan has read its attributes, with the given number of
+ * syscalls */
+void stats_record_hwmon_scan(const char *backend, unsigned long syscalls)
+{
+	hwmon_backend = backend;
+	n_hwmon_scans++;
+	n_hwmon_syscalls += syscalls;
+}
+
+static void print_histogram(const char *name, const struct histogram *hist,
+		unsigned long errors, bool show_errors)
+{
+	char errors_str[16] = "";
+
+	if (show_errors)
+		snprintf(errors_str, sizeof(errors_str), "%lu", errors);
+
+	fprintf(stderr, "  %-36s %8lu %6s %10.1f %10.1f %10.1f %10.1f\n",
+			name, hist->count, errors_str,
+			histogram_percentile(hist, 50) / 1000,
+			histogram_percentile(hist, 90) / 1000,
+			histogram_percentile(hist, 99) / 1000,
+			hist->max / 1000.0);
+}
+
+void stats_report(void)
+{
+	unsigned int i;
+
+	fprintf(stderr, "  %-36s %8s %6s %10s %10s %10s %10s\n",
+			"phase", "count", "", "p50 (us)", "p90", "p99", "max");
+
+	for (i = 0; i < N_STATS_PHASES; i++) {
+		if (!phases[i].count)
+			continue;
+		print_histogram(phase_names[i], &phases[i], 0, false);
+	}
+
+	if (n_services)
+		fprintf(stderr, "  %-36s %8s %6s\n",
+				"method calls by service", "calls", "errors");
+
+	for (i = 0; i < n_services; i++)
+		print_histogram(services[i].name, &services[i].calls,
+				services[i].errors, true);
+
+	fprintf(stderr, "  %lu method calls; %lu writes, %llu bytes output\n",
+			n_calls, n_output_writes, n_output_bytes);
+
+	if (n_hwmon_scans)
+		fprintf(stderr, "  hwmon (%s): %lu scans, %.1f syscalls "
+				"per scan\n", hwmon_backend, n_hwmon_scans,
+				(double)n_hwmon_syscalls / n_hwmon_scans);
+
+	for (i = 0; i < n_services; i++)
+		free((char *)services[i].name);
+	free(services);
+	services = NULL;
+	n_services = 0;
+}
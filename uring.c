@@ -0,0 +1,301 @@
+/* Minimal io_uring, for batched reads of many small files: enough to
+ * submit a set of fixed-buffer reads on registered files, and reap
+ * their completions, in a single io_uring_enter() per batch. We use the
+ * raw syscalls rather than liburing, to avoid the dependency.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "sensor-query.h"
+
+#define URING_MAX_ENTRIES	4096
+
+struct uring {
+	int			fd;
+
+	/* submission queue */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		sq_entries;
+	unsigned int		n_queued;
+
+	/* completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_len;
+	void			*cq_ring;
+	size_t			cq_ring_len;
+	size_t			sqes_len;
+
+	unsigned long		n_syscalls;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode,
+		const void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_map(struct uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_len = p->sq_off.array +
+		p->sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_len > ring->sq_ring_len)
+			ring->sq_ring_len = ring->cq_ring_len;
+		ring->cq_ring_len = ring->sq_ring_len;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			return -errno;
+		}
+	}
+
+	ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -errno;
+	}
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ring +
+			p->sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring +
+			p->sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring +
+			p->sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring +
+			p->sq_off.array);
+	ring->sq_entries = p->sq_entries;
+
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring +
+			p->cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring +
+			p->cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring +
+			p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+			p->cq_off.cqes);
+
+	return 0;
+}
+
+/* Set up a ring with room for n_reads reads per batch (capped), with
+ * fds[] registered as fixed files, and buf as the single fixed buffer
+ * that all reads go to.
+ */
+int uring_open(struct uring **ringp, unsigned int n_reads,
+		const int *fds, unsigned int n_fds, void *buf, size_t buf_len)
+{
+	struct io_uring_params params;
+	struct uring *ring;
+	struct iovec iov;
+	unsigned int entries;
+	int rc;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	for (entries = 1; entries < n_reads && entries < URING_MAX_ENTRIES;)
+		entries *= 2;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = sys_io_uring_setup(entries, &params);
+	if (ring->fd < 0) {
+		rc = -errno;
+		free(ring);
+		return rc;
+	}
+
+	rc = uring_map(ring, &params);
+	if (rc)
+		goto err;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES,
+				fds, n_fds)) {
+		rc = -errno;
+		goto err;
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = buf_len;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+				&iov, 1)) {
+		rc = -errno;
+		goto err;
+	}
+
+	*ringp = ring;
+	return 0;
+
+err:
+	uring_close(ring);
+	return rc;
+}
+
+void uring_close(struct uring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	free(ring);
+}
+
+/* Queue a read of file index file_idx, at offset 0, into buf (within the
+ * registered buffer). Returns -EBUSY if the submission queue is full;
+ * call uring_submit_wait() to drain it.
+ */
+int uring_queue_read(struct uring *ring, unsigned int file_idx, void *buf,
+		unsigned int len, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	if (ring->n_queued == ring->sq_entries)
+		return -EBUSY;
+
+	/* we're the only submitter, and the ring is empty between
+	 * batches, so the tail only needs a plain read */
+	tail = *ring->sq_tail + ring->n_queued;
+	idx = tail & *ring->sq_mask;
+
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = file_idx;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = 0;
+	sqe->buf_index = 0;
+	sqe->user_data = data;
+
+	ring->sq_array[idx] = idx;
+	ring->n_queued++;
+
+	return 0;
+}
+
+/* Submit everything queued, wait for all of it to complete, and pass
+ * each completion to complete().
+ *
+ * An enter may submit fewer entries than asked for (the kernel then
+ * returns without waiting), so we keep submitting the remainder. If a
+ * submit fails outright, whatever is left is dropped from the queue and
+ * never completes; we still wait for everything in flight before
+ * returning the error, so no read lands in a buffer after we return.
+ */
+int uring_submit_wait(struct uring *ring,
+		void (*complete)(uint64_t data, int res, void *arg), void *arg)
+{
+	unsigned int head, tail, n, n_submitted, n_done, to_submit;
+	int rc, err;
+
+	n = ring->n_queued;
+	if (!n)
+		return 0;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+	ring->n_queued = 0;
+
+	err = 0;
+	n_submitted = 0;
+	n_done = 0;
+
+	while (n_done < n_submitted || (!err && n_submitted < n)) {
+		to_submit = err ? 0 : n - n_submitted;
+		rc = sys_io_uring_enter(ring->fd, to_submit,
+				n_submitted + to_submit - n_done,
+				IORING_ENTER_GETEVENTS);
+		ring->n_syscalls++;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			/* failing to wait leaves us nothing to drain
+			 * with */
+			if (!to_submit)
+				return -errno;
+
+			/* nothing was submitted: unqueue the rest */
+			err = -errno;
+			__atomic_store_n(ring->sq_tail,
+					*ring->sq_tail - to_submit,
+					__ATOMIC_RELEASE);
+			continue;
+		}
+		n_submitted += rc;
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++, n_done++) {
+			struct io_uring_cqe *cqe;
+
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			complete(cqe->user_data, cqe->res, arg);
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return err;
+}
+
+unsigned long uring_syscalls(const struct uring *ring)
+{
+	return ring->n_syscalls;
+}
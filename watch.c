@@ -0,0 +1,567 @@
+/* Watch core, for the long-running modes: after an initial scan, keep
+ * sensor state up to date from PropertiesChanged signals, and notify the
+ * user (watch mode printing, or the daemon) of each sensor that changes.
+ * This replaces re-running a full scan periodically, so steady-state
+ * bus traffic scales with the rate of change, not the number of sensors.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "sensor-query.h"
+
+/* The interfaces carrying properties we track. We subscribe to
+ * PropertiesChanged for each of these individually (as arg0 matches),
+ * so the bus daemon drops changes to any other interface before they
+ * reach us.
+ */
+static const char * const watched_ifaces[] = {
+	VALUE_IFACE,
+	CRIT_IFACE,
+	WARN_IFACE,
+};
+
+struct watch_ctx {
+	sd_bus				*bus;
+	const struct watch_ops		*ops;
+	void				*ops_data;
+	const struct query_config	*config;
+	struct sensor_table		*table;
+	const char			*type;
+	struct watch_sensor		*sensors;
+	unsigned int			n_sensors;
+	unsigned int			scan_idx;
+	/* during the initial scan, signals for sensors whose results are
+	 * still to come */
+	bool				scanning;
+	sd_bus_message			**held;
+	unsigned int			n_held;
+	sd_bus_slot			*match_slots[ARRAY_SIZE(watched_ifaces)];
+
+	/* for --stats */
+	unsigned long			n_wakeups;
+	unsigned long			n_signals;
+};
+
+static int watch_sensor_cmp(const void *a, const void *b)
+{
+	const struct watch_sensor *wa = a, *wb = b;
+
+	return strcmp(wa->desc.object, wb->desc.object);
+}
+
+static int watch_sensor_key_cmp(const void *key, const void *elem)
+{
+	const struct watch_sensor *ws = elem;
+
+	return strcmp(key, ws->desc.object);
+}
+
+static struct watch_sensor *find_watch_sensor(struct watch_sensor *sensors,
+		unsigned int n, const char *path)
+{
+	return bsearch(path, sensors, n, sizeof(*sensors),
+			watch_sensor_key_cmp);
+}
+
+static bool sensor_data_equal(const struct sensor_data *a,
+		const struct sensor_data *b)
+{
+	/* compare value bits, so that a NaN reading doesn't count as a
+	 * change every time */
+	return a->type == b->type && a->scale == b->scale &&
+		!memcmp(&a->value, &b->value, sizeof(a->value)) &&
+		a->lower_crit == b->lower_crit &&
+		a->upper_crit == b->upper_crit &&
+		a->lower_warn == b->lower_warn &&
+		a->upper_warn == b->upper_warn;
+}
+
+static uint64_t epoch_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a sensor's state has been read, or has changed: record it, and tell
+ * the user */
+static void sensor_updated(struct watch_ctx *ctx, struct watch_sensor *ws)
+{
+	if (ctx->config->history)
+		history_record(ctx->config->history, ws - ctx->sensors, ws,
+				epoch_ms());
+
+	if (ctx->ops->updated)
+		ctx->ops->updated(ctx, ws, ctx->ops_data);
+}
+
+static bool watched_iface(const char *iface)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(watched_ifaces); i++)
+		if (!strcmp(iface, watched_ifaces[i]))
+			return true;
+
+	return false;
+}
+
+/* Apply a PropertiesChanged signal to a sensor's state, returning
+ * whether that changed anything.
+ */
+static bool apply_signal(struct watch_sensor *ws, sd_bus_message *m)
+{
+	struct sensor_data tmp;
+	const char *iface;
+	bool value_set;
+	int rc;
+
+	rc = sd_bus_message_read_basic(m, 's', &iface);
+	if (rc < 0 || !watched_iface(iface))
+		return false;
+
+	/* PropertiesChanged carries only the changed properties, so apply
+	 * them on top of the current state */
+	tmp = ws->data;
+	value_set = false;
+	rc = parse_sensor_props(m, &tmp, &value_set);
+	if (rc < 0)
+		return false;
+
+	/* until we have a value, there's nothing to print */
+	if (!ws->valid && !value_set)
+		return false;
+
+	if (ws->valid && sensor_data_equal(&tmp, &ws->data))
+		return false;
+
+	ws->data = tmp;
+	ws->valid = true;
+	return true;
+}
+
+/* The scan engines deliver results in order, so a sensor's reply may
+ * be parsed and held while earlier sensors are still outstanding. A
+ * signal arriving in that time is newer than the held result, so rather
+ * than apply it now, only to have the result overwrite it, we hold the
+ * signal too, and apply it once the result is in.
+ */
+static bool hold_signal(struct watch_ctx *ctx, sd_bus_message *m)
+{
+	sd_bus_message **held;
+
+	held = realloc(ctx->held, (ctx->n_held + 1) * sizeof(*held));
+	if (!held)
+		return false;
+
+	held[ctx->n_held++] = sd_bus_message_ref(m);
+	ctx->held = held;
+	return true;
+}
+
+static void apply_held(struct watch_ctx *ctx, struct watch_sensor *ws)
+{
+	unsigned int i, j;
+
+	for (i = 0, j = 0; i < ctx->n_held; i++) {
+		sd_bus_message *m = ctx->held[i];
+
+		if (strcmp(sd_bus_message_get_path(m), ws->desc.object)) {
+			ctx->held[j++] = m;
+			continue;
+		}
+
+		apply_signal(ws, m);
+		sd_bus_message_unref(m);
+	}
+
+	ctx->n_held = j;
+}
+
+static void drop_held(struct watch_ctx *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->n_held; i++)
+		sd_bus_message_unref(ctx->held[i]);
+	free(ctx->held);
+	ctx->held = NULL;
+	ctx->n_held = 0;
+}
+
+static int properties_changed(sd_bus_message *m, void *data,
+		sd_bus_error *ret_error)
+{
+	struct watch_ctx *ctx = data;
+	struct watch_sensor *ws;
+
+	(void)ret_error;
+
+	ctx->n_signals++;
+
+	ws = find_watch_sensor(ctx->sensors, ctx->n_sensors,
+			sd_bus_message_get_path(m));
+	if (!ws)
+		return 0;
+
+	if (ctx->scanning &&
+			(unsigned int)(ws - ctx->sensors) >= ctx->scan_idx &&
+			hold_signal(ctx, m))
+		return 0;
+
+	if (apply_signal(ws, m))
+		sensor_updated(ctx, ws);
+
+	return 0;
+}
+
+static void scan_result(const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, void *data)
+{
+	struct watch_ctx *ctx = data;
+	struct watch_sensor *ws = &ctx->sensors[ctx->scan_idx++];
+
+	(void)desc;
+
+	ws->data = *sensor;
+	ws->valid = !rc;
+	apply_held(ctx, ws);
+	sensor_updated(ctx, ws);
+}
+
+static void new_result(const struct sensor_desc *desc,
+		struct sensor_data *sensor, int rc, void *data)
+{
+	struct watch_ctx *ctx = data;
+	struct watch_sensor *ws;
+
+	ws = find_watch_sensor(ctx->sensors, ctx->n_sensors, desc->object);
+	if (!ws)
+		return;
+
+	ws->data = *sensor;
+	ws->valid = !rc;
+	sensor_updated(ctx, ws);
+}
+
+/* Query sensors that appeared after the initial scan, as configured for
+ * the scan. We're called from the event loop here, where the async
+ * engines can't run bus processing of their own, so the queries are
+ * synchronous; sensors appear rarely, and few at a time.
+ */
+static void watch_query_new(struct watch_ctx *ctx, const bool *is_new)
+{
+	const struct sensor_desc **descs;
+	struct query_config config;
+	unsigned int i, n;
+
+	descs = calloc(ctx->n_sensors ? ctx->n_sensors : 1, sizeof(*descs));
+	if (!descs)
+		return;
+
+	for (i = 0, n = 0; i < ctx->n_sensors; i++)
+		if (is_new[i])
+			descs[n++] = &ctx->sensors[i].desc;
+
+	config = *ctx->config;
+	config.engine = ENGINE_SYNC;
+	if (n)
+		query_sensors(ctx->bus, &config, descs, n, new_result, ctx);
+
+	free(descs);
+}
+
+/* Build the (sorted) set of watched sensors from the table. On update,
+ * existing sensor state is carried over, new sensors are queried, and
+ * removed sensors are reported.
+ */
+static int watch_build(struct watch_ctx *ctx, bool update)
+{
+	struct watch_sensor *sensors, *old;
+	unsigned int i, n;
+	bool *is_new;
+	int rc;
+
+	sensors = calloc(ctx->table->n_descs ? ctx->table->n_descs : 1,
+			sizeof(*sensors));
+	if (!sensors)
+		return -ENOMEM;
+
+	for (i = 0, n = 0; i < ctx->table->n_descs; i++) {
+		const struct sensor_desc *desc = &ctx->table->descs[i];
+
+		if (!sensor_matches_type(desc, ctx->type))
+			continue;
+
+		sensors[n++].desc = *desc;
+	}
+
+	qsort(sensors, n, sizeof(*sensors), watch_sensor_cmp);
+
+	is_new = calloc(n ? n : 1, sizeof(*is_new));
+	if (!is_new) {
+		free(sensors);
+		return -ENOMEM;
+	}
+
+	if (update) {
+		for (i = 0; i < n; i++) {
+			old = find_watch_sensor(ctx->sensors, ctx->n_sensors,
+					sensors[i].desc.object);
+			if (old && !strcmp(old->desc.service,
+						sensors[i].desc.service)) {
+				sensors[i].data = old->data;
+				sensors[i].valid = old->valid;
+			} else {
+				is_new[i] = true;
+			}
+		}
+
+		for (i = 0; ctx->ops->removed && i < ctx->n_sensors; i++) {
+			old = &ctx->sensors[i];
+			if (!find_watch_sensor(sensors, n, old->desc.object))
+				ctx->ops->removed(ctx, &old->desc,
+						ctx->ops_data);
+		}
+	}
+
+	free(ctx->sensors);
+	ctx->sensors = sensors;
+	ctx->n_sensors = n;
+
+	if (ctx->config->history) {
+		rc = history_layout(ctx->config->history, sensors, n);
+		if (rc < 0)
+			fprintf(stderr, "history: can't record sensors: %s\n",
+					strerror(-rc));
+	}
+
+	if (ctx->ops->changed)
+		ctx->ops->changed(ctx, ctx->ops_data);
+
+	if (update)
+		watch_query_new(ctx, is_new);
+
+	free(is_new);
+	return 0;
+}
+
+static void table_changed(struct sensor_table *table, void *data)
+{
+	struct watch_ctx *ctx = data;
+
+	(void)table;
+
+	watch_build(ctx, true);
+}
+
+/* Updates are reported as they're processed; let the consumer flush
+ * once we've processed everything available, so a piped reader sees
+ * changes promptly without a write per line. Post sources run once per
+ * event loop iteration, so this is also where we count wakeups.
+ */
+static int flush_output(sd_event_source *s, void *data)
+{
+	struct watch_ctx *ctx = data;
+
+	(void)s;
+
+	ctx->n_wakeups++;
+	if (ctx->ops->flush)
+		ctx->ops->flush(ctx, ctx->ops_data);
+	return 0;
+}
+
+/* can type be used as an object path component? */
+static bool type_is_path_element(const char *type)
+{
+	if (!type || !*type)
+		return false;
+
+	for (; *type; type++)
+		if (!isalnum((unsigned char)*type) && *type != '_')
+			return false;
+
+	return true;
+}
+
+/* Subscribe to PropertiesChanged. By default, rules are restricted to
+ * the sensors namespace (narrowed to the type's subtree, if we have
+ * one) and to our interfaces, so the bus daemon filters out unrelated
+ * traffic, rather than waking us for every property change on the
+ * system.
+ */
+static int watch_subscribe(struct watch_ctx *ctx, bool broad)
+{
+	char match[512];
+	unsigned int i;
+	int rc;
+
+	if (broad)
+		return sd_bus_add_match(ctx->bus, &ctx->match_slots[0],
+				"type='signal',"
+				"interface='org.freedesktop.DBus.Properties',"
+				"member='PropertiesChanged'",
+				properties_changed, ctx);
+
+	for (i = 0; i < ARRAY_SIZE(watched_ifaces); i++) {
+		snprintf(match, sizeof(match),
+				"type='signal',"
+				"interface='org.freedesktop.DBus.Properties',"
+				"member='PropertiesChanged',"
+				"path_namespace='%s%s%s',"
+				"arg0='%s'",
+				SENSORS_ROOT,
+				type_is_path_element(ctx->type) ? "/" : "",
+				type_is_path_element(ctx->type) ?
+					ctx->type : "",
+				watched_ifaces[i]);
+
+		rc = sd_bus_add_match(ctx->bus, &ctx->match_slots[i], match,
+				properties_changed, ctx);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const struct watch_sensor *watch_get_sensors(struct watch_ctx *ctx,
+		unsigned int *n)
+{
+	*n = ctx->n_sensors;
+	return ctx->sensors;
+}
+
+int watch_sensors(sd_bus *bus, const struct query_config *config,
+		struct sensor_table *table, const char *type,
+		const struct watch_ops *ops, void *ops_data)
+{
+	const struct sensor_desc **descs = NULL;
+	struct watch_ctx ctx = { 0 };
+	sd_event *event = NULL;
+	uint64_t start, elapsed;
+	unsigned int i;
+	sigset_t mask;
+	int rc;
+
+	ctx.bus = bus;
+	ctx.ops = ops;
+	ctx.ops_data = ops_data;
+	ctx.config = config;
+	ctx.table = table;
+	ctx.type = type;
+
+	/* Subscribe before the initial scan, so that no change between the
+	 * scan and the subscription is lost.
+	 */
+	rc = watch_subscribe(&ctx, config->broad_match);
+	if (rc < 0)
+		goto out;
+
+	rc = watch_build(&ctx, false);
+	if (rc < 0)
+		goto out;
+
+	descs = calloc(ctx.n_sensors ? ctx.n_sensors : 1, sizeof(*descs));
+	if (!descs) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < ctx.n_sensors; i++)
+		descs[i] = &ctx.sensors[i].desc;
+
+	ctx.scanning = true;
+	rc = query_sensors(bus, config, descs, ctx.n_sensors,
+			scan_result, &ctx);
+	ctx.scanning = false;
+	drop_held(&ctx);
+	if (rc < 0)
+		goto out;
+
+	if (ops->flush)
+		ops->flush(&ctx, ops_data);
+
+	/* only discovered tables can be patched; for the compiled-in list,
+	 * the sensor set is fixed */
+	rc = sensor_table_watch(bus, table, table_changed, &ctx);
+	if (rc < 0 && rc != -EINVAL)
+		goto out;
+
+	rc = sd_event_default(&event);
+	if (rc < 0)
+		goto out;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	/* a NULL handler exits the event loop */
+	rc = sd_event_add_signal(event, NULL, SIGINT, NULL, NULL);
+	if (rc < 0)
+		goto out;
+
+	rc = sd_event_add_signal(event, NULL, SIGTERM, NULL, NULL);
+	if (rc < 0)
+		goto out;
+
+	rc = sd_event_add_post(event, NULL, flush_output, &ctx);
+	if (rc < 0)
+		goto out;
+
+	if (ops->setup) {
+		rc = ops->setup(&ctx, event, ops_data);
+		if (rc < 0)
+			goto out;
+	}
+
+	rc = sd_bus_attach_event(bus, event, 0);
+	if (rc < 0)
+		goto out;
+
+	start = now_usec();
+	ctx.n_signals = 0;
+
+	rc = sd_event_loop(event);
+
+	if (config->stats) {
+		elapsed = now_usec() - start;
+		fprintf(stderr, "watch: %lu wakeups, %lu PropertiesChanged "
+				"in %.1fs: %.1f wakeups/min (%s match)\n",
+				ctx.n_wakeups, ctx.n_signals,
+				elapsed / 1e6,
+				ctx.n_wakeups * 60e6 / (elapsed ? elapsed : 1),
+				config->broad_match ? "broad" : "filtered");
+		if (config->history)
+			history_report(config->history);
+	}
+
+out:
+	for (i = 0; i < ARRAY_SIZE(ctx.match_slots); i++)
+		sd_bus_slot_unref(ctx.match_slots[i]);
+	sd_bus_detach_event(bus);
+	sd_event_unref(event);
+	free(descs);
+	free(ctx.sensors);
+	return rc;
+}